@@ -6,9 +6,12 @@
 #include "dragdrop.h"
 #include "err.h"
 #include "ics.h"
+#include "loader.h"
 #include "monthview.h"
 #include "prefview.h"
+#include "readqueue.h"
 #include "setting.h"
+#include "sql.h"
 #include "util.h"
 #include "weekview.h"
 
@@ -46,6 +49,15 @@ Calendari::load(const char* dbname)
   db = new Db(dbname);
   setting = new Setting(*this);
   db->load_calendars();
+  loader = new Loader(*this,dbname);
+  if(loader->running())
+      db->set_loader(loader);
+  read_queue = new ReadQueue(*this,dbname);
+  if(!read_queue->running())
+  {
+    delete read_queue;
+    read_queue = NULL;
+  }
 }
 
 
@@ -135,6 +147,10 @@ Calendari::select(Occurrence* occ)
 {
   if(occ == cut()) // Can't select a cut occurrence.
       occ = NULL;
+  if(occ)
+      occ->pin();
+  if(_selected_occurrence)
+      _selected_occurrence->unpin();
   _selected_occurrence = NULL;
   main_view->select( occ );
   detail_view->select( occ );
@@ -216,18 +232,33 @@ Calendari::import_calendar(bool readonly)
   if(readonly)
   {
     printf("Subscribe to %s\n",filename.c_str());
+    if(read_queue)
+    {
+      read_queue->subscribe(filename.c_str());
+      return;
+    }
     calnum = ics::subscribe(this,filename.c_str(),*db);
   }
   else
   {
     printf("Import %s\n",filename.c_str());
+    if(read_queue)
+    {
+      read_queue->import(filename.c_str());
+      return;
+    }
     calnum = ics::import(this,filename.c_str(),*db);
   }
-  if(calnum<0)
-      return;
+  if(calnum>=0)
+      add_calendar(calnum);
+}
+
+
+void
+Calendari::add_calendar(int calnum)
+{
   Calendar* new_cal = db->load_calendar(calnum);
   assert(new_cal);
-  assert(readonly == new_cal->readonly());
   if(_selected_occurrence)
       select(NULL);
   calendar_list->add_calendar(*new_cal);
@@ -270,16 +301,7 @@ Calendari::delete_selected_calendar(void)
 
   // OK, let the blood flow...
   // Start by clearing the selection, if necessary.
-  if(_clipboard_occurrence &&
-     _clipboard_occurrence->event.calendar().calid == cal->calid)
-  {
-    _clipboard_occurrence = NULL;
-  }
-  if(_selected_occurrence &&
-     _selected_occurrence->event.calendar().calid == cal->calid)
-  {
-    select(NULL);
-  }
+  release(*cal);
   // Remove the Calendar from the cal-list GUI.
   if( !calendar_list->remove_selected_calendar() )
       return; // Bail out if it's somehow not there.
@@ -312,6 +334,26 @@ Calendari::create_event(time_t dtstart, time_t dtend, Event* old)
 }
 
 
+void
+Calendari::release(const Calendar& cal)
+{
+  if(_clipboard_occurrence && _clipboard_occurrence->event.calendar()==cal)
+      _release_clipboard();
+  if(_selected_occurrence && _selected_occurrence->event.calendar()==cal)
+      select(NULL);
+}
+
+
+void
+Calendari::release(const std::set<std::string>& uids)
+{
+  if(_clipboard_occurrence && uids.count(_clipboard_occurrence->event.uid))
+      _release_clipboard();
+  if(_selected_occurrence && uids.count(_selected_occurrence->event.uid))
+      select(NULL);
+}
+
+
 void
 Calendari::erase_selected(void)
 {
@@ -319,10 +361,11 @@ Calendari::erase_selected(void)
   {
     Occurrence* old_selected_occ = NULL;
     std::swap(old_selected_occ,_selected_occurrence);
+    old_selected_occ->unpin();
     if(_clipboard_occurrence == old_selected_occ)
     {
       // forget clipboard
-      _clipboard_occurrence = NULL;
+      _set_clipboard(NULL);
       if(_clipboard_cut)
           queue_main_redraw();
     }
@@ -350,7 +393,7 @@ Calendari::cut_clipboard(void)
         );
     if(ok)
     {
-      _clipboard_occurrence = _selected_occurrence;
+      _set_clipboard(_selected_occurrence);
       _clipboard_cut = true;
       select(NULL);
       queue_main_redraw();
@@ -375,7 +418,7 @@ Calendari::copy_clipboard(void)
         );
     if(ok)
     {
-      _clipboard_occurrence = _selected_occurrence;
+      _set_clipboard(_selected_occurrence);
       _clipboard_cut = false;
     }
   }
@@ -469,11 +512,33 @@ Calendari::clipboard_clear(GtkClipboard* cb, gpointer user_data)
       // The cut occurrence has not been pasted anywhere, so replace it.
       app.queue_main_redraw();
     }
-    app._clipboard_occurrence = NULL;
+    app._set_clipboard(NULL);
   }
 }
 
 
+void
+Calendari::_set_clipboard(Occurrence* occ)
+{
+  if(occ)
+      occ->pin();
+  if(_clipboard_occurrence)
+      _clipboard_occurrence->unpin();
+  _clipboard_occurrence = occ;
+}
+
+
+void
+Calendari::_release_clipboard(void)
+{
+  const bool was_cut = _clipboard_cut;
+  _set_clipboard(NULL);
+  _clipboard_cut = false;
+  if(was_cut)
+      queue_main_redraw(); // Stop showing it greyed out.
+}
+
+
 } // end namespace calendari
 
 
@@ -483,7 +548,9 @@ main(int argc, char* argv[])
   GtkBuilder*  builder;
   GError*  error = NULL;
 
-  // Init GTK+
+  // Init threads (for the Loader), then GTK+
+  if(!g_thread_supported())
+      g_thread_init(NULL);
   gtk_init( &argc, &argv );
   gtk_rc_parse("dot.calrc");
 
@@ -561,5 +628,30 @@ main(int argc, char* argv[])
   // Save settings before we quit.
   app->setting->save();
 
+  if(app->debug)
+  {
+    const calendari::sql::StatementCache& stmts = app->db->statements();
+    const calendari::sql::StatementCache& rstmts = app->db->read_statements();
+    printf("SQL statements: %ld prepared, %ld reused\n",
+        stmts.prepared() + rstmts.prepared(),
+        stmts.reused() + rstmts.reused());
+    calendari::PoolStats evt, occ;
+    app->db->pool_stats(evt,occ);
+    printf("Events: %lu live (peak %lu) in %lu blocks, %lu KB\n",
+        (unsigned long)evt.live,(unsigned long)evt.peak,
+        (unsigned long)evt.blocks,(unsigned long)evt.bytes/1024);
+    printf("Occurrences: %lu live (peak %lu) in %lu blocks, %lu KB\n",
+        (unsigned long)occ.live,(unsigned long)occ.peak,
+        (unsigned long)occ.blocks,(unsigned long)occ.bytes/1024);
+    const size_t occ_bytes = app->db->occurrence_bytes();
+    printf("Occurrences with map & index: %lu KB, %lu bytes each\n",
+        (unsigned long)occ_bytes/1024,
+        (unsigned long)(occ.live? occ_bytes/occ.live: 0));
+    const calendari::VeventCache& vc = app->db->vevent_cache();
+    printf("VEVENT cache: %lu held, %lu KB, %ld hits, %ld misses, "
+        "%ld evicted\n",(unsigned long)vc.size(),
+        (unsigned long)vc.bytes()/1024,vc.hits(),vc.misses(),vc.evictions());
+  }
+
   return 0;
 }
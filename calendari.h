@@ -2,6 +2,8 @@
 #define CALENDARI__CALENDARI_H 1
 
 #include <gtk/gtk.h>
+#include <set>
+#include <string>
 
 #define FORMAT_DATE "%Y-%m-%d"
 #define FORMAT_TIME " %H:%M"
@@ -10,11 +12,14 @@ namespace calendari {
 
 class Db;
 class View;
+class Calendar;
 class CalendarList;
 class DetailView;
 class Event;
+class Loader;
 class Occurrence;
 class PrefView;
+class ReadQueue;
 class Setting;
 
 
@@ -24,6 +29,8 @@ struct Calendari
   // Settings
   bool        debug;
   Db*         db;
+  Loader*     loader;  ///< Reads occurrences in the background.
+  ReadQueue*  read_queue; ///< Reads .ics files in the background, or NULL.
   Setting*    setting;
 
   // Widgets
@@ -67,12 +74,22 @@ struct Calendari
   /** An occurrence moved. */
   void moved(Occurrence* occ);
 
+  /** Let go of the selected and clipboard occurrences if they belong to
+  *   'cal', because its events are about to be destroyed. */
+  void release(const Calendar& cal);
+  /** Let go of the selected and clipboard occurrences if they belong to
+  *   one of these events (by UID). */
+  void release(const std::set<std::string>& uids);
+
   /** Create a new calendar - triggered by UI. */
   void create_calendar(void);
 
   /** Import a new calendar - triggered by UI. */
   void import_calendar(bool readonly = true);
 
+  /** Load and show a calendar that has just been read into the database. */
+  void add_calendar(int calnum);
+
   void delete_selected_calendar(void);
 
   /** Create a new event - triggered by UI. Copy details from 'old', if set. */
@@ -108,6 +125,12 @@ private:
   /** TRUE if _clipboard_occurrence refers to a 'cut' rather than 'copied'
    *  occurrence. ('cut' is displayed as greyed out.) */
   bool        _clipboard_cut;
+
+  /** Set _clipboard_occurrence. The selected and clipboard occurrences are
+  *   pinned, so that Db never evicts them from memory. */
+  void _set_clipboard(Occurrence* occ);
+  /** Let go of the clipboard occurrence, and redraw if it was cut. */
+  void _release_clipboard(void);
 };
 
 
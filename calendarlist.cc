@@ -7,6 +7,7 @@
 #include "event.h"
 #include "ics.h"
 #include "monthview.h"
+#include "readqueue.h"
 #include "util.h"
 
 #include <cassert>
@@ -217,12 +218,27 @@ CalendarList::refresh(calendari::Calendari* app, Calendar* cal)
   {
     if(cal->readonly())
     {
+      // Skip files that haven't changed since they were last read.
+      Fingerprint fp;
+      if(fp.stat(cal->path().c_str()) && fp.same_stat(cal->fingerprint()))
+      {
+        if(app->read_queue)
+            app->read_queue->skipped();
+        return;
+      }
       // ?? Uncomment this line for chatty diagnostics...
       //printf("read %s at %s\n",cal->name().c_str(),cal->path().c_str());
-      if(app->selected() && app->selected()->event.calendar()==*cal)
-          app->select(NULL);
+      if(app->read_queue)
+      {
+        // The ReadQueue calls Db::merge_cal() once the file has been read.
+        app->read_queue->reread(*cal);
+        return;
+      }
+      app->release(*cal);
       ics::reread(app, cal->path().c_str(), *app->db, cal->calid.c_str(), 2);
       app->db->refresh_cal(cal->calnum,2);
+      if(fp.hash_file(cal->path().c_str()))
+          cal->set_fingerprint(fp);
       app->main_view->reload();
       app->queue_main_redraw();
     }
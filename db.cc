@@ -2,13 +2,17 @@
 
 #include "err.h"
 #include "ics.h"
+#include "loader.h"
 #include "queue.h"
 #include "sql.h"
 #include "util.h"
+#include "zblob.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstdarg>
 #include <libical/ical.h>
+#include <limits>
 #include <set>
 
 namespace calendari {
@@ -17,58 +21,282 @@ namespace calendari {
 void
 Version::purge(int calnum)
 {
+  // The database has new content for this calendar.
+  _index.uncover();
+  // The calendar's replacement events may not yet be fully expanded.
+  expanded = EXPANDED_NONE;
+  std::map<int,Calendar*>::iterator c = _calendar.find(calnum);
+  if(c==_calendar.end())
+      return;
+  std::map<int,Arena*>::iterator a = _arena.find(calnum);
+  Arena* arena = (a==_arena.end()? NULL: a->second);
+  // Only visit this calendar's events, and their occurrences.
   typedef std::map<Occurrence::key_type,Occurrence*>::iterator OIt;
-  for(OIt oi =_occurrence.begin(); oi!=_occurrence.end(); )
+  typedef std::set<Event*>::const_iterator EIt;
+  const std::set<Event*>& events = c->second->events();
+
+  // Objects stay in the arena they were made in. Unless events have moved
+  // between calendars, the arena holds exactly this calendar's objects, so
+  // they can be destroyed in place and the arena freed all at once.
+  bool whole = (arena!=NULL);
+  if(arena)
   {
-    OIt o = oi++;
-    if(calnum == o->second->event.calendar().calnum)
+    size_t nevents = 0;
+    size_t noccurrences = 0;
+    for(EIt e=events.begin(); e!=events.end(); ++e)
     {
-      delete o->second;
-      _occurrence.erase(o);
+      if(Pool<Event>::owner(*e)==&arena->events)
+          ++nevents;
+      const int evtnum = (*e)->evtnum;
+      OIt o = _occurrence.lower_bound(
+          Occurrence::key_type(evtnum,std::numeric_limits<time_t>::min()) );
+      for( ; o!=_occurrence.end() && o->first.first==evtnum; ++o)
+          if(Pool<Occurrence>::owner(o->second)==&arena->occurrences)
+              ++noccurrences;
     }
+    whole = (nevents==arena->events.stats().live &&
+             noccurrences==arena->occurrences.stats().live);
   }
-  typedef std::map<std::string,Event*>::iterator EIt;
-  for(EIt ei =_event.begin(); ei!=_event.end(); )
+
+  while(!events.empty())
+  {
+    Event* event = *events.begin();
+    const int evtnum = event->evtnum;
+    OIt o = _occurrence.lower_bound(
+        Occurrence::key_type(evtnum,std::numeric_limits<time_t>::min()) );
+    while(o!=_occurrence.end() && o->first.first==evtnum)
+    {
+      assert(!o->second->pinned()); // See Calendari::release().
+      _index.erase(o->second,o->first.second);
+      if(whole)
+          o->second->~Occurrence();
+      else
+          Pool<Occurrence>::destroy(o->second);
+      _occurrence.erase(o++);
+    }
+    _event.erase(event->uid);
+    // Removes it from 'events'.
+    if(whole)
+        event->~Event();
+    else
+        Pool<Event>::destroy(event);
+  }
+  if(whole)
+  {
+    arena->occurrences.clear();
+    arena->events.clear();
+  }
+  if(arena && arena->empty())
+  {
+    delete arena;
+    _arena.erase(a);
+  }
+}
+
+
+void
+Version::purge_events(const std::set<std::string>& uids)
+{
+  typedef std::map<Occurrence::key_type,Occurrence*>::iterator OIt;
+  typedef std::set<std::string>::const_iterator UIt;
+  for(UIt u=uids.begin(); u!=uids.end(); ++u)
+  {
+    std::map<std::string,Event*>::iterator e = _event.find(*u);
+    if(e==_event.end())
+        continue;
+    const int evtnum = e->second->evtnum;
+    OIt o = _occurrence.lower_bound(
+        Occurrence::key_type(evtnum,std::numeric_limits<time_t>::min()) );
+    while(o!=_occurrence.end() && o->first.first==evtnum)
+    {
+      assert(!o->second->pinned()); // See Calendari::release().
+      _index.erase(o->second,o->first.second);
+      Pool<Occurrence>::destroy(o->second);
+      _occurrence.erase(o++);
+    }
+    Pool<Event>::destroy(e->second);
+    _event.erase(e);
+  }
+  // The database has new occurrences for some of these events.
+  _index.uncover();
+  expanded = EXPANDED_NONE;
+}
+
+
+size_t
+Version::evict(time_t begin, time_t end)
+{
+  std::vector<Occurrence*> evicted;
+  _index.evict(begin,end,evicted);
+  typedef std::map<Occurrence::key_type,Occurrence*>::iterator OIt;
+  std::set<Event*> events;
+  for(size_t i=0; i<evicted.size(); ++i)
   {
-    EIt e = ei++;
-    if(calnum == e->second->calendar().calnum)
+    Occurrence* occ = evicted[i];
+    OIt o = _occurrence.find(occ->key());
+    if(o==_occurrence.end() || o->second!=occ)
+        o = find(occ);
+    if(o!=_occurrence.end())
+        _occurrence.erase(o);
+    events.insert(&occ->event);
+    Pool<Occurrence>::destroy(occ);
+  }
+  // Events are only read along with their occurrences, so an event with
+  // none left can go too.
+  for(std::set<Event*>::iterator e=events.begin(); e!=events.end(); ++e)
+  {
+    if((*e)->ref_count()==0)
     {
-      delete e->second;
-      _event.erase(e);
+      _event.erase((*e)->uid);
+      Pool<Event>::destroy(*e);
     }
   }
+  return evicted.size();
+}
+
+
+std::map<Occurrence::key_type,Occurrence*>::iterator
+Version::find(const Occurrence* occ)
+{
+  // Only look amongst the event's own occurrences.
+  typedef std::map<Occurrence::key_type,Occurrence*>::iterator OIt;
+  const int evtnum = occ->event.evtnum;
+  OIt o = _occurrence.lower_bound(
+      Occurrence::key_type(evtnum,std::numeric_limits<time_t>::min()) );
+  for( ; o!=_occurrence.end() && o->first.first==evtnum; ++o)
+      if(o->second==occ)
+          return o;
+  return _occurrence.end();
 }
 
 
 void
 Version::destroy(void)
 {
+  // Occurrences refer to their events, and events to their calendars.
+  typedef std::map<Occurrence::key_type,Occurrence*>::iterator OIt;
+  for(OIt o =_occurrence.begin(); o!=_occurrence.end(); ++o)
+      Pool<Occurrence>::destroy(o->second);
+  typedef std::map<std::string,Event*>::iterator EIt;
+  for(EIt e =_event.begin(); e!=_event.end(); ++e)
+      Pool<Event>::destroy(e->second);
   typedef std::map<int,Calendar*>::iterator CIt;
   for(CIt c =_calendar.begin(); c!=_calendar.end(); ++c)
       delete c->second;
-  typedef std::map<std::string,Event*>::iterator EIt;
-  for(EIt e =_event.begin(); e!=_event.end(); ++e)
-      delete e->second;
-  typedef std::map<Occurrence::key_type,Occurrence*>::iterator OIt;
-  for(OIt o =_occurrence.begin(); o!=_occurrence.end(); ++o)
-      delete o->second;
+  typedef std::map<int,Arena*>::iterator AIt;
+  for(AIt a =_arena.begin(); a!=_arena.end(); ++a)
+      delete a->second;
+  _arena.clear();
   _calendar.clear();
   _event.clear();
   _occurrence.clear();
+  _index.clear();
+  expanded = EXPANDED_NONE;
+}
+
+
+/** Secondary indexes. */
+struct { const char* name; const char* sql; } const index_sql[] = {
+  { "EVT_NUM_INDEX",
+    "create index if not exists EVT_NUM_INDEX on EVENT(EVTNUM,VERSION)" },
+  { "EVT_CAL_INDEX",
+    "create index if not exists EVT_CAL_INDEX on EVENT(VERSION,CALNUM)" },
+  { "OCC_CAL_INDEX",
+    "create index if not exists OCC_CAL_INDEX on OCCURRENCE(VERSION,CALNUM)" },
+  { "OCC_START_INDEX",
+    "create index if not exists OCC_START_INDEX on OCCURRENCE(DTSTART)" },
+  { "OCC_END_INDEX",
+    "create index if not exists OCC_END_INDEX on OCCURRENCE(DTEND)" }
+};
+
+
+// R*Tree rejects intervals that end before they start.
+const char* const rtree_insert_sql =
+    "create trigger OCC_RTREE_INSERT after insert on OCCURRENCE begin "
+      "insert into OCC_RTREE values (new.rowid,"
+        "min(new.DTSTART,new.DTEND),max(new.DTSTART,new.DTEND)); "
+    "end";
+
+
+// OCC_RTREE holds 32-bit floats, rounded outwards, so it finds a superset of
+// the occurrences. The exact test is repeated against OCCURRENCE.
+const char* const OccurrenceRow::find_sql =
+    "select O.CALNUM,O.EVTNUM,E.UID,SUMMARY,SEQUENCE,ALLDAY,"
+        "E.RECURS,O.DTSTART,O.DTEND,O.RECURS "
+    "from OCC_RTREE R "
+    "cross join OCCURRENCE O on O.rowid=R.ID "
+    "left join EVENT E on E.EVTNUM=O.EVTNUM and E.VERSION=O.VERSION "
+    "where R.DTEND>=?1 and R.DTSTART<?2 "
+      "and O.DTEND>=?1 and O.DTSTART<?2 and O.VERSION=?3 "
+    "order by O.DTSTART";
+
+
+const char* const OccurrenceRow::scan_sql =
+    "select O.CALNUM,O.EVTNUM,E.UID,SUMMARY,SEQUENCE,ALLDAY,"
+        "E.RECURS,DTSTART,DTEND,O.RECURS "
+    "from OCCURRENCE O "
+    "left join EVENT E on E.EVTNUM=O.EVTNUM and E.VERSION=O.VERSION "
+    "where DTEND>=?1 and DTSTART<?2 and O.VERSION=?3 "
+    "order by DTSTART";
+
+
+void
+OccurrenceRow::read(sqlite3_stmt* select_stmt)
+{
+  calnum     =           ::sqlite3_column_int( select_stmt,0);
+  evtnum     =           ::sqlite3_column_int( select_stmt,1);
+  uid        =   safestr(::sqlite3_column_text(select_stmt,2));
+  summary    =   safestr(::sqlite3_column_text(select_stmt,3));
+  sequence   =           ::sqlite3_column_int( select_stmt,4);
+  all_day    =           ::sqlite3_column_int( select_stmt,5);
+  evt_recurs = int2recur(::sqlite3_column_int( select_stmt,6));
+  dtstart    =           ::sqlite3_column_int( select_stmt,7);
+  dtend      =           ::sqlite3_column_int( select_stmt,8);
+  occ_recurs = int2recur(::sqlite3_column_int( select_stmt,9));
 }
 
 
 Db::Db(const char* dbname)
+  : _sdb(NULL),
+    _stmts(NULL),
+    _rdb(NULL),
+    _rstmts(NULL),
+    _loader(NULL),
+    _serial(0),
+    _rtree(false),
+    _evtnum(0),
+    _vevents(VEVENT_CACHE_BYTES),
+    _resident_periods(RESIDENT_PERIODS),
+    _evict_at(RESIDENT_MIN),
+    _windows_size(0)
 {
   if( SQLITE_OK != ::sqlite3_open(dbname,&_sdb) )
       CALI_ERRO(1,0,"Failed to open database %s",dbname);
+  // The ReadQueue may hold the write lock.
+  ::sqlite3_busy_timeout(_sdb,sql::BUSY_TIMEOUT);
+  // Write-ahead logging lets readers carry on while another connection
+  // commits. The setting is stored in the database file.
+  sql::exec(CALI_HERE,_sdb,"pragma journal_mode=WAL");
+  sql::exec(CALI_HERE,_sdb,"pragma synchronous=NORMAL");
+  _stmts = new sql::StatementCache(_sdb);
   Queue::inst().set_db( this );
   create_db(); // ?? Wasteful to do this if not needed?
+
+  if( SQLITE_OK != ::sqlite3_open_v2(dbname,&_rdb,SQLITE_OPEN_READONLY,NULL) )
+      CALI_ERRO(1,0,"Failed to open database %s",dbname);
+  // Only needed if WAL is not available.
+  ::sqlite3_busy_timeout(_rdb,sql::BUSY_TIMEOUT);
+  _rstmts = new sql::StatementCache(_rdb);
 }
 
 
 Db::~Db(void)
 {
+  // Finalize statements before closing the database.
+  delete _rstmts;
+  if(_rdb)
+      ::sqlite3_close(_rdb);
+  delete _stmts;
   if(_sdb)
       ::sqlite3_close(_sdb);
   for(std::map<int,Version>::iterator v=_ver.begin(); v!=_ver.end(); ++v)
@@ -93,37 +321,64 @@ Db::create_db(void)
       "  POSITION integer," // ordering within the UI's calendar list.
       "  COLOUR   string,"
       "  SHOW     boolean,"
+      "  MTIME    integer," // Fingerprint of the file, when last read.
+      "  SIZE     integer,"
+      "  HASH     integer," // fnv1a() of the file's contents.
       "  primary key(VERSION,CALID)"
       ")"
     );
+  // Calendars without a fingerprint are read the next time they're refreshed.
+  if(!sql::has_column(CALI_HERE,_sdb,"CALENDAR","MTIME"))
+  {
+    sql::exec(CALI_HERE,_sdb,"alter table CALENDAR add column MTIME integer");
+    sql::exec(CALI_HERE,_sdb,"alter table CALENDAR add column SIZE integer");
+    sql::exec(CALI_HERE,_sdb,"alter table CALENDAR add column HASH integer");
+  }
   sql::exec(CALI_HERE,_sdb,
       "create table if not exists EVENT ("
       "  VERSION  integer,"
       "  CALNUM   integer,"
       "  UID      string,"
+      "  EVTNUM   integer," // Surrogate key for UID, used by OCCURRENCE.
       "  SUMMARY  string,"
       "  SEQUENCE integer,"
       "  ALLDAY   boolean,"
       "  RECURS   integer," // Summarises all recurrence rules.
-      "  VEVENT   blob,"
+      "  VEVENT   blob," // zblob_pack()ed iCalendar text.
+      "  EXPANDED integer," // OCCURRENCEs exist up to this time_t.
+      "  HASH     integer," // fnv1a(VEVENT), to spot changes when re-reading.
       "  primary key(VERSION,UID)"
       ")"
     );
+  // Older databases hold every occurrence, so leave EXPANDED null for them.
+  if(!sql::has_column(CALI_HERE,_sdb,"EVENT","EXPANDED"))
+      sql::exec(CALI_HERE,_sdb,"alter table EVENT add column EXPANDED integer");
+  // Events with a null HASH are re-written the next time they are re-read.
+  if(!sql::has_column(CALI_HERE,_sdb,"EVENT","HASH"))
+      sql::exec(CALI_HERE,_sdb,"alter table EVENT add column HASH integer");
+  if(!sql::has_column(CALI_HERE,_sdb,"EVENT","EVTNUM"))
+  {
+    sql::exec(CALI_HERE,_sdb,"alter table EVENT add column EVTNUM integer");
+    sql::exec(CALI_HERE,_sdb,"update EVENT set EVTNUM=rowid");
+  }
+  sql::exec(CALI_HERE,_sdb,index_sql[0].sql);
+  // Older databases repeat each event's UID in every OCCURRENCE row.
+  if(sql::has_column(CALI_HERE,_sdb,"OCCURRENCE","UID"))
+      _upgrade_occurrence();
   sql::exec(CALI_HERE,_sdb,
       "create table if not exists OCCURRENCE ("
       "  VERSION  integer,"
       "  CALNUM   integer,"
-      "  UID      string,"
+      "  EVTNUM   integer," // EVENT.EVTNUM
       "  DTSTART  integer," // time_t (need to allow for 'all-day')
       "  DTEND    integer," // time_t
       "  RECURS   integer," // The recurrence rule that made this occurrence.
-      "  primary key(VERSION,UID,DTSTART)"
+      "  primary key(VERSION,EVTNUM,DTSTART)"
       ")"
     );
-  sql::exec(CALI_HERE,_sdb,
-      "create index if not exists OCC_START_INDEX on OCCURRENCE(DTSTART)");
-  sql::exec(CALI_HERE,_sdb,
-      "create index if not exists OCC_END_INDEX on OCCURRENCE(DTEND)");
+  for(size_t i=1; i<sizeof(index_sql)/sizeof(index_sql[0]); ++i)
+      sql::exec(CALI_HERE,_sdb,index_sql[i].sql);
+  _rtree = _create_rtree();
   /*
   -- Find all occurances between two times.
   select O.UID,DTSTART,DTEND,SUMMARY,COLOUR
@@ -151,25 +406,58 @@ Db::create_db(void)
       "  primary key(KEY)"
       ")"
     );
+  // Older databases hold plain VEVENT text. Compress it, once.
+  int packed = 0;
+  sql::query_val(CALI_HERE,_sdb,packed,
+      "select count(0) from SETTING where KEY='zblob'");
+  if(!packed)
+  {
+    zblob_register(_sdb);
+    sql::exec(CALI_HERE,_sdb,"begin");
+    try
+    {
+      sql::execf(CALI_HERE,_sdb,
+          "update EVENT set VEVENT=zblob_pack(VEVENT) "
+          "where typeof(VEVENT)='text' and length(VEVENT)>=%d",
+          int(ZBLOB_MIN));
+      sql::exec(CALI_HERE,_sdb,
+          "insert into SETTING (KEY,VALUE) values ('zblob','1')");
+      sql::exec(CALI_HERE,_sdb,"commit");
+    }
+    catch(...)
+    {
+      try{ sql::exec(CALI_HERE,_sdb,"rollback"); } catch(...) {}
+      throw;
+    }
+  }
 }
 
 
-void
+bool
 Db::refresh_cal(int calnum, int from_version, int to_version)
 {
-  sql::exec(CALI_HERE,_sdb,"begin");
+  if(!sql::try_begin(CALI_HERE,_sdb))
+      return false;
   try
   {
     // Ensure that UID is unique
     // ?? should look at SEQUENCE to decide which event to keep.
+    // Separate deletes, so that each one can use an index.
+    sql::execf(CALI_HERE,_sdb,
+        "delete from OCCURRENCE where VERSION=%d and CALNUM=%d",
+        to_version,calnum);
     sql::execf(CALI_HERE,_sdb,
-        "delete from OCCURRENCE where VERSION=%d and( CALNUM=%d or "
-          "UID in (select UID from EVENT where VERSION=%d) )",
-        to_version,calnum,from_version);
+        "delete from OCCURRENCE where VERSION=%d and "
+          "EVTNUM in (select EVTNUM from EVENT where VERSION=%d and "
+            "UID in (select UID from EVENT where VERSION=%d))",
+        to_version,to_version,from_version);
     sql::execf(CALI_HERE,_sdb,
-        "delete from EVENT where VERSION=%d and( CALNUM=%d or "
-          "UID in (select UID from EVENT where VERSION=%d) )",
-        to_version,calnum,from_version);
+        "delete from EVENT where VERSION=%d and CALNUM=%d",
+        to_version,calnum);
+    sql::execf(CALI_HERE,_sdb,
+        "delete from EVENT where VERSION=%d and "
+          "UID in (select UID from EVENT where VERSION=%d)",
+        to_version,from_version);
     sql::execf(CALI_HERE,_sdb,
         "update OCCURRENCE set VERSION=%d where VERSION=%d",
         to_version,from_version);
@@ -180,12 +468,190 @@ Db::refresh_cal(int calnum, int from_version, int to_version)
         "delete from CALENDAR where VERSION=%d",from_version);
     sql::exec(CALI_HERE,_sdb,"commit");
     _ver[to_version].purge(calnum);
+    ++_serial;
+    _forget_windows();
+  }
+  catch(...)
+  {
+    try{ sql::exec(CALI_HERE,_sdb,"rollback"); } catch(...) {}
+    throw;
+  }
+  return true;
+}
+
+
+void
+Db::staged_uids(int version, std::set<std::string>& uids)
+{
+  const char* sql = "select UID from EVENT where VERSION=?";
+  sql::CachedStatement select_evt(CALI_HERE,*_rstmts,sql);
+  sql::bind_int(CALI_HERE,_rdb,select_evt,1,version);
+  while(true)
+  {
+    int return_code = ::sqlite3_step(select_evt);
+    if(return_code==SQLITE_ROW)
+    {
+      uids.insert(safestr(::sqlite3_column_text(select_evt,0)));
+    }
+    else
+    {
+      if(return_code!=SQLITE_DONE)
+          calendari::sql::error(CALI_HERE,_rdb);
+      break;
+    }
+  }
+}
+
+
+bool
+Db::merge_cal(
+    int                           from_version,
+    const std::set<std::string>&  uids,
+    int                           to_version
+  )
+{
+  if(!sql::try_begin(CALI_HERE,_sdb))
+      return false;
+  try
+  {
+    if(!uids.empty())
+    {
+      // Ensure that UID is unique
+      const char* sql =
+          "delete from OCCURRENCE where VERSION=?1 and EVTNUM in "
+            "(select EVTNUM from EVENT where VERSION=?1 and UID=?2)";
+      sql::CachedStatement delete_occ(CALI_HERE,*_stmts,sql);
+      sql = "delete from EVENT where VERSION=? and UID=?";
+      sql::CachedStatement delete_evt(CALI_HERE,*_stmts,sql);
+      typedef std::set<std::string>::const_iterator UIt;
+      for(UIt u=uids.begin(); u!=uids.end(); ++u)
+      {
+        sql::bind_int( CALI_HERE,_sdb,delete_occ,1,to_version);
+        sql::bind_text(CALI_HERE,_sdb,delete_occ,2,u->c_str());
+        sql::step_reset(CALI_HERE,_sdb,delete_occ);
+        sql::bind_int( CALI_HERE,_sdb,delete_evt,1,to_version);
+        sql::bind_text(CALI_HERE,_sdb,delete_evt,2,u->c_str());
+        sql::step_reset(CALI_HERE,_sdb,delete_evt);
+      }
+      sql::execf(CALI_HERE,_sdb,
+          "update OCCURRENCE set VERSION=%d where VERSION=%d",
+          to_version,from_version);
+      sql::execf(CALI_HERE,_sdb,
+          "update EVENT set VERSION=%d where VERSION=%d",
+          to_version,from_version);
+    }
+    sql::execf(CALI_HERE,_sdb,
+        "delete from CALENDAR where VERSION=%d",from_version);
+    sql::exec(CALI_HERE,_sdb,"commit");
   }
   catch(...)
   {
     try{ sql::exec(CALI_HERE,_sdb,"rollback"); } catch(...) {}
     throw;
   }
+  if(!uids.empty())
+  {
+    _ver[to_version].purge_events(uids);
+    ++_serial;
+    _forget_windows();
+  }
+  return true;
+}
+
+
+void
+Db::pool_stats(PoolStats& events, PoolStats& occurrences) const
+{
+  typedef std::map<int,Version>::const_iterator VIt;
+  typedef std::map<int,Version::Arena*>::const_iterator AIt;
+  for(VIt v=_ver.begin(); v!=_ver.end(); ++v)
+  {
+    for(AIt a=v->second._arena.begin(); a!=v->second._arena.end(); ++a)
+    {
+      events      += a->second->events.stats();
+      occurrences += a->second->occurrences.stats();
+    }
+  }
+}
+
+
+size_t
+Db::occurrence_bytes(void) const
+{
+  // A red-black tree node holds its colour & three pointers, and the value.
+  typedef std::map<Occurrence::key_type,Occurrence*>::value_type Value;
+  const size_t node_bytes = 4*sizeof(void*) + sizeof(Value);
+  PoolStats events, occurrences;
+  pool_stats(events,occurrences);
+  size_t result = occurrences.bytes;
+  typedef std::map<int,Version>::const_iterator VIt;
+  for(VIt v=_ver.begin(); v!=_ver.end(); ++v)
+  {
+    result += v->second._occurrence.size() * node_bytes;
+    result += v->second._index.bytes();
+  }
+  return result;
+}
+
+
+void
+Db::begin_bulk(sqlite3* sdb)
+{
+  sql::exec(CALI_HERE,sdb,"drop table if exists temp.BULK_EVENT");
+  sql::exec(CALI_HERE,sdb,"drop table if exists temp.BULK_OCCURRENCE");
+  sql::exec(CALI_HERE,sdb,
+      "create temp table BULK_EVENT as select * from EVENT where 0");
+  sql::exec(CALI_HERE,sdb,
+      "create temp table BULK_OCCURRENCE as select * from OCCURRENCE where 0");
+}
+
+
+void
+Db::end_bulk(sqlite3* sdb)
+{
+  // Rebuilding an index reads the whole table, so it only beats updating
+  // the index row by row when the load at least doubles the table.
+  int old_rows = 0;
+  int new_rows = 0;
+  sql::query_val(CALI_HERE,sdb,old_rows,"select count(0) from OCCURRENCE");
+  sql::query_val(CALI_HERE,sdb,new_rows,
+      "select count(0) from temp.BULK_OCCURRENCE");
+  const bool rebuild = (new_rows >= 2*old_rows);
+  const size_t num_indexes = sizeof(index_sql)/sizeof(index_sql[0]);
+  int rtree = 0;
+  int max_rowid = 0;
+  if(rebuild)
+  {
+    for(size_t i=0; i<num_indexes; ++i)
+        sql::execf(CALI_HERE,sdb,"drop index %s",index_sql[i].name);
+    sql::query_val(CALI_HERE,sdb,rtree,
+        "select count(0) from sqlite_master where name='OCC_RTREE_INSERT'");
+    if(rtree)
+        sql::exec(CALI_HERE,sdb,"drop trigger OCC_RTREE_INSERT");
+    sql::query_val(CALI_HERE,sdb,max_rowid,
+        "select coalesce(max(rowid),0) from OCCURRENCE");
+  }
+  sql::exec(CALI_HERE,sdb,
+      "insert into EVENT select * from temp.BULK_EVENT order by VERSION,UID");
+  sql::exec(CALI_HERE,sdb,
+      "insert into OCCURRENCE select * from temp.BULK_OCCURRENCE "
+      "order by VERSION,EVTNUM,DTSTART");
+  if(rebuild)
+  {
+    for(size_t i=0; i<num_indexes; ++i)
+        sql::exec(CALI_HERE,sdb,index_sql[i].sql);
+    if(rtree)
+    {
+      // Only the new rows need to go into OCC_RTREE.
+      sql::execf(CALI_HERE,sdb,
+          "insert into OCC_RTREE select rowid,"
+            "min(DTSTART,DTEND),max(DTSTART,DTEND) "
+          "from OCCURRENCE where rowid>%d",max_rowid);
+      sql::exec(CALI_HERE,sdb,rtree_insert_sql);
+    }
+  }
+  sql::exec(CALI_HERE,sdb,"drop table temp.BULK_EVENT");
+  sql::exec(CALI_HERE,sdb,"drop table temp.BULK_OCCURRENCE");
 }
 
 
@@ -193,12 +659,13 @@ void
 Db::load_calendars(int version)
 {
   const char* sql =
-      "select CALID,CALNUM,CALNAME,PATH,READONLY,POSITION,COLOUR,SHOW "
+      "select CALID,CALNUM,CALNAME,PATH,READONLY,POSITION,COLOUR,SHOW,"
+        "coalesce(MTIME,0),coalesce(SIZE,-1),coalesce(HASH,0) "
       "from CALENDAR "
       "where VERSION=? "
       "order by POSITION";
-  sql::Statement select_stmt(CALI_HERE,_sdb,sql);
-  sql::bind_int(CALI_HERE,_sdb,select_stmt,1,version);
+  sql::CachedStatement select_stmt(CALI_HERE,*_rstmts,sql);
+  sql::bind_int(CALI_HERE,_rdb,select_stmt,1,version);
   _load_calendars(select_stmt,version);
 }
 
@@ -207,20 +674,27 @@ Calendar*
 Db::load_calendar(int calnum, int version)
 {
   const char* sql =
-      "select CALID,CALNUM,CALNAME,PATH,READONLY,POSITION,COLOUR,SHOW "
+      "select CALID,CALNUM,CALNAME,PATH,READONLY,POSITION,COLOUR,SHOW,"
+        "coalesce(MTIME,0),coalesce(SIZE,-1),coalesce(HASH,0) "
       "from CALENDAR "
       "where VERSION=? and CALNUM=? "
       "order by POSITION";
-  sql::Statement select_stmt(CALI_HERE,_sdb,sql);
-  sql::bind_int(CALI_HERE,_sdb,select_stmt,1,version);
-  sql::bind_int(CALI_HERE,_sdb,select_stmt,2,calnum);
+  sql::CachedStatement select_stmt(CALI_HERE,*_rstmts,sql);
+  sql::bind_int(CALI_HERE,_rdb,select_stmt,1,version);
+  sql::bind_int(CALI_HERE,_rdb,select_stmt,2,calnum);
   _load_calendars(select_stmt,version);
+  // The new calendar's recurring events have only been partially expanded,
+  // and none of its occurrences are in memory yet.
+  _ver[version].expanded = EXPANDED_NONE;
+  _ver[version]._index.uncover();
+  ++_serial;
+  _forget_windows();
   return calendar(calnum);
 }
 
 
 void
-Db::_load_calendars(sql::Statement& select_stmt, int version)
+Db::_load_calendars(sqlite3_stmt* select_stmt, int version)
 {
   Version& ver = _ver[version];
   while(true)
@@ -238,6 +712,9 @@ Db::_load_calendars(sql::Statement& select_stmt, int version)
           safestr(::sqlite3_column_text(select_stmt,6)), // colour
                   ::sqlite3_column_int( select_stmt,7)   // show
         );
+      cal->_fingerprint.mtime = ::sqlite3_column_int64(select_stmt,8);
+      cal->_fingerprint.size  = ::sqlite3_column_int64(select_stmt,9);
+      cal->_fingerprint.hash  = ::sqlite3_column_int64(select_stmt,10);
       ver._calendar.insert(std::make_pair(cal->calnum,cal));
     }
     else if(return_code==SQLITE_DONE)
@@ -246,7 +723,7 @@ Db::_load_calendars(sql::Statement& select_stmt, int version)
     }
     else
     {
-      calendari::sql::error(CALI_HERE,_sdb);
+      calendari::sql::error(CALI_HERE,_rdb);
       break;
     }
   }
@@ -257,37 +734,48 @@ std::multimap<time_t,Occurrence*>
 Db::find(time_t begin, time_t end, int version)
 {
   std::multimap<time_t,Occurrence*> result;
+  if(_find_window(begin,end,version,result))
+      return result;
+  _evict(begin,end,version);
 
-  const char* sql =
-      "select O.CALNUM,O.UID,SUMMARY,SEQUENCE,ALLDAY,"
-          "E.RECURS,DTSTART,DTEND,O.RECURS "
-      "from OCCURRENCE O "
-      "left join EVENT E on E.UID=O.UID and E.VERSION=O.VERSION "
-      "where DTEND>=? and DTSTART<? and O.VERSION=? "
-      "order by DTSTART";
-  sql::Statement select_stmt(CALI_HERE,_sdb,sql);
-  sql::bind_int64(CALI_HERE,_sdb,select_stmt,1,begin);
-  sql::bind_int64(CALI_HERE,_sdb,select_stmt,2,end);
-  sql::bind_int(  CALI_HERE,_sdb,select_stmt,3,version);
+  // The background loader expands recurring events itself. Without one, if
+  // they can't be expanded yet, then read what we can from the database, but
+  // don't remember the period as complete.
+  Version& ver = _ver[version];
+  const bool expanded = (_loader? end<=ver.expanded: _expand(end,version));
+
+  // Serve the query from memory, if we've already loaded the whole period.
+  if(expanded && ver._index.covers(begin,end))
+  {
+    ver._index.find(begin,end,result);
+    _add_window(begin,end,version,result);
+    return result;
+  }
+
+  // Let the background loader expand and read the period from the database.
+  // Meanwhile, make do with what we already have.
+  if(_loader)
+  {
+    _loader->request(begin,end,version,_horizon(end,version));
+    ver._index.find(begin,end,result);
+    return result;
+  }
+
+  sql::CachedStatement select_stmt(CALI_HERE,*_rstmts,find_sql());
+  sql::bind_int64(CALI_HERE,_rdb,select_stmt,1,begin);
+  sql::bind_int64(CALI_HERE,_rdb,select_stmt,2,end);
+  sql::bind_int(  CALI_HERE,_rdb,select_stmt,3,version);
 
+  OccurrenceRow row;
   while(true)
   {
     int return_code = ::sqlite3_step(select_stmt);
     if(return_code==SQLITE_ROW)
     {
-      Occurrence* occ = make_occurrence(
-                  ::sqlite3_column_int( select_stmt,0),  // calnum
-          safestr(::sqlite3_column_text(select_stmt,1)), // uid
-          safestr(::sqlite3_column_text(select_stmt,2)), // summary
-                  ::sqlite3_column_int( select_stmt,3),  // sequence
-                  ::sqlite3_column_int( select_stmt,4),  // all_day
-        int2recur(::sqlite3_column_int( select_stmt,5)), // event recurs
-                  ::sqlite3_column_int( select_stmt,6),  // dtstart
-                  ::sqlite3_column_int( select_stmt,7),  // dtend
-        int2recur(::sqlite3_column_int( select_stmt,8)), // occ recurs
-          version
-        );
-      result.insert(std::make_pair(occ->dtstart(),occ));
+      row.read(select_stmt);
+      Occurrence* occ = make_occurrence(row,version);
+      if(occ)
+          result.insert(std::make_pair(occ->dtstart(),occ));
     }
     else if(return_code==SQLITE_DONE)
     {
@@ -295,14 +783,70 @@ Db::find(time_t begin, time_t end, int version)
     }
     else
     {
-      calendari::sql::error(CALI_HERE,_sdb);
-      break;
+      calendari::sql::error(CALI_HERE,_rdb);
+      return result;
     }
   }
+  if(expanded)
+  {
+    ver._index.cover(begin,end);
+    _add_window(begin,end,version,result);
+  }
   return result;
 }
 
 
+void
+Db::prefetch(
+    const std::vector< std::pair<time_t,time_t> >&  periods,
+    int                                             version
+  )
+{
+  if(!_loader)
+      return;
+  Version& ver = _ver[version];
+  std::vector< std::pair<time_t,time_t> > missing;
+  time_t last = EXPANDED_NONE;
+  typedef std::vector< std::pair<time_t,time_t> >::const_iterator PIt;
+  for(PIt p=periods.begin(); p!=periods.end(); ++p)
+  {
+    if(!ver._index.covers(p->first,p->second))
+    {
+      missing.push_back(*p);
+      last = std::max(last,p->second);
+    }
+  }
+  _loader->prefetch(missing,version,_horizon(last,version));
+}
+
+
+void
+Db::expanded(time_t horizon, int version)
+{
+  Version& ver = _ver[version];
+  if(horizon > ver.expanded)
+      ver.expanded = horizon;
+}
+
+
+void
+Db::loaded(
+    time_t                             begin,
+    time_t                             end,
+    const std::vector<OccurrenceRow>&  rows,
+    int                                version
+  )
+{
+  typedef std::vector<OccurrenceRow>::const_iterator RIt;
+  for(RIt r=rows.begin(); r!=rows.end(); ++r)
+      make_occurrence(*r,version);
+  // The period is only complete if recurring events had been expanded.
+  Version& ver = _ver[version];
+  if(end <= ver.expanded)
+      ver._index.cover(begin,end);
+}
+
+
 int
 Db::calnum(const char* calid)
 {
@@ -318,24 +862,37 @@ Db::calnum(const char* calid)
 
   // Look it up in the database, then.
   // ?? SQL begin..commit here - but it would sometimes be re-entrant :(
+  return calnum(_rdb,calid);
+}
+
+
+int
+Db::calnum(sqlite3* sdb, const char* calid)
+{
+  assert(calid);
   int calnum =1;
-  std::string sql_calid = sql::quote(calid);
-  bool ok =
-    sql::query_val(
-        CALI_HERE,_sdb,
-        calnum,                                  // <== output
-        "select CALNUM from CALENDAR where CALID='%s' order by VERSION",
-        sql_calid.c_str()
-      );
-  if(!ok)
+  const char* sql =
+      "select CALNUM from CALENDAR where CALID=? order by VERSION";
+  sql::Statement select_stmt(CALI_HERE,sdb,sql);
+  sql::bind_text(CALI_HERE,sdb,select_stmt,1,calid,-1);
+  int return_code = ::sqlite3_step(select_stmt);
+  if(return_code==SQLITE_ROW)
+  {
+    calnum = ::sqlite3_column_int(select_stmt,0);
+  }
+  else if(return_code==SQLITE_DONE)
   {
     // ...well find the next free number, then.
     sql::query_val(
-        CALI_HERE,_sdb,
+        CALI_HERE,sdb,
         calnum,                                  // <== output
         "select 1 + coalesce(max(CALNUM),0) from CALENDAR"
       );
   }
+  else
+  {
+    calendari::sql::error(CALI_HERE,sdb);
+  }
   return calnum;
 }
 
@@ -400,6 +957,8 @@ Db::erase_calendar(Calendar* cal)
     _ver[cal->version].purge(cal->calnum);
     _ver[cal->version]._calendar.erase(cal->calnum);
     delete cal;
+    ++_serial;
+    _forget_windows();
   }
   catch(...)
   {
@@ -423,6 +982,7 @@ Db::create_event(
   Occurrence* occ =
     make_occurrence(
         calnum,
+        _next_evtnum(),
         uid,
         summary,
         1, // sequence
@@ -440,29 +1000,61 @@ Db::create_event(
 
 
 icalcomponent*
-Db::vevent(const char* uid, int version)
+Db::vevent(const Event& event)
+{
+  icalcomponent* vevent = _vevents.find(&event);
+  if(vevent)
+      return vevent;
+  size_t bytes = 0;
+  vevent = _read_vevent(event.uid.c_str(),event.calendar().version,bytes);
+  if(!vevent)
+      return NULL;
+  _vevents.insert(&event,vevent,bytes);
+  // Keeps the entry just inserted. Changes that have been evicted are read
+  // back from the Queue until it has written them.
+  _vevents.trim();
+  return vevent;
+}
+
+
+icalcomponent*
+Db::_read_vevent(const char* uid, int version, size_t& bytes)
 {
   // Read in VEVENTS from the database...
   const char* sql = "select VEVENT from EVENT where VERSION=? and UID=?";
-  sql::Statement select_evt(CALI_HERE,_sdb,sql);
-  sql::bind_int( CALI_HERE,_sdb,select_evt,1,version);
-  sql::bind_text(CALI_HERE,_sdb,select_evt,2,uid,-1);
+  sql::CachedStatement select_evt(CALI_HERE,*_rstmts,sql);
+  sql::bind_int( CALI_HERE,_rdb,select_evt,1,version);
+  sql::bind_text(CALI_HERE,_rdb,select_evt,2,uid,-1);
 
-  const char* veventz =NULL;
-  int return_code = ::sqlite3_step(select_evt);
-  if(return_code==SQLITE_ROW)
+  std::string veventz;
+  // A changed VEVENT may not have been written yet.
+  std::vector<Queue::Column> key;
+  key.push_back(Queue::Column("VERSION",version));
+  key.push_back(Queue::Column("UID",uid));
+  const sql::Value* queued =NULL;
+  switch(Queue::inst().pending("EVENT",key,"VEVENT",queued))
   {
-    veventz = safestr(::sqlite3_column_text(select_evt,0));
-  }
-  else if(return_code!=SQLITE_DONE)
-  {
-    calendari::sql::error(CALI_HERE,_sdb);
+    case Queue::QUEUED:
+      zblob_unpack(queued->text().data(),queued->text().size(),veventz);
+      break;
+    case Queue::DELETED:
+      break; // As if there were no row.
+    case Queue::NOT_QUEUED:
+    {
+      int return_code = ::sqlite3_step(select_evt);
+      if(return_code==SQLITE_ROW)
+          zblob_column(select_evt,0,veventz);
+      else if(return_code!=SQLITE_DONE)
+          calendari::sql::error(CALI_HERE,_rdb);
+      break;
+    }
   }
 
+  bytes = veventz.size();
   icalcomponent* vevent =NULL;
-  if(veventz && veventz[0])
+  if(!veventz.empty())
   {
-    vevent = icalparser_parse_string(veventz);
+    vevent = icalparser_parse_string(veventz.c_str());
     // ?? Check for error.
   }
   else
@@ -477,8 +1069,18 @@ void
 Db::moved(Occurrence* occ, int version)
 {
   Version& ver = _ver[version];
-  ver._occurrence.erase( occ->key() );
-  ver._occurrence[ occ->rekey() ] = occ;
+  // The occurrence's start time may have changed since it was filed.
+  typedef std::map<Occurrence::key_type,Occurrence*>::iterator OIt;
+  OIt o = ver.find(occ);
+  if(o!=ver._occurrence.end())
+  {
+    ver._index.erase(occ,o->first.second);
+    ver._occurrence.erase(o);
+  }
+  ver._index.insert(occ);
+  ver._occurrence[ occ->key() ] = occ;
+  ++_serial;
+  _forget_windows();
 }
 
 
@@ -486,16 +1088,43 @@ void
 Db::erase(Occurrence* occ, int version)
 {
   occ->destroy();
+  _ver[version]._index.erase(occ,occ->dtstart());
   _ver[version]._occurrence.erase( occ->key() );
-  delete occ;
+  ++_serial;
+  _forget_windows();
+  Pool<Occurrence>::destroy(occ);
 }
 
 
 // -- private: --
 
+Occurrence*
+Db::make_occurrence(const OccurrenceRow& row, int version)
+{
+  // Rows may belong to a calendar that has been read in the background, but
+  // which has not been loaded yet.
+  if(!calendar(row.calnum,version))
+      return NULL;
+  return make_occurrence(
+      row.calnum,
+      row.evtnum,
+      row.uid.c_str(),
+      row.summary.c_str(),
+      row.sequence,
+      row.all_day,
+      row.evt_recurs,
+      row.dtstart,
+      row.dtend,
+      row.occ_recurs,
+      version
+    );
+}
+
+
 Occurrence*
 Db::make_occurrence(
     int          calnum,
+    int          evtnum,
     const char*  uid,
     const char*  summary,
     int          sequence,
@@ -512,9 +1141,11 @@ Db::make_occurrence(
   std::map<std::string,Event*>::iterator e = ver._event.find(uid);
   if(e==ver._event.end())
   {
+    void* mem = ver.arena(calnum).events.allocate();
     event = ver._event[uid] =
-      new Event(
+      new (mem) Event(
           *ver._calendar[calnum],
+          evtnum,
           uid,
           summary,
           sequence,
@@ -527,12 +1158,231 @@ Db::make_occurrence(
     event = e->second;
   }
 
-  Occurrence::key_type key(uid,dtstart);
+  Occurrence::key_type key(event->evtnum,dtstart);
   std::map<Occurrence::key_type,Occurrence*>::iterator o =
       ver._occurrence.find(key);
   if(o!=ver._occurrence.end())
       return o->second;
-  return ver._occurrence[key] = new Occurrence(*event,dtstart,dtend,occ_recurs);
+  void* mem = ver.arena(event->calendar().calnum).occurrences.allocate();
+  Occurrence* occ = new (mem) Occurrence(*event,dtstart,dtend,occ_recurs);
+  ver._occurrence[key] = occ;
+  ver._index.insert(occ);
+  _forget_windows(dtstart,dtend,version);
+  return occ;
+}
+
+
+int
+Db::_next_evtnum(void)
+{
+  if(!_evtnum)
+  {
+    // Start below any that were created in earlier sessions.
+    sql::query_val(CALI_HERE,_rdb,_evtnum,
+        "select min(0,coalesce(min(EVTNUM),0)) from EVENT");
+  }
+  return --_evtnum;
+}
+
+
+bool
+Db::_create_rtree(void)
+{
+  int exists = 0;
+  sql::query_val(CALI_HERE,_sdb,exists,
+      "select count(0) from sqlite_master where name='OCC_RTREE'");
+  if(exists)
+      return true;
+
+  // One dimension: each occurrence's [DTSTART,DTEND]. Keyed by OCCURRENCE's
+  // rowid, so OCC_RTREE must be rebuilt if the database is ever VACUUMed.
+  sql::exec(CALI_HERE,_sdb,"begin");
+  int ret = ::sqlite3_exec(_sdb,
+      "create virtual table OCC_RTREE using rtree(ID,DTSTART,DTEND)",0,0,0);
+  if(ret!=SQLITE_OK)
+  {
+    sql::exec(CALI_HERE,_sdb,"rollback");
+    return false;
+  }
+  try
+  {
+    sql::exec(CALI_HERE,_sdb,rtree_insert_sql);
+    sql::exec(CALI_HERE,_sdb,
+        "create trigger OCC_RTREE_DELETE after delete on OCCURRENCE begin "
+          "delete from OCC_RTREE where ID=old.rowid; "
+        "end"
+      );
+    sql::exec(CALI_HERE,_sdb,
+        "create trigger OCC_RTREE_UPDATE "
+          "after update of DTSTART,DTEND on OCCURRENCE begin "
+          "update OCC_RTREE set "
+            "DTSTART=min(new.DTSTART,new.DTEND),"
+            "DTEND  =max(new.DTSTART,new.DTEND) "
+          "where ID=new.rowid; "
+        "end"
+      );
+    // Index the occurrences we already have.
+    sql::exec(CALI_HERE,_sdb,
+        "insert into OCC_RTREE select rowid,"
+          "min(DTSTART,DTEND),max(DTSTART,DTEND) from OCCURRENCE"
+      );
+    sql::exec(CALI_HERE,_sdb,"commit");
+  }
+  catch(...)
+  {
+    try{ sql::exec(CALI_HERE,_sdb,"rollback"); } catch(...) {}
+    throw;
+  }
+  return true;
+}
+
+
+void
+Db::_upgrade_occurrence(void)
+{
+  sql::exec(CALI_HERE,_sdb,"begin");
+  try
+  {
+    sql::exec(CALI_HERE,_sdb,"alter table OCCURRENCE rename to OCC_OLD");
+    sql::exec(CALI_HERE,_sdb,
+        "create table OCCURRENCE ("
+        "  VERSION  integer,"
+        "  CALNUM   integer,"
+        "  EVTNUM   integer,"
+        "  DTSTART  integer,"
+        "  DTEND    integer,"
+        "  RECURS   integer,"
+        "  primary key(VERSION,EVTNUM,DTSTART)"
+        ")"
+      );
+    // Occurrences without an EVENT are dropped.
+    sql::exec(CALI_HERE,_sdb,
+        "insert or ignore into OCCURRENCE "
+          "select O.VERSION,O.CALNUM,E.EVTNUM,O.DTSTART,O.DTEND,O.RECURS "
+          "from OCC_OLD O "
+          "join EVENT E on E.UID=O.UID and E.VERSION=O.VERSION"
+      );
+    // Takes OCC_OLD's indexes & triggers with it.
+    sql::exec(CALI_HERE,_sdb,"drop table OCC_OLD");
+    // OCC_RTREE is keyed by the old rowids. _create_rtree() rebuilds it.
+    sql::exec(CALI_HERE,_sdb,"drop table if exists OCC_RTREE");
+    sql::exec(CALI_HERE,_sdb,"commit");
+  }
+  catch(...)
+  {
+    try{ sql::exec(CALI_HERE,_sdb,"rollback"); } catch(...) {}
+    throw;
+  }
+}
+
+
+time_t
+Db::_horizon(time_t end, int version)
+{
+  return( end > _ver[version].expanded? end + EXPAND_STEP: 0 );
+}
+
+
+bool
+Db::_expand(time_t end, int version)
+{
+  const time_t horizon = _horizon(end,version);
+  if(horizon)
+  {
+    if(!ics::expand(statements(),horizon,version))
+        return false;
+    _ver[version].expanded = horizon;
+  }
+  return true;
+}
+
+
+void
+Db::_evict(time_t begin, time_t end, int version)
+{
+  Version& ver = _ver[version];
+  if(_resident_periods<=0 || ver._index.size()<=_evict_at)
+      return;
+  const time_t margin = _resident_periods * (end-begin);
+  if(ver.evict(begin-margin,end+margin))
+      _forget_windows(); // They may hold evicted occurrences.
+  _evict_at = std::max(RESIDENT_MIN,2*ver._index.size());
+}
+
+
+bool
+Db::_find_window(
+    time_t                              begin,
+    time_t                              end,
+    int                                 version,
+    std::multimap<time_t,Occurrence*>&  result
+  )
+{
+  typedef std::multimap<time_t,Occurrence*>::const_iterator OIt;
+  for(std::list<Window>::iterator w=_windows.begin(); w!=_windows.end(); ++w)
+  {
+    if(w->version!=version || begin<w->begin || w->end<end)
+        continue;
+    if(begin==w->begin && end==w->end)
+    {
+      result = w->occurrence;
+    }
+    else
+    {
+      // A sub-period of the window.
+      OIt last = w->occurrence.lower_bound(end);
+      for(OIt o=w->occurrence.begin(); o!=last; ++o)
+          if(o->second->dtend() >= begin)
+              result.insert(*o);
+    }
+    _windows.splice(_windows.begin(),_windows,w); // Now most recently used.
+    return true;
+  }
+  return false;
+}
+
+
+void
+Db::_add_window(
+    time_t                                    begin,
+    time_t                                    end,
+    int                                       version,
+    const std::multimap<time_t,Occurrence*>&  occurrence
+  )
+{
+  _windows.push_front(Window());
+  Window& w = _windows.front();
+  w.version    = version;
+  w.begin      = begin;
+  w.end        = end;
+  w.occurrence = occurrence;
+  _windows_size += occurrence.size();
+  // Evict the least recently used windows, but always keep this one.
+  while(_windows_size > WINDOWS_BUDGET && _windows.size() > 1)
+  {
+    _windows_size -= _windows.back().occurrence.size();
+    _windows.pop_back();
+  }
+}
+
+
+void
+Db::_forget_windows(time_t begin, time_t end, int version)
+{
+  std::list<Window>::iterator w=_windows.begin();
+  while(w!=_windows.end())
+  {
+    // The same test as find(): DTEND>=begin and DTSTART<end.
+    if(w->version==version && end>=w->begin && begin<w->end)
+    {
+      _windows_size -= w->occurrence.size();
+      w = _windows.erase(w);
+    }
+    else
+    {
+      ++w;
+    }
+  }
 }
 
 
@@ -541,8 +1391,8 @@ Db::_setting(const char* key, std::string& val) const
 {
   bool result = false;
   const char* sql = "select VALUE from SETTING where KEY=?";
-  sql::Statement select_stg(CALI_HERE,_sdb,sql);
-  sql::bind_text(CALI_HERE,_sdb,select_stg,1,key,-1);
+  sql::CachedStatement select_stg(CALI_HERE,*_rstmts,sql);
+  sql::bind_text(CALI_HERE,_rdb,select_stg,1,key,-1);
 
   int return_code = ::sqlite3_step(select_stg);
   if(return_code==SQLITE_ROW)
@@ -552,7 +1402,7 @@ Db::_setting(const char* key, std::string& val) const
   }
   else if(return_code!=SQLITE_DONE)
   {
-    calendari::sql::error(CALI_HERE,_sdb);
+    calendari::sql::error(CALI_HERE,_rdb);
   }
   return result;
 }
@@ -567,7 +1417,7 @@ Db::_set_setting(const char* key, const char* val) const
   if(!_setting(key,oldval))
   {
     const char* sql = "insert into SETTING (KEY,VALUE) values (?,?)";
-    sql::Statement insert_stg(CALI_HERE,_sdb,sql);
+    sql::CachedStatement insert_stg(CALI_HERE,*_stmts,sql);
     sql::bind_text(CALI_HERE,_sdb,insert_stg,1,key,-1);
     sql::bind_text(CALI_HERE,_sdb,insert_stg,2,val,-1);
     sql::step_reset(CALI_HERE,_sdb,insert_stg);
@@ -575,7 +1425,7 @@ Db::_set_setting(const char* key, const char* val) const
   else if(oldval!=val)
   {
     const char* sql = "update SETTING set VALUE=? where KEY=?";
-    sql::Statement update_stg(CALI_HERE,_sdb,sql);
+    sql::CachedStatement update_stg(CALI_HERE,*_stmts,sql);
     sql::bind_text(CALI_HERE,_sdb,update_stg,1,val,-1);
     sql::bind_text(CALI_HERE,_sdb,update_stg,2,key,-1);
     sql::step_reset(CALI_HERE,_sdb,update_stg);
@@ -2,12 +2,18 @@
 #define CALENDARI__DB_H 1
 
 #include "event.h"
+#include "pool.h"
 #include "recur.h"
+#include "timeindex.h"
+#include "veventcache.h"
 
+#include <list>
 #include <map>
+#include <set>
 #include <sqlite3.h>
 #include <string>
 #include <sstream>
+#include <vector>
 
 struct icalcomponent_impl;
 typedef struct icalcomponent_impl icalcomponent;
@@ -15,18 +21,86 @@ typedef struct icalcomponent_impl icalcomponent;
 namespace calendari {
 
 // Forward reference
-namespace sql { class Statement; }
+namespace sql { class StatementCache; }
+class Loader;
+
+
+/** One row of the query that finds occurrences. */
+struct OccurrenceRow
+{
+  int          calnum;
+  int          evtnum;
+  std::string  uid;
+  std::string  summary;
+  int          sequence;
+  bool         all_day;
+  RecurType    evt_recurs;
+  time_t       dtstart;
+  time_t       dtend;
+  RecurType    occ_recurs;
+
+  /** SQL that finds occurrences: bind begin, end & version. Looks them up
+  *   in the OCC_RTREE. */
+  static const char* const find_sql;
+  /** As find_sql, but uses OCCURRENCE's indexes, for when there's no
+  *   OCC_RTREE. */
+  static const char* const scan_sql;
+  /** Read the current row of a find_sql statement. */
+  void read(sqlite3_stmt* select_stmt);
+};
 
 
 struct Version
 {
+  Version(void): expanded(EXPANDED_NONE) {}
+
   /** CALENDAR, indexed by CALNUM. */
   std::map<int,Calendar*>                     _calendar;
   std::map<std::string,Event*>                _event;
   std::map<Occurrence::key_type,Occurrence*>  _occurrence;
+  /** The same occurrences, indexed by time. */
+  TimeIndex                                   _index;
+
+  /** Every recurring event in this version has been expanded into
+  *   OCCURRENCE rows at least up to this time. */
+  time_t                                      expanded;
+
+  /** Where one calendar's events & occurrences are allocated. */
+  struct Arena
+  {
+    Pool<Event>       events;
+    Pool<Occurrence>  occurrences;
 
-  /** Clear away all events and occurrences for the given calender. */
+    bool empty(void) const
+      { return !events.stats().live && !occurrences.stats().live; }
+  };
+  /** Arenas, indexed by CALNUM. Objects stay in the arena they were made
+  *   in, even if their event moves to another calendar. */
+  std::map<int,Arena*>                        _arena;
+
+  Arena& arena(int calnum)
+    {
+      Arena*& a = _arena[calnum];
+      if(!a)
+          a = new Arena();
+      return *a;
+    }
+
+  /** Clear away all events and occurrences for the given calender. Frees
+  *   the calendar's arena, unless it still holds objects for events that
+  *   have moved to another calendar. */
   void purge(int calnum);
+  /** Clear away these events (by UID) and their occurrences. */
+  void purge_events(const std::set<std::string>& uids);
+  /** Clear away the occurrences that don't overlap [begin,end), unless they
+  *   are pinned, and then any of their events that are left with no
+  *   occurrences. They are read back from the database when needed.
+  *   Returns the number of occurrences evicted. */
+  size_t evict(time_t begin, time_t end);
+  /** Find 'occ' in _occurrence, even if its start time has changed since it
+  *   was filed there. Takes time in proportion to its event's occurrences. */
+  std::map<Occurrence::key_type,Occurrence*>::iterator
+  find(const Occurrence* occ);
   /** Clear away all calendars, events and occurrences. */
   void destroy(void);
 };
@@ -41,7 +115,24 @@ public:
   /** Creates tables and indices in the database. */
   void create_db(void);
 
-  void refresh_cal(int calnum, int from_version, int to_version=1);
+  /** Replace calendar 'calnum' in to_version with the rows staged in
+  *   from_version. Returns FALSE, having done nothing, if another connection
+  *   is writing. */
+  bool refresh_cal(int calnum, int from_version, int to_version=1);
+
+  /** Add the UIDs of the events staged in 'version' to 'uids'. */
+  void staged_uids(int version, std::set<std::string>& uids);
+
+  /** Like refresh_cal(), but from_version only holds the events that are new
+  *   or changed. 'uids' lists those events, as found by staged_uids(), and
+  *   any that have been removed. Other events are left alone, both in the
+  *   database and in memory. Returns FALSE, having done nothing, if another
+  *   connection is writing. */
+  bool merge_cal(
+      int                           from_version,
+      const std::set<std::string>&  uids,
+      int                           to_version=1
+    );
 
   /** Initial load of all calendar information. */
   void load_calendars(int version=1);
@@ -49,12 +140,76 @@ public:
   /** Initial load of one calendar's information. */
   Calendar* load_calendar(int calnum, int version=1);
 
-  /** Find all occurrences between the specified (begin,end] times. */
+  /** Find all occurrences between the specified (begin,end] times.
+  *   If there's a background loader, and the period is not yet in memory,
+  *   then this just returns what's already loaded. The loader expands any
+  *   recurring events that need it, and then calls loaded() once it has read
+  *   the rest from the database. */
   std::multimap<time_t,Occurrence*> find(time_t begin,time_t end,int version=1);
 
+  /** Periods that the user is likely to view next. Any that are not yet in
+  *   memory are read in the background, by the loader. */
+  void prefetch(
+      const std::vector< std::pair<time_t,time_t> >&  periods,
+      int                                             version=1
+    );
+
+  /** Recurring events in 'version' have been expanded up to 'horizon' by
+  *   the background loader. */
+  void expanded(time_t horizon, int version=1);
+
+  /** Load occurrences that were read for find() by the background loader. */
+  void loaded(
+      time_t                             begin,
+      time_t                             end,
+      const std::vector<OccurrenceRow>&  rows,
+      int                                version=1
+    );
+
+  void set_loader(Loader* loader)
+    { _loader = loader; }
+
+  /** Allocator statistics for the events & occurrences in memory. */
+  void pool_stats(PoolStats& events, PoolStats& occurrences) const;
+
+  /** All of the memory taken by the occurrences in memory: their Pool
+  *   blocks, their nodes in the Version::_occurrence maps and the TimeIndex
+  *   arrays. The map nodes are estimated, without malloc's own overhead. */
+  size_t occurrence_bytes(void) const;
+
+  /** Incremented whenever occurrences are changed or removed in memory.
+  *   Rows read before such a change may be out of date. */
+  unsigned serial(void) const
+    { return _serial; }
+
+  /** Keep the occurrences within 'periods' view periods either side of the
+  *   one that find() is asked for, and evict the rest. Zero turns eviction
+  *   off. */
+  void set_resident_periods(int periods)
+    { _resident_periods = periods; }
+  /** Default for set_resident_periods(): the views prefetch two periods
+  *   either side, so keep one more than that. */
+  static const int RESIDENT_PERIODS = 3;
+
   /** Look up the calnum of the given calid, or generate a new unique number. */
   int calnum(const char* calid);
 
+  /** As calnum(calid), but only consults the database 'sdb'. For use by
+  *   other connections. */
+  static int calnum(sqlite3* sdb, const char* calid);
+
+  /** Make the empty temporary tables BULK_EVENT and BULK_OCCURRENCE, which
+  *   are shaped like EVENT and OCCURRENCE but have no indexes. A bulk load
+  *   into 'sdb' writes its rows there. Call inside the load's transaction,
+  *   and call end_bulk() before it commits. */
+  static void begin_bulk(sqlite3* sdb);
+
+  /** Move the rows from the BULK_ tables into EVENT and OCCURRENCE, in
+  *   primary-key order. If that at least doubles OCCURRENCE, then the
+  *   secondary indexes are dropped for the copy and rebuilt afterwards, and
+  *   the new rows are added to OCC_RTREE in one pass. */
+  static void end_bulk(sqlite3* sdb);
+
   Calendar* calendar(int calnum, int version=1)
     {
       const std::map<int,Calendar*>& m( calendars(version) );
@@ -86,8 +241,20 @@ public:
       int          version=1
     );
 
-  /** Read a VEVENT from the database, or create a new, empty one. */
-  icalcomponent* vevent(const char* uid, int version=1);
+  /** The parsed VEVENT for 'event', from the cache or else read from the
+  *   database. Creates a new, empty one if there is none. Owned by the cache,
+  *   and only valid until the next call to vevent(). */
+  icalcomponent* vevent(const Event& event);
+  /** 'event's VEVENT has been changed in place; it's now 'bytes' long. */
+  void vevent_changed(const Event& event, size_t bytes)
+    { _vevents.resize(&event,bytes); }
+  /** Drop 'event's VEVENT from the cache. Called as events are destroyed. */
+  void forget_vevent(const Event& event)
+    { _vevents.erase(&event); }
+  const VeventCache& vevent_cache(void) const
+    { return _vevents; }
+  /** Default budget for the VEVENT cache, in bytes of iCalendar text. */
+  static const size_t VEVENT_CACHE_BYTES = 1024*1024;
 
   void moved(Occurrence* occ, int version=1);
   void erase(Occurrence* occ, int version=1);
@@ -98,18 +265,106 @@ public:
   template<class T>
   void set_setting(const char* key, const T& val) const;
 
+  /** The write connection. */
   operator sqlite3* (void) const
     { return _sdb; }
 
+  /** Prepared statements for frequently executed queries, on the write
+  *   connection. */
+  sql::StatementCache& statements(void) const
+    { return *_stmts; }
+
+  /** Prepared statements on the read connection. */
+  sql::StatementCache& read_statements(void) const
+    { return *_rstmts; }
+
+  /** The SQL that finds occurrences: OccurrenceRow::find_sql or scan_sql. */
+  const char* find_sql(void) const
+    { return _rtree? OccurrenceRow::find_sql: OccurrenceRow::scan_sql; }
+
 private:
+  /** Write connection, used by the Queue, expansion & calendar swaps. */
   sqlite3*               _sdb;
+  sql::StatementCache*   _stmts;
+  /** Read-only connection, used by find(), vevent() & settings. In WAL mode
+  *   it reads a consistent snapshot, and never waits for the writers. */
+  sqlite3*               _rdb;
+  sql::StatementCache*   _rstmts;
   std::map<int,Version>  _ver;
+  Loader*                _loader;
+  unsigned               _serial;
+  /** TRUE if the OCC_RTREE interval index is available. */
+  bool                   _rtree;
+  /** EVTNUM of the last event created here, or 0 if there's been none yet.
+  *   Events created by the user count down from -1, so that they never clash
+  *   with those that the readers number from the top of EVENT. */
+  int                    _evtnum;
+  VeventCache            _vevents;
+  /** See set_resident_periods(). */
+  int                    _resident_periods;
+  /** Evict occurrences when find() sees more than this many in memory. */
+  size_t                 _evict_at;
+  /** Never evict when there are fewer than this many occurrences. */
+  static const size_t    RESIDENT_MIN = 10000;
+
+  /** A period that find() has recently returned. */
+  struct Window
+  {
+    int                                version;
+    time_t                             begin;
+    time_t                             end;
+    std::multimap<time_t,Occurrence*>  occurrence;
+  };
+  /** Cache of find() results, most recently used first. */
+  std::list<Window>      _windows;
+  /** Total number of occurrences in _windows. */
+  size_t                 _windows_size;
+  /** Evict the least recently used windows when _windows_size exceeds this. */
+  static const size_t    WINDOWS_BUDGET = 50000;
+
+  /** Create OCC_RTREE and its triggers, if they don't exist. Returns FALSE
+  *   if SQLite has no R*Tree module. */
+  bool _create_rtree(void);
+  /** Rebuild an old OCCURRENCE table, keyed by UID, to use EVTNUM. */
+  void _upgrade_occurrence(void);
+  /** How far recurring events must be expanded so that they have
+  *   OCCURRENCE rows up to 'end', or zero if they already do. */
+  time_t _horizon(time_t end, int version);
+  /** Make sure that recurring events have OCCURRENCE rows up to 'end'.
+  *   Returns FALSE if the database is busy, so that they might not. Only
+  *   used when there's no background loader. */
+  bool _expand(time_t end, int version);
+  /** Evict occurrences far from [begin,end), if there are too many. The
+  *   threshold doubles with what's left, so this stays cheap. */
+  void _evict(time_t begin, time_t end, int version);
+  /** Look for [begin,end) in _windows. Returns TRUE if it was found. */
+  bool _find_window(
+      time_t                              begin,
+      time_t                              end,
+      int                                 version,
+      std::multimap<time_t,Occurrence*>&  result
+    );
+  void _add_window(
+      time_t                                    begin,
+      time_t                                    end,
+      int                                       version,
+      const std::multimap<time_t,Occurrence*>&  occurrence
+    );
+  /** Occurrences have changed, so cached windows may be wrong. */
+  void _forget_windows(void)
+    { _windows.clear(); _windows_size = 0; }
+  /** An occurrence in [begin,end) has been added, so forget just the
+  *   windows that it would have appeared in. */
+  void _forget_windows(time_t begin, time_t end, int version);
 
   /** Helper, loads calendars from 'select_stmt'. */
-  void _load_calendars(sql::Statement& select_stmt, int version);
+  void _load_calendars(sqlite3_stmt* select_stmt, int version);
 
+  /** Returns NULL if the row's calendar is not loaded. */
+  Occurrence* make_occurrence(const OccurrenceRow& row, int version);
   Occurrence* make_occurrence(
       int          calnum,
+      int          evtnum,
       const char*  uid,
       const char*  summary,
       int          sequence,
@@ -120,6 +375,11 @@ private:
       RecurType    occ_recurs,
       int          version
     );
+  /** Read a VEVENT from the database, or create a new, empty one. Sets
+  *   'bytes' to the length of its text. */
+  icalcomponent* _read_vevent(const char* uid, int version, size_t& bytes);
+  /** Choose an EVTNUM for a new event. */
+  int _next_evtnum(void);
 
   /** Returns TRUE and sets value if key exists, else returns FALSE.  */
   bool _setting(const char* key, std::string& val) const;
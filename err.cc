@@ -10,6 +10,16 @@ namespace calendari {
 namespace util {
 
 
+/** TRUE in threads other than the GTK main thread. */
+static __thread bool background_thread = false;
+
+
+void set_background_thread(void)
+{
+  background_thread = true;
+}
+
+
 void error(const Here& here,int r,int e,const char* format,...)
 {
   char buf[512];
@@ -21,6 +31,12 @@ void error(const Here& here,int r,int e,const char* format,...)
       snprintf(buf+len,sizeof(buf)-len,": %s",::strerror(e));
   buf[ sizeof(buf)-1 ] = '\0';
   fprintf(stderr,"%s at %s:%d\n",buf,here.first,here.second);
+  if(background_thread)
+  {
+    if(r)
+        ::exit(r);
+    return;
+  }
   // Pop up error dialogue ?? only when action is user-requested.
   GtkWidget* dialog =
     gtk_message_dialog_new(
@@ -51,6 +67,8 @@ void warning(const Here& here,int e,const char* format,...)
       snprintf(buf+len,sizeof(buf)-len,": %s",::strerror(e));
   buf[ sizeof(buf)-1 ] = '\0';
   fprintf(stderr,"%s at %s:%d\n",buf,here.first,here.second);
+  if(background_thread)
+      return;
   // Pop up error dialogue
   GtkWidget* dialog =
     gtk_message_dialog_new(
@@ -28,6 +28,12 @@ void warning(const Here& here,int e,const char* format,...);
  }while(0)
 
 
+/** Call at the start of a worker thread. Errors and warnings raised in the
+*   calling thread are then just logged, rather than popping up dialogues -
+*   only the main thread may use GTK. */
+void set_background_thread(void);
+
+
 struct Exception: public std::exception
 {
   const char* what(void) const throw()
@@ -3,6 +3,7 @@
 #include "db.h"
 #include "queue.h"
 #include "sql.h"
+#include "zblob.h"
 
 #include <cassert>
 #include <cstring>
@@ -40,41 +41,17 @@ void
 Calendar::create(void)
 {
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "insert into CALENDAR ("
-          "VERSION,"
-          "CALNUM,"
-          "CALID,"
-          "CALNAME,"
-          "DTSTAMP,"
-          "PATH,"
-          "READONLY,"
-          "POSITION,"
-          "COLOUR,"
-          "SHOW"
-      ") values ("
-          "%d,"   // VERSION
-          "%d,"   // CALNUM
-          "'%s'," // CALID
-          "'%s'," // CALNAME
-          "%d,"   // DTSTAMP
-          "'%s'," // PATH
-          "%d,"   // READONLY
-          "%d,"   // POSITION
-          "'%s'," // COLOUR
-          "%d"    // SHOW
-      ");",
-      version,
-      calnum,
-      sql::quote(calid).c_str(),
-      sql::quote(_name).c_str(),
-      ::time(NULL),
-      sql::quote(_path).c_str(),
-      (_readonly? 1: 0),
-      _position,
-      sql::quote(_colour).c_str(),
-      (_show? 1: 0)
-    );
+  q.insert("CALENDAR")
+      .set("VERSION",  version)
+      .set("CALNUM",   calnum)
+      .set("CALID",    calid)
+      .set("CALNAME",  _name)
+      .set("DTSTAMP",  ::time(NULL))
+      .set("PATH",     _path)
+      .set("READONLY", (_readonly? 1: 0))
+      .set("POSITION", _position)
+      .set("COLOUR",   _colour)
+      .set("SHOW",     (_show? 1: 0));
 }
 
 
@@ -86,10 +63,9 @@ Calendar::set_name(const std::string& s)
   _name = s;
   // --
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "update CALENDAR set CALNAME='%s' where VERSION=%d and CALNUM=%d",
-      sql::quote(s).c_str(), version, calnum
-    );
+  q.update("CALENDAR")
+      .where("VERSION",version).where("CALNUM",calnum)
+      .set("CALNAME",s);
   touch();
 }
 
@@ -102,10 +78,9 @@ Calendar::set_path(const std::string& s)
   _path = s;
   // --
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "update CALENDAR set PATH='%s' where VERSION=%d and CALNUM=%d",
-      sql::quote(s).c_str(), version, calnum
-    );
+  q.update("CALENDAR")
+      .where("VERSION",version).where("CALNUM",calnum)
+      .set("PATH",s);
   touch();
 }
 
@@ -117,10 +92,9 @@ Calendar::set_position(int p)
       return;
   _position = p;
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "update CALENDAR set POSITION=%d where VERSION=%d and CALNUM=%d",
-      _position, version, calnum
-    );
+  q.update("CALENDAR")
+      .where("VERSION",version).where("CALNUM",calnum)
+      .set("POSITION",_position);
 }
 
 void
@@ -131,10 +105,9 @@ Calendar::set_colour(const std::string& s)
   _colour = s;
   // --
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "update CALENDAR set COLOUR='%s' where VERSION=%d and CALNUM=%d",
-      sql::quote(s).c_str(), version, calnum
-    );
+  q.update("CALENDAR")
+      .where("VERSION",version).where("CALNUM",calnum)
+      .set("COLOUR",s);
 }
 
 
@@ -145,20 +118,30 @@ Calendar::toggle_show(void)
   _show = !_show;
   // --
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "update CALENDAR set SHOW=%d where VERSION=%d and CALNUM=%d",
-      _show, version, calnum
-    );
+  q.update("CALENDAR")
+      .where("VERSION",version).where("CALNUM",calnum)
+      .set("SHOW",(_show? 1: 0));
 }
 
+void
+Calendar::set_fingerprint(const Fingerprint& f)
+{
+  _fingerprint = f;
+  // --
+  static Queue& q( Queue::inst() );
+  q.update("CALENDAR")
+      .where("VERSION",version).where("CALNUM",calnum)
+      .set("MTIME",f.mtime).set("SIZE",f.size).set("HASH",f.hash);
+}
+
+
 void
 Calendar::touch(void)
 {
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "update CALENDAR set DTSTAMP=%lu where VERSION=%d and CALNUM=%d",
-      ::time(NULL), version, calnum
-    );
+  q.update("CALENDAR")
+      .where("VERSION",version).where("CALNUM",calnum)
+      .set("DTSTAMP",::time(NULL));
 }
 
 
@@ -167,30 +150,30 @@ Calendar::touch(void)
 
 Event::Event(
     Calendar&    c,
+    int          n,
     const char*  u,
     const char*  s,
     int          q,
     bool         a,
     RecurType    r
   )
-  : uid(u),
+  : evtnum(n),
+    uid(u),
     _calendar(&c),
     _summary(s),
     _sequence(q),
     _all_day(a),
     _recurs(r),
-    _vevent(NULL),
     _ref_count(0)
-{}
+{
+  _calendar->_events.insert(this);
+}
 
 
 Event::~Event(void)
 {
-  if(_vevent)
-  {
-    icalcomponent_free(_vevent);
-    _vevent = NULL;
-  }
+  _calendar->_events.erase(this);
+  Queue::inst().db()->forget_vevent(*this);
 }
 
 
@@ -198,34 +181,16 @@ void
 Event::create(void)
 {
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "insert into EVENT ("
-          "VERSION,"
-          "CALNUM,"
-          "UID,"
-          "SUMMARY,"
-          "SEQUENCE,"
-          "ALLDAY,"
-          "RECURS,"
-          "VEVENT"
-      ") values ("
-          "%d,"   // VERSION
-          "%d,"   // CALNUM
-          "'%s'," // UID
-          "'%s'," // SUMMARY
-          "%d,"   // SEQUENCE
-          "%d,"   // ALLDAY
-          "%d,"   // RECURS
-          "''"    // VEVENT
-      ");",
-      _calendar->version,
-      _calendar->calnum,
-      sql::quote(uid).c_str(),
-      sql::quote(_summary).c_str(),
-      _sequence,
-      (_all_day? 1: 0),
-      recur2int(_recurs)
-    );
+  q.insert("EVENT")
+      .set("VERSION",  _calendar->version)
+      .set("CALNUM",   _calendar->calnum)
+      .set("UID",      uid)
+      .set("EVTNUM",   evtnum)
+      .set("SUMMARY",  _summary)
+      .set("SEQUENCE", _sequence)
+      .set("ALLDAY",   (_all_day? 1: 0))
+      .set("RECURS",   recur2int(_recurs))
+      .set("VEVENT",   "");
 }
 
 
@@ -240,9 +205,9 @@ Event::readonly(void) const
 const char*
 Event::description(void) const
 {
-  load_vevent();
+  icalcomponent* vevent = load_vevent();
   icalproperty* iprop =
-      icalcomponent_get_first_property(_vevent,ICAL_DESCRIPTION_PROPERTY);
+      icalcomponent_get_first_property(vevent,ICAL_DESCRIPTION_PROPERTY);
   if(!iprop)
       return "";
   const char* desc = icalproperty_get_description(iprop);
@@ -253,21 +218,17 @@ Event::description(void) const
 void
 Event::set_calendar(Calendar& c)
 {
+  _calendar->_events.erase(this);
   _calendar = &c;
+  _calendar->_events.insert(this);
   // --
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "update EVENT set CALNUM=%d where VERSION=%d and UID='%s'",
-      _calendar->calnum,
-      _calendar->version,
-      sql::quote(uid).c_str()
-    );
-  q.pushf(
-      "update OCCURRENCE set CALNUM=%d where VERSION=%d and UID='%s'",
-      _calendar->calnum,
-      _calendar->version,
-      sql::quote(uid).c_str()
-    );
+  q.update("EVENT")
+      .where("VERSION",_calendar->version).where("UID",uid)
+      .set("CALNUM",_calendar->calnum);
+  q.update("OCCURRENCE")
+      .where("VERSION",_calendar->version).where("EVTNUM",evtnum)
+      .set("CALNUM",_calendar->calnum);
   increment_sequence();
 }
 
@@ -280,12 +241,9 @@ Event::set_summary(const std::string& s)
   _summary = s;
   // --
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "update EVENT set SUMMARY='%s' where VERSION=%d and UID='%s'",
-      sql::quote(s).c_str(),
-      _calendar->version,
-      sql::quote(uid).c_str()
-    );
+  q.update("EVENT")
+      .where("VERSION",_calendar->version).where("UID",uid)
+      .set("SUMMARY",s);
   increment_sequence();
 }
 
@@ -298,12 +256,9 @@ Event::set_all_day(bool v)
   _all_day = v;
   // --
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "update EVENT set ALLDAY=%d where VERSION=%d and UID='%s'",
-      (_all_day? 1: 0),
-      _calendar->version,
-      sql::quote(uid).c_str()
-    );
+  q.update("EVENT")
+      .where("VERSION",_calendar->version).where("UID",uid)
+      .set("ALLDAY",(_all_day? 1: 0));
   increment_sequence();
 }
 
@@ -317,12 +272,9 @@ Event::add_recurs(RecurType r)
   _recurs = new_recurs;
   // --
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "update EVENT set RECURS=%d where VERSION=%d and UID='%s'",
-      recur2int(_recurs),
-      _calendar->version,
-      sql::quote(uid).c_str()
-    );
+  q.update("EVENT")
+      .where("VERSION",_calendar->version).where("UID",uid)
+      .set("RECURS",recur2int(_recurs));
   increment_sequence();
 }
 
@@ -331,9 +283,9 @@ void
 Event::set_description(const char* s)
 {
   assert(s);
-  load_vevent();
+  icalcomponent* vevent = load_vevent();
   icalproperty* iprop =
-      icalcomponent_get_first_property(_vevent,ICAL_DESCRIPTION_PROPERTY);
+      icalcomponent_get_first_property(vevent,ICAL_DESCRIPTION_PROPERTY);
   if(s[0])
   {
       // Set / change the description.
@@ -347,25 +299,26 @@ Event::set_description(const char* s)
       else
       {
         iprop = icalproperty_new_description(s);
-        icalcomponent_add_property(_vevent,iprop);
+        icalcomponent_add_property(vevent,iprop);
       }
   }
   else
   {
       // Erase the description.
       if(iprop)
-          icalcomponent_remove_property(_vevent,iprop);
+          icalcomponent_remove_property(vevent,iprop);
       else
           return; // No change.
   }
   // --
+  const char* text = icalcomponent_as_ical_string(vevent);
+  const size_t len = ::strlen(text);
+  std::string blob = zblob_pack(text,len);
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "update EVENT set VEVENT='%s' where VERSION=%d and UID='%s'",
-      sql::quote(icalcomponent_as_ical_string(_vevent)).c_str(),
-      _calendar->version,
-      sql::quote(uid).c_str()
-    );
+  q.db()->vevent_changed(*this,len);
+  q.update("EVENT")
+      .where("VERSION",_calendar->version).where("UID",uid)
+      .set("VEVENT",sql::Value::blob(blob));
   increment_sequence();
 }
 
@@ -377,28 +330,24 @@ Event::increment_sequence(void)
   ++_sequence;
   // --
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "update EVENT set SEQUENCE=%d where VERSION=%d and UID='%s'",
-      _sequence,
-      _calendar->version,
-      sql::quote(uid).c_str()
-    );
+  q.update("EVENT")
+      .where("VERSION",_calendar->version).where("UID",uid)
+      .set("SEQUENCE",_sequence);
   _calendar->touch();
 }
 
 
-void
+icalcomponent*
 Event::load_vevent(void) const
 {
-  if(!_vevent)
-      _vevent = Queue::inst().db()->vevent(uid.c_str(),_calendar->version);
+  return Queue::inst().db()->vevent(*this);
 }
 
 
 // -- Occurrence --
 
 Occurrence::Occurrence(Event& e, time_t t0, time_t t1, RecurType r):
-  event(e), _dtstart(t0), _dtend(t1), _recurs(r), _key(e.uid,t0)
+  event(e), _dtstart(t0), _duration(t1-t0), _recurs(r), _pins(0)
 {
   ++event._ref_count;
 }
@@ -415,30 +364,14 @@ Occurrence::create(void)
 {
   assert(!event.calendar().readonly());
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "insert into OCCURRENCE ("
-          "VERSION,"
-          "CALNUM,"
-          "UID,"
-          "DTSTART,"
-          "DTEND,"
-          "RECURS"
-      ") values ("
-          "%d,"   // VERSION
-          "%d,"   // CALNUM
-          "'%s'," // UID
-          "%d,"   // DTSTART
-          "%d,"   // DTEND
-          "%d"    // RECURS
-      ");",
-      event.calendar().version,
-      event.calendar().calnum,
-      sql::quote(event.uid).c_str(),
-      _dtstart,
-      _dtend,
-      recur2int(_recurs)
-    );
-  event.add_recurs(_recurs);
+  q.insert("OCCURRENCE")
+      .set("VERSION", event.calendar().version)
+      .set("CALNUM",  event.calendar().calnum)
+      .set("EVTNUM",  event.evtnum)
+      .set("DTSTART", _dtstart)
+      .set("DTEND",   dtend())
+      .set("RECURS",  recur2int(recurs()));
+  event.add_recurs(recurs());
   event.calendar().touch();
 }
 
@@ -448,23 +381,18 @@ Occurrence::set_start(time_t start_)
 {
   if(_dtstart==start_)
       return false;
-  assert(_dtend >= _dtstart);
+  assert(_duration >= 0);
   time_t old_dtstart = _dtstart;
-  time_t old_dtend   = _dtend;
+  time_t old_dtend   = dtend();
   // --
-  time_t duration = _dtend - _dtstart;
   _dtstart = start_;
-  _dtend = start_ + duration;
   // --
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "update OCCURRENCE set DTSTART=%d,DTEND=%d "
-        "where VERSION=%d and UID='%s' and DTSTART=%d and DTEND=%d",
-      _dtstart,_dtend,
-      event.calendar().version,
-      sql::quote(event.uid).c_str(),
-      old_dtstart,old_dtend
-    );
+  q.update("OCCURRENCE")
+      .where("VERSION",event.calendar().version)
+      .where("EVTNUM",event.evtnum)
+      .where("DTSTART",old_dtstart).where("DTEND",old_dtend)
+      .set("DTSTART",_dtstart).set("DTEND",dtend());
   event.increment_sequence();
   return true;
 }
@@ -473,21 +401,18 @@ Occurrence::set_start(time_t start_)
 bool
 Occurrence::set_end(time_t end_)
 {
-  if(_dtend==end_ || end_<_dtstart)
+  if(dtend()==end_ || end_<_dtstart)
       return false;
-  time_t old_dtend = _dtend;
+  time_t old_dtend = dtend();
   // ?? Enforce restrictions from all_day events.
-  _dtend = end_;
+  _duration = end_ - _dtstart;
   // --
   static Queue& q( Queue::inst() );
-  q.pushf(
-      "update OCCURRENCE set DTEND=%d "
-        "where VERSION=%d and UID='%s' and DTSTART=%d and DTEND=%d",
-      _dtend,
-      event.calendar().version,
-      sql::quote(event.uid).c_str(),
-      _dtstart,old_dtend
-    );
+  q.update("OCCURRENCE")
+      .where("VERSION",event.calendar().version)
+      .where("EVTNUM",event.evtnum)
+      .where("DTSTART",_dtstart).where("DTEND",old_dtend)
+      .set("DTEND",dtend());
   event.increment_sequence();
   return true;
 }
@@ -497,24 +422,16 @@ void
 Occurrence::destroy(void)
 {
   static Queue& q( Queue::inst() );
-  std::string uid_sql = sql::quote(event.uid);
-  q.pushf(
-      "delete from OCCURRENCE "
-        "where VERSION=%d and UID='%s' and DTSTART=%d and DTEND=%d",
-      event.calendar().version,
-      uid_sql.c_str(),
-      _dtstart,_dtend
-    );
+  q.erase("OCCURRENCE")
+      .where("VERSION",event.calendar().version)
+      .where("EVTNUM",event.evtnum)
+      .where("DTSTART",_dtstart).where("DTEND",dtend());
   if(event._ref_count == 1)
   {
-    q.pushf(
-      "delete from EVENT "
-        "where VERSION=%d and UID='%s' and 0=("
-          "select count(0) from OCCURRENCE O where VERSION=%d and UID='%s'"
-        ")",
-      event.calendar().version, uid_sql.c_str(),
-      event.calendar().version, uid_sql.c_str()
-    );
+    q.erase("EVENT")
+        .where("VERSION",event.calendar().version)
+        .where("EVTNUM",event.evtnum)
+        .unless_referenced_by("OCCURRENCE");
   }
   event.calendar().touch();
 }
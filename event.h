@@ -2,7 +2,10 @@
 #define CALENDARI__EVENT_H 1
 
 #include "recur.h"
+#include "util.h"
 
+#include <cassert>
+#include <set>
 #include <string>
 #include <time.h>
 
@@ -11,6 +14,8 @@ typedef struct icalcomponent_impl icalcomponent;
 
 namespace calendari {
 
+class Event;
+
 
 class Calendar
 {
@@ -30,12 +35,17 @@ public:
   int                position(void) const { return _position; }
   const std::string& colour(void)   const { return _colour; }
   bool               show(void)     const { return _show; }
+  /** The file, as it was when this calendar was last read from it. */
+  const Fingerprint& fingerprint(void) const { return _fingerprint; }
+  /** The events of this calendar that are in memory. */
+  const std::set<Event*>& events(void) const { return _events; }
 
   void set_name(const std::string& s);
   void set_path(const std::string& s);
   void set_position(int p);
   void set_colour(const std::string& s);
   void toggle_show(void);
+  void set_fingerprint(const Fingerprint& f);
   void touch(void); ///< Touch the calendar's datestamp (in the database).
 
   bool operator == (const Calendar& right) const
@@ -48,15 +58,29 @@ private:
   int         _position;
   std::string _colour;
   bool        _show;
+  Fingerprint _fingerprint;
+  std::set<Event*> _events;
+
+  friend class Db; // Allows _fingerprint to be loaded.
+  friend class Event; // Events add & remove themselves from _events.
 };
 
 
 class Event
 {
 public:
+  const int          evtnum; ///< EVENT.EVTNUM: identifies the event's rows.
   const std::string  uid;
 
-  Event(Calendar& c, const char* u, const char* s, int q, bool a, RecurType r);
+  Event(
+      Calendar&    c,
+      int          n,
+      const char*  u,
+      const char*  s,
+      int          q,
+      bool         a,
+      RecurType    r
+    );
   ~Event(void);
   /** Write this to a new row in the database. */
   void create(void);
@@ -67,6 +91,8 @@ public:
   RecurType recurs(void) const           { return _recurs; }
   bool readonly(void) const;
   const char* description(void) const;
+  /** Number of Occurrences in memory that refer to this. */
+  size_t ref_count(void) const           { return _ref_count; }
 
   void set_calendar(Calendar& c);
   void set_summary(const std::string& s);
@@ -82,22 +108,24 @@ private:
   bool               _all_day;
   RecurType          _recurs; ///< Event has an RRULE or RDATE property.
 
-  /**  VEVENT ical component. If NULL, then not cached. Owned by 'this'. */
-  mutable icalcomponent* _vevent;
-
-  /** Read _vevent from database, if it is not already loaded. Creates
-  *   a new VEVENT if there is none in the database. */
-  void load_vevent(void) const;
+  /** The VEVENT ical component, from Db's cache. Creates a new VEVENT if
+  *   there is none in the database. Owned by the cache. */
+  icalcomponent* load_vevent(void) const;
 
   friend class Occurrence; // Allows _ref_count to be set.
   size_t  _ref_count; ///< Number of Occurrences that refer to this.
 };
 
 
+/** One instance of an Event. There may be many thousands of these, so they
+*   are kept small: 24 bytes on a 64-bit machine. The key (event & start
+*   time) is not stored, since Version::_occurrence already holds it. Each
+*   also costs a Pool slot header, a node in Version::_occurrence and an
+*   entry in the TimeIndex; Db::occurrence_bytes() counts them all. */
 class Occurrence
 {
 public:
-  typedef std::pair<std::string,time_t> key_type;
+  typedef std::pair<int,time_t> key_type; ///< (evtnum,dtstart)
 
   Event&      event;
   
@@ -109,14 +137,16 @@ public:
   const time_t& dtstart(void) const
     { return _dtstart; }
 
-  const time_t& dtend(void) const
-    { return _dtend; }
+  time_t dtend(void) const
+    { return _dtstart + _duration; }
 
   RecurType recurs(void) const
-    { return _recurs; }
+    { return static_cast<RecurType>(_recurs); }
 
-  const key_type& key(void) const
-    { return _key; }
+  /** Location of this object in Version::_occurrence. Changed by
+  *   set_start(), until Db::moved() is called. */
+  key_type key(void) const
+    { return key_type(event.evtnum,_dtstart); }
 
   /** Returns TRUE if dtstart was actually changed. */
   bool set_start(time_t start_);
@@ -124,18 +154,27 @@ public:
   /** Returns TRUE if dtend was actually changed. */
   bool set_end(time_t end_);
 
-  /** Reset the _key, and return the new value. */
-  const key_type& rekey(void)
-    { return _key = key_type(event.uid,_dtstart); }
-
   /** Notify this occurrence has been removed. */
   void destroy(void);
 
+  /** Pinned occurrences are never evicted from memory by Db::find(). Pins
+  *   are counted, so every pin() needs a matching unpin(). The count sticks
+  *   once it reaches PINS_MAX, so the occurrence stays pinned for good
+  *   rather than wrapping round to unpinned. */
+  void pin(void)
+    { if(_pins<PINS_MAX) ++_pins; }
+  void unpin(void)
+    { assert(_pins>0); if(_pins<PINS_MAX) --_pins; }
+  bool pinned(void) const
+    { return _pins>0; }
+
+  static const unsigned char PINS_MAX = 255;
+
 private:
-  time_t      _dtstart;
-  time_t      _dtend;
-  RecurType   _recurs; ///< RRULE that made this occurrence.
-  key_type    _key; ///< Location of this object in Db::_occurrence map.
+  time_t         _dtstart;
+  int            _duration; ///< dtend - dtstart, in seconds.
+  unsigned char  _recurs;   ///< RecurType of the RRULE that made this.
+  unsigned char  _pins;     ///< Number of pin() calls not yet unpinned.
 };
 
 
@@ -6,6 +6,8 @@
 #include "queue.h"
 #include "reader.h"
 #include "sql.h"
+#include "tz.h"
+#include "zblob.h"
 
 #include <cstdlib>
 #include <cstring>
@@ -36,18 +38,8 @@ timet2ical(time_t t, bool is_date, const char* tzid = NULL)
   ::memset(&local_tm,0,sizeof(local_tm));
   if(tzid)
   {
-    char* tz;
-    tz = ::getenv("TZ");
-    ::setenv("TZ", tzid, 1);
-    ::tzset();
-
-    ::localtime_r(&t, &local_tm);
-
-    if(tz)
-      ::setenv("TZ", tz, 1);
-    else
-      ::unsetenv("TZ");
-    ::tzset();
+    const TimeZone* zone = TimeZone::find(tzid);
+    (zone? *zone: TimeZone::utc()).to_tm(t,local_tm);
   }
   else
   {
@@ -90,14 +82,16 @@ std::string generate_uid(void)
 int subscribe(
     Calendari*   app,
     const char*  ical_filename,
-    Db&          db,
-    int          version
+    sqlite3*     db,
+    int          version,
+    Progress*    progress
   )
 {
   try
   {
-      Reader reader(ical_filename);
+      Reader reader(ical_filename,progress);
       reader.readonly = true;
+      reader.bulk = true;
       if(!reader.calid_is_unique(db))
       {
         // We need to preserve the calid (subscribing), so we can't proceed.
@@ -116,13 +110,14 @@ int subscribe(
 int import(
     Calendari*   app,
     const char*  ical_filename,
-    Db&          db,
-    int          version
+    sqlite3*     db,
+    int          version,
+    Progress*    progress
   )
 {
   try
   {
-      Reader reader(ical_filename);
+      Reader reader(ical_filename,progress);
       if(reader.calid_is_unique(db))
       {
         if(reader.readonly)
@@ -137,6 +132,7 @@ int import(
          reader.path = "";
       }
       reader.readonly = false;
+      reader.bulk = true;
       return reader.load(app, db, version);
   }
   catch(Reader::Exception&)
@@ -147,17 +143,20 @@ int import(
 
 
 int reread(
-    Calendari*   app,
-    const char*  ical_filename,
-    Db&          db,
-    const char*  reread_calid,
-    int          version
+    Calendari*                 app,
+    const char*                ical_filename,
+    sqlite3*                   db,
+    const char*                reread_calid,
+    int                        version,
+    Progress*                  progress,
+    std::vector<std::string>*  removed
   )
 {
   try
   {
-      Reader reader(ical_filename);
+      Reader reader(ical_filename,progress);
       reader.readonly = true;
+      reader.incremental = (removed!=NULL);
       // We are re-reading an existing calendar - calids must match.
       if(reader.calid != reread_calid)
       {
@@ -165,7 +164,10 @@ int reread(
         CALI_SQLCHK(db, ::sqlite3_exec(db, "rollback", 0, 0, 0) );
         return -1; // FAIL
       }
-      return reader.load(app, db, version);
+      int calnum = reader.load(app, db, version);
+      if(removed)
+          removed->swap(reader.removed);
+      return calnum;
   }
   catch(Reader::Exception&)
   {
@@ -183,8 +185,10 @@ void write(const char* ical_filename, Db& db, const char* calid, int version)
   icalparameter* param;
   Queue& q( Queue::inst() );
 
-  // Make sure the database is up-to-date before we start.
-  q.flush();
+  // Make sure the database is up-to-date before we start. If another
+  // connection is writing, then leave it until the next refresh.
+  if(!q.flush())
+      return;
 
   // Load calendar from database.
   const char* sql =
@@ -223,10 +227,9 @@ void write(const char* ical_filename, Db& db, const char* calid, int version)
   }
   if(dtstamp==0)
   {
-      q.pushf(
-          "update CALENDAR set DTSTAMP=%lu where VERSION=%d and CALNUM=%d",
-          ::time(NULL),version,calnum
-        );
+      q.update("CALENDAR")
+          .where("VERSION",version).where("CALNUM",calnum)
+          .set("DTSTAMP",::time(NULL));
   }
   else
   {
@@ -285,10 +288,10 @@ void write(const char* ical_filename, Db& db, const char* calid, int version)
   // Load calendar from database.
   // Eek! a self-join to find the *first* occurrence for each event.
   sql = "select E.UID,SUMMARY,SEQUENCE,ALLDAY,VEVENT,O.DTSTART,O.DTEND "
-        "from (select UID,min(DTSTART) as S from "
-               "OCCURRENCE where VERSION=? and CALNUM=? group by UID) K "
-        "left join OCCURRENCE O on K.UID=O.UID and K.S=O.DTSTART "
-        "left join EVENT E on E.UID=O.UID and E.VERSION=O.VERSION "
+        "from (select EVTNUM,min(DTSTART) as S from "
+               "OCCURRENCE where VERSION=? and CALNUM=? group by EVTNUM) K "
+        "left join OCCURRENCE O on K.EVTNUM=O.EVTNUM and K.S=O.DTSTART "
+        "left join EVENT E on E.EVTNUM=O.EVTNUM and E.VERSION=O.VERSION "
         "where E.VERSION=? and E.CALNUM=? "
         "order by O.DTSTART";
   sql::Statement select_evt(CALI_HERE,db,sql);
@@ -313,7 +316,8 @@ void write(const char* ical_filename, Db& db, const char* calid, int version)
     const char* summary  = safestr(::sqlite3_column_text(select_evt,1));
     int         sequence =         ::sqlite3_column_int( select_evt,2);
     bool        allday   =         ::sqlite3_column_int( select_evt,3);
-    const char* veventz  = safestr(::sqlite3_column_text(select_evt,4));
+    std::string veventz;
+    zblob_column(select_evt,4,veventz); // Only decompressed here.
     time_t      dtstart  =         ::sqlite3_column_int( select_evt,5);
     time_t      dtend    =         ::sqlite3_column_int( select_evt,6);
 
@@ -321,9 +325,9 @@ void write(const char* ical_filename, Db& db, const char* calid, int version)
 
     int old_sequence = -1;
     icalcomponent* vevent;
-    if(veventz && veventz[0])
+    if(!veventz.empty())
     {
-      vevent = icalparser_parse_string(veventz);
+      vevent = icalparser_parse_string(veventz.c_str());
 
       // Find the old sequence number (if any).
       prop = icalcomponent_get_first_property(vevent,ICAL_SEQUENCE_PROPERTY);
@@ -385,12 +389,10 @@ void write(const char* ical_filename, Db& db, const char* calid, int version)
     // If it's changed, write it back out to the database too.
     if(sequence>old_sequence)
     {
-      q.pushf(
-          "update EVENT set VEVENT='%s' where VERSION=%d and UID='%s'",
-          sql::quote(icalcomponent_as_ical_string(vevent)).c_str(),
-          version,
-          sql::quote(uid).c_str()
-        );
+      std::string blob = zblob_pack(icalcomponent_as_ical_string(vevent));
+      q.update("EVENT")
+          .where("VERSION",version).where("UID",uid)
+          .set("VEVENT",sql::Value::blob(blob));
     }
   }
   
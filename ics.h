@@ -2,31 +2,39 @@
 #define CALENDARI__ICS_H 1
 
 #include <string>
+#include <time.h>
+#include <vector>
 
 struct icalcomponent_impl;
 typedef struct icalcomponent_impl icalcomponent;
+struct sqlite3;
 
 namespace calendari {
   struct Calendari;
   class Db;
+  namespace sql { class StatementCache; }
 }
 
 
 namespace calendari {
 namespace ics {
 
+struct Progress;
+
 
 /** Generate a new unique event ID. */
 std::string generate_uid(void);
 
 /** Parse ical_filename and write the result to db. Calid must be new.
 *   Return the 'calnum' of the calendar we read in, or -1 in the case of
-*   failure. */
+*   failure. Only touches the database, so may be called from the ReadQueue
+*   thread. If 'progress' is set, then it's kept up to date. */
 int subscribe(
     Calendari*   app,
     const char*  ical_filename,
-    Db&          db,
-    int          version=1
+    sqlite3*     db,
+    int          version=1,
+    Progress*    progress=NULL
   );
 
 /** Parse ical_filename and write the result to db. Calid is *made* unique.
@@ -35,19 +43,36 @@ int subscribe(
 int import(
     Calendari*   app,
     const char*  ical_filename,
-    Db&          db,
-    int          version=1
+    sqlite3*     db,
+    int          version=1,
+    Progress*    progress=NULL
   );
 
 /** Reread an existing calendar from ical_filename and write the result to db.
 *   Return the 'calnum' of the calendar we read in, or -1 in the case of
-*   failure. */
+*   failure. If 'removed' is set, then only new and changed events are
+*   written, and the UIDs of events that have gone are put in 'removed'. */
 int reread(
-    Calendari*   app,
-    const char*  ical_filename,
-    Db&          db,
-    const char*  calid,
-    int          version=1
+    Calendari*                 app,
+    const char*                ical_filename,
+    sqlite3*                   db,
+    const char*                calid,
+    int                        version=1,
+    Progress*                  progress=NULL,
+    std::vector<std::string>*  removed=NULL
+  );
+
+/** Extend lazily expanded recurring events, so that OCCURRENCE rows exist
+*   for every instance that starts before 'until'. Uses the connection that
+*   'stmts' belongs to. Returns FALSE if another connection is writing, in
+*   which case nothing is done. Unless 'wait' is set, it doesn't wait for the
+*   write lock at all. Only touches the database, so may be called from the
+*   Loader thread. */
+bool expand(
+    sql::StatementCache&  stmts,
+    time_t                until,
+    int                   version=1,
+    bool                  wait=false
   );
 
 /** Write from the db to ical_filename. */
@@ -0,0 +1,557 @@
+#include "icsscan.h"
+
+#include "tz.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace calendari {
+namespace ics {
+
+namespace {
+
+/** Release pages in steps of at least this many bytes. */
+const size_t RELEASE_STEP = 8*1024*1024;
+
+
+/** Start of the line after the one at 'p'. */
+inline const char* next_line(const char* p, const char* end)
+{
+  const char* nl = static_cast<const char*>(::memchr(p,'\n',end-p));
+  return( nl? nl+1: end );
+}
+
+
+/** End of the line [p,e), without its CR LF. */
+inline const char* trim_eol(const char* p, const char* e)
+{
+  if(e>p && e[-1]=='\n')
+      --e;
+  if(e>p && e[-1]=='\r')
+      --e;
+  return e;
+}
+
+
+/** If [p,e) is "<kw><name>", then set 'name' (in upper case). */
+bool keyword(const char* p, const char* e, const char* kw, std::string& name)
+{
+  const size_t n = ::strlen(kw);
+  e = trim_eol(p,e);
+  if(static_cast<size_t>(e-p)<n || 0!=::strncasecmp(p,kw,n))
+      return false;
+  while(e>p+n && (e[-1]==' ' || e[-1]=='\t'))
+      --e;
+  name.assign(p+n,e);
+  for(size_t i=0; i<name.size(); ++i)
+      if(name[i]>='a' && name[i]<='z')
+          name[i] += 'A'-'a';
+  return true;
+}
+
+
+/** TRUE if [p,e) is 'word', ignoring case. */
+inline bool is(const char* p, const char* e, const char* word)
+{
+  const size_t n = ::strlen(word);
+  return( static_cast<size_t>(e-p)==n && 0==::strncasecmp(p,word,n) );
+}
+
+
+/** Undo TEXT escapes: \\ \; \, \n \N */
+std::string unescape(const char* p, const char* e)
+{
+  std::string s;
+  s.reserve(e-p);
+  for( ; p<e; ++p)
+  {
+    if(*p=='\\' && p+1<e)
+    {
+      ++p;
+      s += ((*p=='n' || *p=='N')? '\n': *p);
+    }
+    else
+    {
+      s += *p;
+    }
+  }
+  return s;
+}
+
+
+/** Find the first 'c' in [p,e) that isn't inside double quotes. */
+const char* find_unquoted(const char* p, const char* e, char c)
+{
+  bool quoted = false;
+  for( ; p<e; ++p)
+  {
+    if(*p=='"')
+        quoted = !quoted;
+    else if(*p==c && !quoted)
+        return p;
+  }
+  return e;
+}
+
+
+/** Parse 'n' digits. */
+bool digits(const char* p, int n, int& v)
+{
+  v = 0;
+  for(int i=0; i<n; ++i)
+  {
+    if(p[i]<'0' || p[i]>'9')
+        return false;
+    v = v*10 + (p[i]-'0');
+  }
+  return true;
+}
+
+
+/** A DTSTART or DTEND. */
+struct Time
+{
+  Time(void): set(false), is_date(false), is_utc(false) {}
+  bool         set;
+  bool         is_date;
+  bool         is_utc;
+  std::string  tzid;
+  tm           wall;
+};
+
+
+/** Parse ';'-separated 'params' and the value of a DTSTART or DTEND. */
+bool parse_time(const char* p, const char* e, const char* v, Time& t)
+{
+  bool want_date = false;
+  while(p<e)
+  {
+    ++p; // ';'
+    const char* pe = find_unquoted(p,e,';');
+    const char* eq = static_cast<const char*>(::memchr(p,'=',pe-p));
+    if(eq)
+    {
+      const char* val = eq+1;
+      const char* val_end = pe;
+      if(val<val_end && *val=='"' && val_end[-1]=='"' && val_end-val>=2)
+      {
+        ++val;
+        --val_end;
+      }
+      if(is(p,eq,"VALUE"))
+      {
+        if(is(val,val_end,"DATE"))
+            want_date = true;
+        else if(!is(val,val_end,"DATE-TIME"))
+            return false;
+      }
+      else if(is(p,eq,"TZID"))
+      {
+        t.tzid.assign(val,val_end);
+      }
+    }
+    p = pe;
+  }
+
+  const size_t n = ::strlen(v);
+  ::memset(&t.wall,0,sizeof(t.wall));
+  int year, mon, day;
+  if(n<8 || !digits(v,4,year) || !digits(v+4,2,mon) || !digits(v+6,2,day))
+      return false;
+  t.wall.tm_year = year - 1900;
+  t.wall.tm_mon  = mon - 1;
+  t.wall.tm_mday = day;
+  if(n==8)
+  {
+    t.is_date = true;
+  }
+  else if(!want_date && (n==15 || (n==16 && v[15]=='Z')) && v[8]=='T')
+  {
+    if(!digits(v+9, 2,t.wall.tm_hour) ||
+       !digits(v+11,2,t.wall.tm_min) ||
+       !digits(v+13,2,t.wall.tm_sec))
+    {
+      return false;
+    }
+    t.is_utc = (n==16);
+  }
+  else
+  {
+    return false;
+  }
+  t.set = true;
+  return true;
+}
+
+
+/** Convert 't' to time_t, as ical2timet() does. */
+bool to_timet(Time& t, time_t& result)
+{
+  if(t.is_date)
+  {
+    // Mid-day, UTC, gets the day right, whatever the timezone.
+    t.wall.tm_hour = 12;
+    result = TimeZone::utc().to_time(t.wall);
+    return true;
+  }
+  const TimeZone* zone;
+  if(t.is_utc)
+      zone = &TimeZone::utc();
+  else if(!t.tzid.empty())
+      zone = TimeZone::find(t.tzid.c_str());
+  else
+      zone = &TimeZone::local();
+  if(!zone)
+      return false; // libical may know it from the file's VTIMEZONEs.
+  result = zone->to_time(t.wall);
+  return true;
+}
+
+} // end anonymous namespace
+
+
+// -- class MappedFile --
+
+MappedFile::MappedFile(const char* path)
+  : _data(NULL), _size(0), _released(0)
+{
+  int fd = ::open(path,O_RDONLY);
+  if(fd<0)
+      return;
+  struct stat st;
+  if(0==::fstat(fd,&st) && S_ISREG(st.st_mode) && st.st_size>0)
+  {
+    void* p = ::mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if(p!=MAP_FAILED)
+    {
+      _data = static_cast<const char*>(p);
+      _size = st.st_size;
+      ::madvise(p,_size,MADV_SEQUENTIAL);
+    }
+  }
+  ::close(fd);
+}
+
+
+MappedFile::~MappedFile(void)
+{
+  if(_data)
+      ::munmap(const_cast<char*>(_data),_size);
+}
+
+
+void
+MappedFile::release(size_t offset)
+{
+  static const size_t page = ::sysconf(_SC_PAGESIZE);
+  offset -= offset % page;
+  if(!_data || offset<_released+RELEASE_STEP)
+      return;
+  ::madvise(const_cast<char*>(_data)+_released,offset-_released,MADV_DONTNEED);
+  _released = offset;
+}
+
+
+// -- class ComponentScanner --
+
+const char*
+ComponentScanner::header(void)
+{
+  _depth = 0;
+  for( ; _pos<_end; _pos=next_line(_pos,_end))
+  {
+    const char* e = next_line(_pos,_end);
+    std::string name;
+    if(keyword(_pos,e,"BEGIN:",name))
+    {
+      if(_depth==1 && name=="VEVENT")
+          break;
+      ++_depth;
+    }
+    else if(keyword(_pos,e,"END:",name))
+    {
+      if(_depth==1)
+          break; // END:VCALENDAR
+      --_depth;
+    }
+  }
+  _depth = 1;
+  return _pos;
+}
+
+
+bool
+ComponentScanner::next(std::string& name, const char*& begin, const char*& end)
+{
+  while(_pos<_end)
+  {
+    const char* line = _pos;
+    _pos = next_line(_pos,_end);
+    std::string n;
+    if(keyword(line,_pos,"BEGIN:",n))
+    {
+      if(_depth++==1)
+      {
+        name  = n;
+        begin = line;
+      }
+    }
+    else if(keyword(line,_pos,"END:",n))
+    {
+      if(--_depth==0)
+          return false; // END:VCALENDAR
+      if(_depth==1)
+      {
+        end = _pos;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+
+// -- class StreamScanner --
+
+StreamScanner::StreamScanner(const char* path)
+  : _file(::fopen(path,"r")), _depth(0), _line(), _unread(false)
+{}
+
+
+StreamScanner::~StreamScanner(void)
+{
+  if(_file)
+      ::fclose(_file);
+}
+
+
+void
+StreamScanner::header(std::string& text)
+{
+  text.clear();
+  _depth = 0;
+  while(read_line())
+  {
+    const char* p = _line.data();
+    const char* e = p + _line.size();
+    std::string name;
+    if(keyword(p,e,"BEGIN:",name))
+    {
+      if(_depth==1 && name=="VEVENT")
+      {
+        _unread = true;
+        break;
+      }
+      ++_depth;
+    }
+    else if(keyword(p,e,"END:",name))
+    {
+      if(_depth==1)
+      {
+        _unread = true;
+        break; // END:VCALENDAR
+      }
+      --_depth;
+    }
+    text += _line;
+  }
+  _depth = 1;
+}
+
+
+bool
+StreamScanner::next(std::string& name, std::string& text)
+{
+  while(read_line())
+  {
+    const char* p = _line.data();
+    const char* e = p + _line.size();
+    std::string n;
+    if(keyword(p,e,"BEGIN:",n))
+    {
+      if(_depth++==1)
+      {
+        name = n;
+        text.clear();
+      }
+    }
+    else if(keyword(p,e,"END:",n))
+    {
+      if(--_depth==0)
+          return false; // END:VCALENDAR
+      if(_depth==1)
+      {
+        text += _line;
+        return true;
+      }
+    }
+    if(_depth>1)
+        text += _line;
+  }
+  return false;
+}
+
+
+bool
+StreamScanner::read_line(void)
+{
+  if(_unread)
+  {
+    _unread = false;
+    return true;
+  }
+  _line.clear();
+  char buf[4096];
+  while(::fgets(buf,sizeof(buf),_file))
+  {
+    _line += buf;
+    if(_line[_line.size()-1]=='\n')
+        break;
+  }
+  return !_line.empty();
+}
+
+
+// -- find_line() --
+
+const char*
+find_line(const char* begin, const char* end, const char* prefix)
+{
+  const size_t n = ::strlen(prefix);
+  for(const char* p=begin; p<end; ++p)
+  {
+    p = static_cast<const char*>(::memmem(p,end-p,prefix,n));
+    if(!p)
+        break;
+    if(p==begin || p[-1]=='\n')
+        return p;
+  }
+  return end;
+}
+
+
+// -- split_vevents() --
+
+std::vector<const char*>
+split_vevents(const char* begin, const char* end, size_t bytes)
+{
+  std::vector<const char*> cuts(1,begin);
+  while(static_cast<size_t>(end-cuts.back()) > bytes)
+  {
+    const char* cut = find_line(
+        next_line(cuts.back()+bytes,end),end,"BEGIN:VEVENT");
+    if(cut==end)
+        break;
+    cuts.push_back(cut);
+  }
+  return cuts;
+}
+
+
+// -- scan_vevent() --
+
+bool
+scan_vevent(const char* begin, const char* end, VeventFields& fields)
+{
+  bool have_uid = false;
+  bool have_summary = false;
+  Time dtstart;
+  Time dtend;
+  fields.sequence = 1;
+
+  int depth = 0;
+  std::string unfolded;
+  for(const char* p=begin; p<end; )
+  {
+    // Find the logical line [ls,le), unfolding it if necessary.
+    const char* e = next_line(p,end);
+    const char* ls = p;
+    const char* le = trim_eol(p,e);
+    if(e<end && (*e==' ' || *e=='\t'))
+    {
+      unfolded.assign(ls,le);
+      while(e<end && (*e==' ' || *e=='\t'))
+      {
+        const char* e2 = next_line(e,end);
+        unfolded.append(e+1,trim_eol(e+1,e2));
+        e = e2;
+      }
+      ls = unfolded.data();
+      le = ls + unfolded.size();
+    }
+    p = e;
+
+    std::string comp;
+    if(keyword(ls,le,"BEGIN:",comp))
+    {
+      ++depth;
+      continue;
+    }
+    if(keyword(ls,le,"END:",comp))
+    {
+      --depth;
+      continue;
+    }
+    if(depth!=1)
+        continue; // A VALARM's properties, say.
+
+    // NAME;PARAM=...:VALUE
+    const char* ne = ls;
+    while(ne<le && *ne!=';' && *ne!=':')
+        ++ne;
+    const char* colon = find_unquoted(ne,le,':');
+    if(colon==le)
+        return false;
+    const char* value = colon+1;
+
+    if(is(ls,ne,"UID") && !have_uid)
+    {
+      fields.uid = unescape(value,le);
+      have_uid = true;
+    }
+    else if(is(ls,ne,"SUMMARY") && !have_summary)
+    {
+      fields.summary = unescape(value,le);
+      have_summary = true;
+    }
+    else if(is(ls,ne,"SEQUENCE"))
+    {
+      char* tail;
+      std::string v(value,le);
+      fields.sequence = ::strtol(v.c_str(),&tail,10);
+      if(v.empty() || *tail)
+          return false;
+    }
+    else if(is(ls,ne,"DTSTART") || is(ls,ne,"DTEND"))
+    {
+      Time& t = (is(ls,ne,"DTSTART")? dtstart: dtend);
+      if(!t.set && !parse_time(ne,colon,std::string(value,le).c_str(),t))
+          return false;
+    }
+    else if(is(ls,ne,"RRULE") || is(ls,ne,"RDATE") ||
+            is(ls,ne,"EXRULE") || is(ls,ne,"DURATION"))
+    {
+      return false;
+    }
+  }
+
+  // Leave the warnings about missing properties to libical's path.
+  if(!have_uid || fields.uid.empty() || !have_summary)
+      return false;
+  if(!dtstart.set || !dtend.set)
+      return false;
+  fields.all_day = dtstart.is_date;
+  if(!to_timet(dtstart,fields.dtstart) || !to_timet(dtend,fields.dtend))
+      return false;
+  if(dtend.is_date)
+      fields.dtend -= 86400; // iCal allday events end the day after.
+  return( fields.dtend >= fields.dtstart );
+}
+
+
+} } // end namespace calendari::ics
@@ -0,0 +1,142 @@
+#ifndef CALENDARI__ICS__ICSSCAN_H
+#define CALENDARI__ICS__ICSSCAN_H 1
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <time.h>
+#include <vector>
+
+namespace calendari {
+namespace ics {
+
+
+/** A read-only memory map of a whole file. */
+class MappedFile
+{
+public:
+  explicit MappedFile(const char* path);
+  ~MappedFile(void);
+
+  /** FALSE if the file could not be mapped, e.g. it's empty or a pipe. */
+  bool is_open(void) const { return _data!=NULL; }
+  const char* data(void) const { return _data; }
+  size_t size(void) const { return _size; }
+
+  /** The bytes before 'offset' won't be read again, so the kernel may drop
+  *   their pages. Keeps resident memory flat while a big file is read. */
+  void release(size_t offset);
+
+private:
+  const char*  _data;
+  size_t       _size;
+  size_t       _released; ///< Bytes already released.
+
+  MappedFile(const MappedFile&); // Not copyable
+  MappedFile& operator=(const MappedFile&);
+};
+
+
+/** Finds the components of an iCalendar file's VCALENDAR, without parsing
+*   them. Only looks at the start of each line, so it's about as fast as
+*   reading the file. */
+class ComponentScanner
+{
+public:
+  /** Set 'in_calendar' if 'begin' is already inside the VCALENDAR, e.g.
+  *   where header() left off. */
+  ComponentScanner(const char* begin, const char* end, bool in_calendar=false)
+    : _pos(begin), _end(end), _depth(in_calendar? 1: 0)
+    {}
+
+  /** Skip the calendar's own properties and any VTIMEZONEs that come first,
+  *   up to its first VEVENT. Returns where they end. */
+  const char* header(void);
+
+  /** Find the next component. Sets 'name' (in upper case) and the range of
+  *   its text, from its BEGIN line to the end of its END line. Returns FALSE
+  *   at the end of the VCALENDAR. */
+  bool next(std::string& name, const char*& begin, const char*& end);
+
+  /** How far the scanner has got. */
+  const char* pos(void) const { return _pos; }
+
+private:
+  const char*  _pos;
+  const char*  _end;
+  int          _depth;
+};
+
+
+/** As ComponentScanner, but for a file that can't be mapped, such as a pipe.
+*   Reads a line at a time, and only holds one component's text. */
+class StreamScanner
+{
+public:
+  explicit StreamScanner(const char* path);
+  ~StreamScanner(void);
+
+  /** FALSE if the file could not be opened. */
+  bool is_open(void) const { return _file!=NULL; }
+
+  /** Read the calendar's own properties and any VTIMEZONEs that come first,
+  *   up to its first VEVENT, into 'text'. */
+  void header(std::string& text);
+
+  /** Read the next component into 'text', from its BEGIN line to the end of
+  *   its END line, and set 'name' (in upper case). Returns FALSE at the end
+  *   of the VCALENDAR. */
+  bool next(std::string& name, std::string& text);
+
+private:
+  FILE*        _file;
+  int          _depth;
+  std::string  _line;
+  bool         _unread; ///< _line was read, but not used yet.
+
+  /** Read the next line into _line. Returns FALSE at the end of the file. */
+  bool read_line(void);
+
+  StreamScanner(const StreamScanner&); // Not copyable
+  StreamScanner& operator=(const StreamScanner&);
+};
+
+
+/** Start of the first line in [begin,end) that starts with 'prefix', or
+*   'end' if there is none. 'begin' must be the start of a line. */
+const char* find_line(const char* begin, const char* end, const char* prefix);
+
+
+/** Cut the components in [begin,end) into pieces of about 'bytes' each.
+*   Cuts only come before "BEGIN:VEVENT" lines, so no component is split.
+*   Returns the cut points: 'begin', then the start of each further piece. */
+std::vector<const char*> split_vevents(
+    const char*  begin,
+    const char*  end,
+    size_t       bytes
+  );
+
+
+/** The properties of a VEVENT that Reader::load() needs. */
+struct VeventFields
+{
+  std::string  uid;
+  std::string  summary;
+  int          sequence;
+  bool         all_day;
+  time_t       dtstart;
+  time_t       dtend; ///< All-day events end on the last day, not the next.
+};
+
+
+/** Scan the text of a VEVENT for its UID, SUMMARY, SEQUENCE, DTSTART and
+*   DTEND, with the same meanings as Reader::load() gives them via libical.
+*   Returns FALSE if the event needs libical after all: if it recurs, has a
+*   DURATION, a TZID that TimeZone can't find, or anything else that the
+*   scanner doesn't understand. */
+bool scan_vevent(const char* begin, const char* end, VeventFields& fields);
+
+
+} } // end namespace calendari::ics
+
+#endif // CALENDARI__ICS__ICSSCAN_H
@@ -0,0 +1,267 @@
+#include "loader.h"
+
+#include "calendari.h"
+#include "db.h"
+#include "err.h"
+#include "ics.h"
+#include "queue.h"
+#include "sql.h"
+
+#include <cassert>
+#include <memory>
+
+namespace calendari {
+
+
+Loader::Loader(Calendari& app, const char* dbname)
+  : _app(app),
+    _sdb(NULL),
+    _thread(NULL),
+    _mutex(g_mutex_new()),
+    _cond(g_cond_new()),
+    _pending(NULL),
+    _quit(false),
+    _generation(0),
+    _requested(false)
+{
+  if(SQLITE_OK != ::sqlite3_open_v2(dbname,&_sdb,SQLITE_OPEN_READWRITE,NULL))
+  {
+    CALI_WARN(0,"Loader failed to open database %s",dbname);
+    return;
+  }
+  // Other connections hold the write lock while they expand or insert.
+  ::sqlite3_busy_timeout(_sdb,sql::BUSY_TIMEOUT);
+  GError* error = NULL;
+  _thread = g_thread_create(run,this,true,&error);
+  if(!_thread)
+  {
+    CALI_WARN(0,"Failed to start loader thread: %s",error->message);
+    g_error_free(error);
+  }
+}
+
+
+Loader::~Loader(void)
+{
+  if(_thread)
+  {
+    g_mutex_lock(_mutex);
+    _quit = true;
+    g_cond_signal(_cond);
+    g_mutex_unlock(_mutex);
+    g_thread_join(_thread);
+  }
+  delete _pending;
+  for(std::list<Job*>::iterator j=_prefetch.begin(); j!=_prefetch.end(); ++j)
+      delete *j;
+  ::sqlite3_close(_sdb);
+  g_cond_free(_cond);
+  g_mutex_free(_mutex);
+}
+
+
+void
+Loader::request(time_t begin, time_t end, int version, time_t expand)
+{
+  if(!_thread)
+      return;
+  // Don't restart a query that is already under way.
+  if(_requested &&
+     begin==_request.begin && end==_request.end && version==_request.version)
+  {
+    return;
+  }
+  // The thread can only see changes once they are in the database.
+  Queue::inst().flush();
+
+  std::auto_ptr<Job> job( new Job() );
+  job->loader     = this;
+  g_atomic_int_inc(&_generation); // Only ever changed in the main thread.
+  job->generation = g_atomic_int_get(&_generation);
+  job->serial     = _app.db->serial();
+  job->begin      = begin;
+  job->end        = end;
+  job->version    = version;
+  job->prefetch   = false;
+  job->expand     = expand;
+  _request  = *job;
+  _requested = true;
+
+  g_mutex_lock(_mutex);
+  delete _pending; // Never started, so just drop it.
+  _pending = job.release();
+  g_cond_signal(_cond);
+  g_mutex_unlock(_mutex);
+}
+
+
+void
+Loader::prefetch(
+    const std::vector< std::pair<time_t,time_t> >&  periods,
+    int                                             version,
+    time_t                                          expand
+  )
+{
+  if(!_thread)
+      return;
+  std::list<Job*> jobs;
+  typedef std::vector< std::pair<time_t,time_t> >::const_iterator PIt;
+  for(PIt p=periods.begin(); p!=periods.end(); ++p)
+  {
+    Job* job = new Job();
+    job->loader     = this;
+    job->generation = g_atomic_int_get(&_generation);
+    job->serial     = _app.db->serial();
+    job->begin      = p->first;
+    job->end        = p->second;
+    job->version    = version;
+    job->prefetch   = true;
+    job->expand     = expand;
+    jobs.push_back(job);
+  }
+  if(!jobs.empty())
+      Queue::inst().flush();
+
+  g_mutex_lock(_mutex);
+  _prefetch.swap(jobs);
+  if(!_prefetch.empty())
+      g_cond_signal(_cond);
+  g_mutex_unlock(_mutex);
+
+  // Discard the old jobs.
+  for(std::list<Job*>::iterator j=jobs.begin(); j!=jobs.end(); ++j)
+      delete *j;
+}
+
+
+bool
+Loader::stale(const Job& job)
+{
+  return job.generation != g_atomic_int_get(&_generation);
+}
+
+
+void
+Loader::expand(sql::StatementCache& stmts, Job& job)
+{
+  if(!job.expand || stale(job))
+      return;
+  // Wait for the write lock, but leave the events for a later request if
+  // a calendar is being read for longer than that.
+  if(!ics::expand(stmts,job.expand,job.version,true))
+      job.expand = 0;
+}
+
+
+bool
+Loader::query(sql::StatementCache& stmts, Job& job)
+{
+  sqlite3* sdb = stmts.db();
+  sql::CachedStatement select_stmt(CALI_HERE,stmts,_app.db->find_sql());
+  sql::bind_int64(CALI_HERE,sdb,select_stmt,1,job.begin);
+  sql::bind_int64(CALI_HERE,sdb,select_stmt,2,job.end);
+  sql::bind_int(  CALI_HERE,sdb,select_stmt,3,job.version);
+
+  OccurrenceRow row;
+  for(size_t n=0; ; ++n)
+  {
+    // Give up as soon as the user has moved on.
+    if(n%256==0 && stale(job))
+        return false;
+    int return_code = ::sqlite3_step(select_stmt);
+    if(return_code==SQLITE_ROW)
+    {
+      row.read(select_stmt);
+      job.rows.push_back(row);
+    }
+    else if(return_code==SQLITE_DONE)
+    {
+      return true;
+    }
+    else
+    {
+      calendari::sql::error(CALI_HERE,sdb);
+      return false;
+    }
+  }
+}
+
+
+gpointer
+Loader::run(gpointer data)
+{
+  util::set_background_thread();
+  Loader& self = *static_cast<Loader*>(data);
+  {
+    // The thread's statements must be finalized before it exits.
+    sql::StatementCache stmts(self._sdb);
+    g_mutex_lock(self._mutex);
+    while(!self._quit)
+    {
+      Job* job = self._pending;
+      if(job)
+      {
+        self._pending = NULL;
+      }
+      else if(!self._prefetch.empty())
+      {
+        job = self._prefetch.front();
+        self._prefetch.pop_front();
+      }
+      else
+      {
+        g_cond_wait(self._cond,self._mutex);
+        continue;
+      }
+      g_mutex_unlock(self._mutex);
+
+      self.expand(stmts,*job);
+      if(self.query(stmts,*job))
+          (void)g_idle_add(deliver,job);
+      else
+          delete job;
+
+      g_mutex_lock(self._mutex);
+    }
+    g_mutex_unlock(self._mutex);
+  }
+  return NULL;
+}
+
+
+gboolean
+Loader::deliver(gpointer data)
+{
+  std::auto_ptr<Job> job( static_cast<Job*>(data) );
+  Loader& self = *job->loader;
+  if(self.stale(*job))
+      return false;
+  Db& db = *self._app.db;
+  if(job->prefetch)
+  {
+    // Keep the rows unless they may be out of date. No need to redraw.
+    if(job->serial == db.serial())
+    {
+      if(job->expand)
+          db.expanded(job->expand,job->version);
+      db.loaded(job->begin,job->end,job->rows,job->version);
+    }
+    return false;
+  }
+  self._requested = false;
+
+  if(job->serial != db.serial())
+  {
+    // Occurrences changed while we were reading. The rows may be out of date.
+    self.request(job->begin,job->end,job->version);
+    return false;
+  }
+  if(job->expand)
+      db.expanded(job->expand,job->version);
+  db.loaded(job->begin,job->end,job->rows,job->version);
+  self._app.queue_main_redraw(true);
+  return false;
+}
+
+
+} // end namespace calendari
@@ -0,0 +1,101 @@
+#ifndef CALENDARI__LOADER_H
+#define CALENDARI__LOADER_H 1
+
+#include "db.h"
+
+#include <gtk/gtk.h>
+#include <list>
+#include <sqlite3.h>
+#include <utility>
+#include <vector>
+
+namespace calendari {
+
+namespace sql { class StatementCache; }
+struct Calendari;
+
+
+/** Background thread that reads occurrences from the database, so that
+*   Db::find() never blocks the GTK main loop.
+*
+*   The thread has its own connection. With it, the thread first expands
+*   recurring events as far as a request needs, and then reads the rows.
+*   Results are posted back to the main thread with g_idle_add(), where they
+*   are handed to Db::expanded() & Db::loaded() and the main view is reloaded.
+*   Only the most recent request matters: older requests are abandoned as soon
+*   as a new one arrives. */
+class Loader
+{
+public:
+  Loader(Calendari& app, const char* dbname);
+  ~Loader(void);
+
+  /** FALSE if the thread could not be started. */
+  bool running(void) const
+    { return _thread!=NULL; }
+
+  /** Ask for the occurrences in [begin,end) to be loaded. Supersedes any
+  *   earlier request. Unless 'expand' is zero, recurring events are first
+  *   expanded up to that time. */
+  void request(time_t begin, time_t end, int version=1, time_t expand=0);
+
+  /** Read these periods when there are no requests to serve. Replaces any
+  *   periods from earlier calls that have not yet been read. 'expand' is as
+  *   for request(). */
+  void prefetch(
+      const std::vector< std::pair<time_t,time_t> >&  periods,
+      int                                             version=1,
+      time_t                                          expand=0
+    );
+
+private:
+  /** A request, and then its results. */
+  struct Job
+  {
+    Loader*                     loader;
+    int                         generation;
+    unsigned                    serial; ///< Db::serial() when requested.
+    time_t                      begin;
+    time_t                      end;
+    int                         version;
+    bool                        prefetch;
+    /** Expand recurring events up to here first. Zero if there's no need,
+    *   or if the expansion failed. */
+    time_t                      expand;
+    std::vector<OccurrenceRow>  rows;
+  };
+
+  Calendari&   _app;
+  sqlite3*     _sdb; ///< Connection used by the thread.
+  GThread*     _thread;
+  GMutex*      _mutex;
+  GCond*       _cond;
+  /** Next job for the thread, if any. Protected by _mutex. */
+  Job*         _pending;
+  /** Jobs to do when there's nothing _pending. Protected by _mutex. */
+  std::list<Job*>  _prefetch;
+  /** Protected by _mutex. */
+  bool         _quit;
+  /** Identifies the latest request. Older jobs are stale. */
+  volatile gint _generation;
+  /** The latest request, while it's being served. Main thread only. */
+  Job          _request;
+  bool         _requested;
+
+  Loader(const Loader&); // Not copyable
+  Loader& operator=(const Loader&);
+
+  bool stale(const Job& job);
+  /** Runs in the thread: expand recurring events for 'job'. */
+  void expand(sql::StatementCache& stmts, Job& job);
+  /** Runs in the thread: read the rows for 'job'. FALSE if abandoned. */
+  bool query(sql::StatementCache& stmts, Job& job);
+
+  static gpointer run(gpointer self);
+  static gboolean deliver(gpointer job);
+};
+
+
+} // end namespace calendari
+
+#endif // CALENDARI__LOADER_H
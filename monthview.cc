@@ -111,8 +111,11 @@ MonthView::set(time_t self_time)
   }
 
   // load events for this time period.
-  std::multimap<time_t,Occurrence*> all =
-      cal.db->find( day[0].start, normalise_local_tm(i) );
+  time_t begin, end;
+  period(self_time,0,begin,end);
+  assert(begin==day[0].start);
+  std::multimap<time_t,Occurrence*> all = cal.db->find(begin,end);
+  prefetch(self_time);
 
   typedef std::multimap<time_t,Occurrence*>::const_reverse_iterator OIt;
   OIt o = all.rbegin();
@@ -140,6 +143,52 @@ MonthView::set(time_t self_time)
 }
 
 
+void
+MonthView::period(time_t t, int offset, time_t& begin, time_t& end) const
+{
+  struct tm i;
+  localtime_r(&t,&i);
+  i.tm_hour = 0;
+  i.tm_min  = 0;
+  i.tm_sec  = 0;
+  i.tm_mday = 1;
+  i.tm_mon += offset;
+  normalise_local_tm(i);
+  const int mon = i.tm_mon;
+
+  // Wind back to the first day of the week.
+  int first_day_of_week = cal.setting->week_starts(); // 0=Sunday, 1=Monday
+  i.tm_mday -= (i.tm_wday + 7 - first_day_of_week) % 7;
+  begin = normalise_local_tm(i);
+
+  // Forward to the end of the last week in the month. (Same as set().)
+  for(int cell=0; cell<MAX_CELLS; ++cell)
+  {
+    normalise_local_tm(i);
+    if(cell>7 && cell%7 == 0 && i.tm_mon != mon)
+        break;
+    ++i.tm_mday;
+  }
+  end = normalise_local_tm(i);
+}
+
+
+void
+MonthView::prefetch(time_t t) const
+{
+  std::vector< std::pair<time_t,time_t> > periods;
+  for(int k=1; k<=PREFETCH_PERIODS; ++k)
+  {
+    time_t begin, end;
+    period(t,k,begin,end);
+    periods.push_back(std::make_pair(begin,end));
+    period(t,-k,begin,end);
+    periods.push_back(std::make_pair(begin,end));
+  }
+  cal.db->prefetch(periods);
+}
+
+
 void
 MonthView::draw(GtkWidget* widget, cairo_t* cr)
 {
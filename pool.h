@@ -0,0 +1,174 @@
+#ifndef CALENDARI__POOL_H
+#define CALENDARI__POOL_H 1
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace calendari {
+
+
+/** Allocator statistics, for a Pool or a sum of Pools. */
+struct PoolStats
+{
+  PoolStats(void): live(0), peak(0), blocks(0), bytes(0) {}
+
+  size_t  live;   ///< Objects allocated and not yet destroyed.
+  size_t  peak;   ///< Most objects that have been live at once.
+  size_t  blocks; ///< Blocks currently held.
+  size_t  bytes;  ///< Size of those blocks.
+
+  PoolStats& operator+=(const PoolStats& v)
+    {
+      live   += v.live;
+      peak   += v.peak;
+      blocks += v.blocks;
+      bytes  += v.bytes;
+      return *this;
+    }
+};
+
+
+/** Arena for objects of type T. Objects are carved out of blocks, which
+*   double in size up to MAX_BLOCK objects, so that a calendar's objects lie
+*   next to each other in memory. Destroyed objects' slots are re-used, and
+*   once the last object is destroyed all of the blocks are freed at once.
+*
+*   Each slot records its Pool, so that destroy() needs only the object. So a
+*   Pool must not be deleted (or moved) while it has live objects. Not
+*   thread safe.
+*
+*     T* t = new (pool.allocate()) T(...);
+*     Pool<T>::destroy(t); */
+template<class T>
+class Pool
+{
+public:
+  /** Objects in the first block. */
+  static const size_t MIN_BLOCK = 16;
+  /** Most objects in any block. */
+  static const size_t MAX_BLOCK = 4096;
+
+  Pool(void): _free(NULL), _next(0), _end(0) {}
+  ~Pool(void)
+    {
+      assert(_stats.live==0);
+      _release();
+    }
+
+  /** Storage for one T. Construct it with placement new. */
+  void* allocate(void)
+    {
+      Slot* slot = _free;
+      if(slot)
+      {
+        _free = slot->u.next;
+      }
+      else
+      {
+        if(_next==_end)
+            _grow();
+        slot = _blocks.back() + _next++;
+      }
+      slot->pool = this;
+      if(++_stats.live > _stats.peak)
+          _stats.peak = _stats.live;
+      return slot->u.data;
+    }
+
+  /** Destroy 't', and return its storage to the Pool it came from. */
+  static void destroy(T* t)
+    {
+      if(!t)
+          return;
+      t->~T();
+      Slot* slot = _slot(t);
+      slot->pool->_deallocate(slot);
+    }
+
+  /** The Pool that 't' came from. */
+  static const Pool* owner(const T* t)
+    { return _slot(t)->pool; }
+
+  /** Free all of the blocks at once. Every live object must already have
+  *   been destroyed in place, by calling ~T() directly. */
+  void clear(void)
+    {
+      _stats.live = 0;
+      _release();
+    }
+
+  const PoolStats& stats(void) const
+    { return _stats; }
+
+private:
+  struct Slot
+  {
+    Pool*  pool;
+    union
+    {
+      Slot*      next; ///< Next free slot.
+      double     align_d;
+      long long  align_ll;
+      void*      align_p;
+      char       data[sizeof(T)];
+    } u;
+  };
+
+  Slot*               _free;   ///< List of destroyed objects' slots.
+  std::vector<Slot*>  _blocks;
+  size_t              _next;   ///< Next unused slot in _blocks.back().
+  size_t              _end;    ///< Number of slots in _blocks.back().
+  PoolStats           _stats;
+
+  Pool(const Pool&); // Not copyable
+  Pool& operator=(const Pool&);
+
+  static Slot* _slot(const T* t)
+    {
+      return reinterpret_cast<Slot*>(
+          const_cast<char*>(reinterpret_cast<const char*>(t)) -
+          offsetof(Slot,u) );
+    }
+
+  void _deallocate(Slot* slot)
+    {
+      assert(_stats.live>0);
+      if(--_stats.live==0)
+      {
+        _release(); // Everything's gone, so free the blocks in one go.
+        return;
+      }
+      slot->u.next = _free;
+      _free = slot;
+    }
+
+  void _grow(void)
+    {
+      size_t n = (_end? _end*2: MIN_BLOCK);
+      if(n>MAX_BLOCK)
+          n = MAX_BLOCK;
+      _blocks.push_back(new Slot[n]);
+      _next = 0;
+      _end = n;
+      ++_stats.blocks;
+      _stats.bytes += n*sizeof(Slot);
+    }
+
+  void _release(void)
+    {
+      for(size_t i=0; i<_blocks.size(); ++i)
+          delete[] _blocks[i];
+      _blocks.clear();
+      _free = NULL;
+      _next = _end = 0;
+      _stats.blocks = 0;
+      _stats.bytes = 0;
+    }
+};
+
+
+} // end namespace calendari
+
+#endif // CALENDARI__POOL_H
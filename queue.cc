@@ -4,13 +4,133 @@
 #include "err.h"
 #include "sql.h"
 
-#include <cstdarg>
-#include <cstdio>
+#include <algorithm>
+#include <cassert>
 #include <gtk/gtk.h>
+#include <map>
 
 namespace calendari {
 
 
+// -- struct Queue::Change --
+
+std::string
+Queue::Change::sql(void) const
+{
+  std::string result;
+  std::vector<Column>::const_iterator c;
+  switch(op)
+  {
+    case INSERT:
+      result = "insert into " + table + " (";
+      for(c=value.begin(); c!=value.end(); ++c)
+          result += (c==value.begin()? "": ",") + c->first;
+      result += ") values (";
+      for(c=value.begin(); c!=value.end(); ++c)
+          result += (c==value.begin()? "?": ",?");
+      result += ")";
+      return result;
+    case UPDATE:
+      result = "update " + table + " set ";
+      for(c=value.begin(); c!=value.end(); ++c)
+          result += (c==value.begin()? "": ",") + c->first + "=?";
+      break;
+    case DELETE:
+      result = "delete from " + table;
+      break;
+  }
+  for(c=key.begin(); c!=key.end(); ++c)
+      result += (c==key.begin()? " where ": " and ") + c->first + "=?";
+  if(op==DELETE && !unreferenced_by.empty())
+  {
+    result += " and not exists (select 1 from " + unreferenced_by;
+    for(c=key.begin(); c!=key.end(); ++c)
+    {
+      result += (c==key.begin()? " where ": " and ");
+      result += unreferenced_by + "." + c->first + "=" + table + "." + c->first;
+    }
+    result += ")";
+  }
+  return result;
+}
+
+
+int
+Queue::Change::bind(sqlite3_stmt* stmt) const
+{
+  int idx = 1;
+  int return_code = SQLITE_OK;
+  std::vector<Column>::const_iterator c;
+  if(op!=DELETE)
+      for(c=value.begin(); return_code==SQLITE_OK && c!=value.end(); ++c)
+          return_code = c->second.bind(stmt,idx++);
+  if(op!=INSERT)
+      for(c=key.begin(); return_code==SQLITE_OK && c!=key.end(); ++c)
+          return_code = c->second.bind(stmt,idx++);
+  return return_code;
+}
+
+
+bool
+Queue::Change::same_sql(const Change& c) const
+{
+  if(op!=c.op || table!=c.table || unreferenced_by!=c.unreferenced_by ||
+     key.size()!=c.key.size() || value.size()!=c.value.size())
+  {
+    return false;
+  }
+  for(size_t i=0; i<key.size(); ++i)
+      if(key[i].first!=c.key[i].first)
+          return false;
+  for(size_t i=0; i<value.size(); ++i)
+      if(value[i].first!=c.value[i].first)
+          return false;
+  return true;
+}
+
+
+bool
+Queue::Change::same_row(const Change& c) const
+{
+  return op==UPDATE && c.op==UPDATE && table==c.table && key==c.key;
+}
+
+
+bool
+Queue::Change::sets_key_of(const Change& c) const
+{
+  if(op!=UPDATE)
+      return false;
+  std::vector<Column>::const_iterator v,k;
+  for(v=value.begin(); v!=value.end(); ++v)
+      for(k=c.key.begin(); k!=c.key.end(); ++k)
+          if(v->first==k->first)
+              return true;
+  return false;
+}
+
+
+void
+Queue::Change::merge(const Change& later)
+{
+  assert(same_row(later));
+  std::vector<Column>::const_iterator l;
+  for(l=later.value.begin(); l!=later.value.end(); ++l)
+  {
+    std::vector<Column>::iterator v;
+    for(v=value.begin(); v!=value.end(); ++v)
+        if(v->first==l->first)
+            break;
+    if(v==value.end())
+        value.push_back(*l);
+    else
+        v->second = l->second;
+  }
+}
+
+
+// -- class Queue --
+
 bool
 Queue::idle(void*)
 {
@@ -28,43 +148,198 @@ Queue::set_db(Db* db)
 }
 
 
-void
-Queue::push(const std::string& sql)
+Queue::Change&
+Queue::push(Change::Op op, const char* table)
 {
   // Hook-in idle processing.
   (void)g_idle_add((GSourceFunc)idle,(gpointer)this);
 
-  _changes.push_back(sql);
-  printf("%s\n",sql.c_str());
+  _changes.push_back(Change(op,table));
+  return _changes.back();
+}
+
+
+bool
+Queue::flush(void)
+{
+  if(_changes.empty())
+      return true;
+  coalesce();
+  group();
+  sqlite3* sdb = *_db;
+  if(!sql::try_begin(CALI_HERE,sdb))
+  {
+    // A calendar is being read in the background. Try again later.
+    (void)g_timeout_add(RETRY_MS,(GSourceFunc)idle,(gpointer)this);
+    return false;
+  }
+  // sql::error() doesn't throw, so check every result code here. Nothing
+  // is committed unless every change succeeds.
+  int return_code = SQLITE_OK;
+  try
+  {
+    // Each group of changes with the same SQL shares a statement.
+    typedef std::list<Change>::const_iterator CIt;
+    CIt c = _changes.begin();
+    while(return_code==SQLITE_OK && c!=_changes.end())
+    {
+      const std::string sql = c->sql();
+      sql::CachedStatement stmt(CALI_HERE,_db->statements(),sql.c_str());
+      const CIt first = c;
+      do{
+        return_code = c->bind(stmt);
+        if(return_code==SQLITE_OK)
+            return_code = ::sqlite3_step(stmt);
+        if(return_code==SQLITE_DONE || return_code==SQLITE_CONSTRAINT)
+            return_code = SQLITE_OK; // As sql::step_reset().
+        else
+            sql::error(CALI_HERE,sdb); // Report it before the reset.
+        ::sqlite3_reset(stmt);
+        ++c;
+      }while(return_code==SQLITE_OK && c!=_changes.end() &&
+             c->same_sql(*first));
+    }
+    if(return_code==SQLITE_OK)
+    {
+      return_code = ::sqlite3_exec(sdb,"commit",0,0,0);
+      if(return_code!=SQLITE_OK)
+          sql::error(CALI_HERE,sdb);
+    }
+  }
+  catch(...)
+  {
+    try{ sql::exec(CALI_HERE,sdb,"rollback"); } catch(...) {}
+    throw;
+  }
+  if(return_code!=SQLITE_OK)
+  {
+    // Keep the changes, so that they are not lost.
+    ::sqlite3_exec(sdb,"rollback",0,0,0);
+    return false;
+  }
+  // Only forget the changes once they are committed.
+  _changes.clear();
+  return true;
+}
+
+
+Queue::Pending
+Queue::pending(
+    const char*                 table,
+    const std::vector<Column>&  key,
+    const char*                 column,
+    const sql::Value*&          value
+  ) const
+{
+  // The latest change wins.
+  typedef std::list<Change>::const_reverse_iterator CIt;
+  for(CIt c=_changes.rbegin(); c!=_changes.rend(); ++c)
+  {
+    if(c->table!=table)
+        continue;
+    // An INSERT names its row in its values.
+    const std::vector<Column>& row = (c->op==Change::INSERT? c->value: c->key);
+    bool match = true;
+    for(size_t k=0; match && k<key.size(); ++k)
+        match = (std::find(row.begin(),row.end(),key[k])!=row.end());
+    if(!match)
+        continue;
+    if(c->op==Change::DELETE)
+        return DELETED;
+    std::vector<Column>::const_iterator v;
+    for(v=c->value.begin(); v!=c->value.end(); ++v)
+        if(v->first==column)
+        {
+          value = &v->second;
+          return QUEUED;
+        }
+  }
+  return NOT_QUEUED;
 }
 
 
 void
-Queue::pushf(const char* format, ...)
+Queue::coalesce(void)
 {
-  va_list args;
-  va_start(args,format);
-  char buf[0x1000];
-  int ret = vsnprintf(buf,sizeof(buf),format,args);
-  if(ret >= static_cast<int>(sizeof(buf)))
-      CALI_ERRO(1,0,"SQL too large for buffer."); //??
-  push(buf);
-  va_end(args);
+  // A later UPDATE may be merged into an earlier one to the same row, so long
+  // as it can be moved past every intervening change to the same table. That's
+  // only safe when the intervening change is an UPDATE that identifies its
+  // rows by the same key columns, and neither change alters the other's key.
+  typedef std::list<Change>::iterator CIt;
+  std::map< std::string,std::vector<CIt> > open; // Updates, by table.
+  CIt c = _changes.begin();
+  while(c!=_changes.end())
+  {
+    std::vector<CIt>& updates = open[c->table];
+    if(c->op!=Change::UPDATE)
+    {
+      updates.clear();
+      if(!c->unreferenced_by.empty())
+          open[c->unreferenced_by].clear();
+      ++c;
+      continue;
+    }
+    bool merged = false;
+    for(std::vector<CIt>::size_type i=updates.size(); i-- >0; )
+    {
+      Change& u = *updates[i];
+      if(u.same_row(*c) && !u.sets_key_of(u) && !c->sets_key_of(u))
+      {
+        u.merge(*c);
+        merged = true;
+        break;
+      }
+      bool same_key_columns = u.key.size()==c->key.size();
+      for(size_t k=0; same_key_columns && k<u.key.size(); ++k)
+          same_key_columns = u.key[k].first==c->key[k].first;
+      if(!same_key_columns || u.sets_key_of(*c) || c->sets_key_of(u))
+          break; // Can't move *c past u.
+    }
+    if(merged)
+    {
+      c = _changes.erase(c);
+    }
+    else
+    {
+      updates.push_back(c);
+      ++c;
+    }
+  }
 }
 
 
 void
-Queue::flush(void)
+Queue::group(void)
 {
-  if(!_changes.empty())
+  // Move a change back to follow the last change to the same table, if that
+  // has the same SQL. It only passes changes to other tables, which it can't
+  // affect - unless one of them is a DELETE that looks at other tables.
+  typedef std::list<Change>::iterator CIt;
+  std::map<std::string,CIt> last; // Latest change to each table.
+  CIt c = _changes.begin();
+  while(c!=_changes.end())
   {
-    sql::exec(CALI_HERE,*_db,"begin");
-    while(!_changes.empty())
+    if(!c->unreferenced_by.empty())
+    {
+      last.clear(); // Nothing may be moved past this one.
+      ++c;
+      continue;
+    }
+    std::map<std::string,CIt>::iterator l = last.find(c->table);
+    if(l==last.end())
     {
-      sql::exec(CALI_HERE,*_db, _changes.front().c_str() );
-      _changes.pop_front();
+      last.insert(std::make_pair(c->table,c));
+      ++c;
+      continue;
     }
-    sql::exec(CALI_HERE,*_db,"commit");
+    CIt to = l->second;
+    ++to;
+    CIt next = c;
+    ++next;
+    if(to!=c && l->second->same_sql(*c))
+        _changes.splice(to,_changes,c);
+    l->second = c;
+    c = next;
   }
 }
 
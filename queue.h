@@ -1,18 +1,72 @@
 #ifndef CALENDARI__QUEUE_H
 #define CALENDARI__QUEUE_H 1
 
+#include "sql.h"
+
 #include <string>
 #include <list>
+#include <utility>
+#include <vector>
 
 namespace calendari {
 
 class Db;
 
 
-/** Stores SQL for pending changes to the database. */
+/** Stores pending changes to the database, one typed record per change.
+*   Changes are built up in place, for example:
+*
+*     q.update("EVENT").where("VERSION",v).where("UID",uid).set("SUMMARY",s);
+*
+*   flush() writes them out in a single transaction, using bound parameters.
+*   Consecutive UPDATEs to the same row are coalesced into one statement.
+*   Changes with the same SQL are then grouped together where that's safe,
+*   and each group shares one prepared statement. */
 class Queue
 {
 public:
+  typedef std::pair<std::string,sql::Value> Column;
+
+  /** A single INSERT, UPDATE or DELETE. */
+  struct Change
+  {
+    enum Op { INSERT, UPDATE, DELETE };
+
+    Op                   op;
+    std::string          table;
+    /** Columns that identify the row(s): the WHERE clause. */
+    std::vector<Column>  key;
+    /** Columns to set (UPDATE) or insert (INSERT). */
+    std::vector<Column>  value;
+    /** DELETE only: only delete rows that are not referenced by any row in
+    *   this table, with the same key columns. */
+    std::string          unreferenced_by;
+
+    Change(Op op_, const char* table_): op(op_), table(table_) {}
+
+    Change& where(const char* column, const sql::Value& v)
+      { key.push_back(Column(column,v)); return *this; }
+    Change& set(const char* column, const sql::Value& v)
+      { value.push_back(Column(column,v)); return *this; }
+    Change& unless_referenced_by(const char* table_)
+      { unreferenced_by = table_; return *this; }
+
+    /** Returns the SQL for this change; parameters are in bind() order. */
+    std::string sql(void) const;
+    /** Returns SQLITE_OK, or the result code of the first bind that
+    *   failed. */
+    int bind(sqlite3_stmt* stmt) const;
+    /** TRUE if 'c' has the same SQL as this: the same table, op and
+    *   columns. */
+    bool same_sql(const Change& c) const;
+    /** TRUE if this is an UPDATE that may be merged with 'c'. */
+    bool same_row(const Change& c) const;
+    /** TRUE if this change sets any of the columns in 'c's key. */
+    bool sets_key_of(const Change& c) const;
+    /** Fold the values set by a later UPDATE into this one. */
+    void merge(const Change& later);
+  };
+
   static bool idle(void*);
   static Queue& inst(void)
     {
@@ -24,17 +78,46 @@ public:
   void set_db(Db* db_);
 
   bool empty(void) const { return _changes.empty(); }
-  void push(const std::string& sql);
-  void pushf(const char* format, ...);
-  void flush(void);
+  Change& insert(const char* table) { return push(Change::INSERT,table); }
+  Change& update(const char* table) { return push(Change::UPDATE,table); }
+  Change& erase(const char* table)  { return push(Change::DELETE,table); }
+  /** Write out the changes. Returns FALSE if another connection is writing;
+  *   the changes are kept, and the flush is retried after RETRY_MS. Also
+  *   returns FALSE if any change fails: the error is reported, the whole
+  *   transaction is rolled back and the changes are kept. */
+  bool flush(void);
+
+  enum Pending
+  {
+    NOT_QUEUED, ///< Nothing is queued for the row since the last flush().
+    QUEUED,     ///< A new value is queued.
+    DELETED     ///< The row is to be deleted.
+  };
+  /** Look for a change to 'column' of the row in 'table' that has these
+  *   'key' columns, which has not been written yet. If the latest such
+  *   change sets it, then returns QUEUED and points 'value' at the value. */
+  Pending pending(
+      const char*                 table,
+      const std::vector<Column>&  key,
+      const char*                 column,
+      const sql::Value*&          value
+    ) const;
+
+  static const int RETRY_MS = 250;
 
 private:
-  Queue(void) {}
+  Queue(void): _db(NULL) {}
   Queue(const Queue&);
   Queue& operator = (const Queue&);
 
+  Change& push(Change::Op op, const char* table);
+  /** Coalesce UPDATEs in _changes. */
+  void coalesce(void);
+  /** Bring together changes in _changes that have the same SQL. */
+  void group(void);
+
   Db* _db;
-  std::list<std::string> _changes;
+  std::list<Change> _changes;
 };
 
 
@@ -4,34 +4,70 @@
 #include "db.h"
 #include "ics.h"
 #include "recur.h"
+#include "rrule.h"
 #include "util.h"
 #include "sql.h"
+#include "tz.h"
+#include "zblob.h"
 
+#include <algorithm>
+#include <cassert>
+#include <cstdarg>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <errno.h>
 #include <fstream>
 #include <libical/ical.h>
+#include <map>
+#include <memory>
 #include <set>
 #include <sqlite3.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
 
 namespace
 {
-  /** Stream reader function for iCalendar parser. */
-  char* read_stream(char *s, size_t size, void *d)
+  /** A VEVENT that has been parsed on its own. It's a child of the calendar
+  *   while it's being loaded, so that its TZIDs find the calendar's
+  *   VTIMEZONEs, and is freed when this goes out of scope. */
+  class Parsed
   {
-    char *c = ::fgets(s,size, (FILE*)d);
-    return c;
-  }
+  public:
+    explicit Parsed(icalcomponent* parent): _parent(parent), _vevent(NULL)
+      {}
+    ~Parsed(void)
+      {
+        if(_vevent)
+        {
+          ::icalcomponent_remove_component(_parent,_vevent);
+          ::icalcomponent_free(_vevent);
+        }
+      }
+    /** Take ownership of 'vevent'. */
+    void adopt(icalcomponent* vevent)
+      {
+        assert(!_vevent);
+        _vevent = vevent;
+        ::icalcomponent_add_component(_parent,_vevent);
+      }
+
+  private:
+    icalcomponent*  _parent;
+    icalcomponent*  _vevent;
+
+    Parsed(const Parsed&); // Not copyable
+    Parsed& operator=(const Parsed&);
+  };
 }
 
 namespace calendari {
 namespace ics {
 
 
-typedef scoped<icalparser,icalparser_free> SParser;
 typedef scoped<icalcomponent,icalcomponent_free> SComponent;
 
 
@@ -75,32 +111,13 @@ ical2timet(icaltimetype& it)
   result_tm.tm_hour = it.hour;
   result_tm.tm_min  = it.minute;
   result_tm.tm_sec  = it.second;
-  result_tm.tm_isdst= -1; // work it out yourself
-
-  time_t result;
 
+  // Unknown zones are taken to be UTC, as the C library does.
   const char* tzid =icaltime_get_tzid(it);
-  if(tzid)
-  {
-    char* tz;
-    tz = ::getenv("TZ");
-    ::setenv("TZ", tzid, 1);
-    ::tzset();
-
-    result = ::mktime(&result_tm);
-
-    if(tz)
-      ::setenv("TZ", tz, 1);
-    else
-      ::unsetenv("TZ");
-    ::tzset();
-  }
-  else
-  {
-    // Assume that 'it' is in local time.
-    result = ::mktime(&result_tm);
-  }
-  return result;
+  const TimeZone* zone = (tzid? TimeZone::find(tzid): &TimeZone::local());
+  if(!zone)
+      zone = &TimeZone::utc();
+  return zone->to_time(result_tm);
 }
 
 
@@ -125,38 +142,77 @@ recur_type(icalrecurrencetype_frequency freq)
 }
 
 
-void make_occurrence(
-    time_t         start_time,
-    time_t         duration,
-    RecurType      occ_recurs,
-    sqlite3*       db,
-    sqlite3_stmt*  insert_occ
+/** An OCCURRENCE, before it is written. */
+struct Instance
+{
+  Instance(time_t start_, time_t end_, RecurType recurs_)
+    : start(start_), end(end_), recurs(recurs_)
+    {}
+  time_t     start;
+  time_t     end;
+  RecurType  recurs;
+};
+
+
+/** Write 'instances' with 'insert_occ', whose VERSION, CALNUM & EVTNUM are
+*   already bound. */
+void insert_instances(
+    const std::vector<Instance>&  instances,
+    sqlite3*                      db,
+    sqlite3_stmt*                 insert_occ
   )
 {
-  time_t end_time = start_time + duration;
-  sql::bind_int64(CALI_HERE,db,insert_occ,4,start_time);
-  sql::bind_int64(CALI_HERE,db,insert_occ,5,end_time);
-  sql::bind_int(  CALI_HERE,db,insert_occ,6,recur2int(occ_recurs));
-  sql::step_reset(CALI_HERE,db,insert_occ);
+  typedef std::vector<Instance>::const_iterator IIt;
+  for(IIt i=instances.begin(); i!=instances.end(); ++i)
+  {
+    sql::bind_int64(CALI_HERE,db,insert_occ,4,i->start);
+    sql::bind_int64(CALI_HERE,db,insert_occ,5,i->end);
+    sql::bind_int(  CALI_HERE,db,insert_occ,6,recur2int(i->recurs));
+    sql::step_reset(CALI_HERE,db,insert_occ);
+  }
 }
 
 
-/** Based on source from libical.
-*   Returns the recurrance type for this event. */
-RecurType process_rrule(
-    icalcomponent*  ievt,
-    icaltimetype&   dtstart,
-    icaltimetype&   dtend,
-    sqlite3*        db,
-    sqlite3_stmt*   insert_occ
-  )
+/** Summarise the recurrence rules of 'ievt', without expanding them. */
+RecurType rrule_recurs(icalcomponent* ievt)
 {
   RecurType evt_recurs = RECUR_NONE;
+  icalproperty* rrule;
+  for (rrule = icalcomponent_get_first_property(ievt,ICAL_RRULE_PROPERTY);
+       rrule != NULL;
+       rrule = icalcomponent_get_next_property(ievt,ICAL_RRULE_PROPERTY))
+  {
+    struct icalrecurrencetype recur = icalproperty_get_rrule(rrule);
+    evt_recurs = add_recurrence(evt_recurs,recur_type(recur.freq));
+  }
+  if(icalcomponent_get_first_property(ievt,ICAL_RDATE_PROPERTY))
+      evt_recurs = RECUR_CUSTOM;
+  return evt_recurs;
+}
+
 
+/** Based on source from libical.
+*   Lists the instances of 'ievt' that start in [from,until).
+*   Returns the time up to which the event has now been expanded: 'until', or
+*   EXPANDED_ALL once all of its rules are exhausted. */
+time_t process_rrule(
+    icalcomponent*          ievt,
+    icaltimetype&           dtstart,
+    icaltimetype&           dtend,
+    time_t                  from,
+    time_t                  until,
+    std::vector<Instance>&  instances
+  )
+{
   time_t start_time = ical2timet(dtstart);
   time_t end_time   = ical2timet(dtend);
   assert(end_time>=start_time);
   const time_t duration = end_time - start_time;
+  bool exhausted = true;
+  // Only ask libical about exclusions if there are any.
+  const bool excludes =
+      icalcomponent_get_first_property(ievt,ICAL_EXDATE_PROPERTY) ||
+      icalcomponent_get_first_property(ievt,ICAL_EXRULE_PROPERTY);
 
   // Cycle through RRULE entries.
   bool seen_occ0 = false;
@@ -166,32 +222,39 @@ RecurType process_rrule(
        rrule = icalcomponent_get_next_property(ievt,ICAL_RRULE_PROPERTY))
   {
     struct icalrecurrencetype recur = icalproperty_get_rrule(rrule);
-    icalrecur_iterator* rrule_itr = icalrecur_iterator_new(recur, dtstart);
+    const RecurType occ_recur = recur_type(recur.freq);
+    RecurIterator rrule_itr(recur, dtstart);
 
-    while(rrule_itr)
+    while(true)
     {
-      struct icaltimetype rrule_time = icalrecur_iterator_next(rrule_itr);
+      struct icaltimetype rrule_time = rrule_itr.next();
       if(icaltime_is_null_time(rrule_time))
           break;
-      if(icalproperty_recurrence_is_excluded(ievt, &dtstart, &rrule_time))
-          continue;
       time_t t = ical2timet(rrule_time);
+      if(t >= until)
+      {
+        exhausted = false; // Leave the rest for later.
+        break;
+      }
+      if(excludes &&
+         icalproperty_recurrence_is_excluded(ievt, &dtstart, &rrule_time))
+      {
+        continue;
+      }
       if(t == start_time)
       {
         if(seen_occ0)
             continue;
         seen_occ0 = true;
       }
-      RecurType occ_recur = recur_type(recur.freq);
-      evt_recurs = add_recurrence(evt_recurs,occ_recur);
-      make_occurrence(t, duration, occ_recur, db,insert_occ);
+      if(t >= from)
+          instances.push_back(Instance(t, t+duration, occ_recur));
     }
-    icalrecur_iterator_free(rrule_itr);
   }
 
   // Make the original occurrence.
-  if(!seen_occ0)
-      make_occurrence(start_time, duration, RECUR_NONE, db,insert_occ);
+  if(!seen_occ0 && from <= start_time && start_time < until)
+      instances.push_back(Instance(start_time, end_time, RECUR_NONE));
 
   // Process RDATE entries
   icalproperty* rdate;
@@ -209,40 +272,620 @@ RecurType process_rrule(
     if(icaltime_is_null_time(rdate_period.time))
       continue;
 
-    if(!icalproperty_recurrence_is_excluded(ievt, &dtstart,&rdate_period.time))
+    time_t t = ical2timet(rdate_period.time);
+    if(t >= until)
     {
-      evt_recurs = RECUR_CUSTOM;
-      time_t t = ical2timet(rdate_period.time);
-      make_occurrence(t, duration, RECUR_CUSTOM, db,insert_occ);
+      exhausted = false;
+      continue;
+    }
+    if(t >= from && !(excludes &&
+       icalproperty_recurrence_is_excluded(ievt, &dtstart,&rdate_period.time)))
+    {
+      instances.push_back(Instance(t, t+duration, RECUR_CUSTOM));
     }
   }
-  return evt_recurs;
+  return( exhausted? EXPANDED_ALL: until );
+}
+
+
+/** Finds DTSTART & DTEND for 'ievt'. Returns FALSE if either is missing. */
+bool
+event_times(icalcomponent* ievt, icaltimetype& dtstart, icaltimetype& dtend)
+{
+  dtstart = icalcomponent_get_dtstart(ievt);
+  dtend   = icalcomponent_get_dtend(ievt);
+  if(icaltime_is_null_time(dtstart) || icaltime_is_null_time(dtend))
+      return false;
+  if(dtend.is_date)
+    --dtend.day; // iCal allday events end the day after.
+  return true;
+}
+
+
+/** An event that ics::expand() has yet to extend. */
+struct Pending
+{
+  int          calnum;
+  int          evtnum;
+  std::string  uid;
+  std::string  vevent;
+  time_t       expanded;
+};
+
+
+bool
+expand(sql::StatementCache& stmts, time_t until, int version, bool wait)
+{
+  sqlite3* db = stmts.db();
+  // Find the events that need expanding. Read them all in before we start
+  // writing to the EVENT table.
+  std::vector<Pending> pending;
+  {
+    const char* sql =
+        "select CALNUM,EVTNUM,UID,VEVENT,EXPANDED from EVENT "
+        "where VERSION=? and EXPANDED<?";
+    sql::CachedStatement select_evt(CALI_HERE,stmts,sql);
+    sql::bind_int(  CALI_HERE,db,select_evt,1,version);
+    sql::bind_int64(CALI_HERE,db,select_evt,2,until);
+    while(true)
+    {
+      int return_code = ::sqlite3_step(select_evt);
+      if(return_code==SQLITE_ROW)
+      {
+        pending.push_back(Pending());
+        Pending& p = pending.back();
+        p.calnum   =         ::sqlite3_column_int(  select_evt,0);
+        p.evtnum   =         ::sqlite3_column_int(  select_evt,1);
+        p.uid      = safestr(::sqlite3_column_text( select_evt,2));
+        zblob_column(select_evt,3,p.vevent);
+        p.expanded =         ::sqlite3_column_int64(select_evt,4);
+      }
+      else if(return_code==SQLITE_DONE)
+      {
+        break;
+      }
+      else
+      {
+        calendari::sql::error(CALI_HERE,db);
+        return true;
+      }
+    }
+  }
+  if(pending.empty())
+      return true;
+
+  const char* sql =
+      "insert into OCCURRENCE "
+        "(VERSION,CALNUM,EVTNUM,DTSTART,DTEND,RECURS) values (?,?,?,?,?,?)";
+  sql::CachedStatement insert_occ(CALI_HERE,stmts,sql);
+
+  sql="update EVENT set EXPANDED=? where VERSION=? and UID=?";
+  sql::CachedStatement update_evt(CALI_HERE,stmts,sql);
+
+  if(wait)
+  {
+    int return_code = ::sqlite3_exec(db,"begin immediate",0,0,0);
+    if(return_code==SQLITE_BUSY)
+        return false;
+    sql::check_error(CALI_HERE,db,return_code);
+  }
+  else if(!sql::try_begin(CALI_HERE,db))
+  {
+    return false; // A calendar is being read in the background.
+  }
+  try
+  {
+    typedef std::vector<Pending>::iterator PIt;
+    for(PIt p=pending.begin(); p!=pending.end(); ++p)
+    {
+      time_t expanded = EXPANDED_ALL;
+      SComponent ievt( icalparser_parse_string(p->vevent.c_str()) );
+      icaltimetype dtstart, dtend;
+      if(ievt && event_times(ievt.get(),dtstart,dtend))
+      {
+        std::vector<Instance> instances;
+        expanded = process_rrule(
+            ievt.get(),dtstart,dtend,p->expanded,until,instances);
+        sql::bind_int( CALI_HERE,db,insert_occ,1,version);
+        sql::bind_int( CALI_HERE,db,insert_occ,2,p->calnum);
+        sql::bind_int( CALI_HERE,db,insert_occ,3,p->evtnum);
+        insert_instances(instances,db,insert_occ);
+      }
+      sql::bind_int64(CALI_HERE,db,update_evt,1,expanded);
+      sql::bind_int(  CALI_HERE,db,update_evt,2,version);
+      sql::bind_text( CALI_HERE,db,update_evt,3,p->uid.c_str());
+      sql::step_reset(CALI_HERE,db,update_evt);
+    }
+    CALI_SQLCHK(db, ::sqlite3_exec(db, "commit", 0, 0, 0) );
+  }
+  catch(...)
+  {
+    try{ sql::exec(CALI_HERE,db,"rollback"); } catch(...) {}
+    throw;
+  }
+  return true;
+}
+
+
+/** printf() into a string. */
+std::string
+format(const char* fmt, ...)
+{
+  char buf[512];
+  va_list va_args;
+  va_start(va_args,fmt);
+  ::vsnprintf(buf,sizeof(buf),fmt,va_args);
+  va_end(va_args);
+  return buf;
+}
+
+
+/** Sets 'uid' to the UID of 'ievt'. Returns FALSE, and sets 'warning', if it
+*   has none. */
+bool
+read_uid(icalcomponent* ievt, std::string& uid, std::string& warning)
+{
+  icalproperty* iprop =
+      icalcomponent_get_first_property(ievt,ICAL_UID_PROPERTY);
+  if(!iprop)
+  {
+    warning = "missing VEVENT::UID property";
+    return false;
+  }
+  uid = safestr( icalproperty_get_uid(iprop) );
+  if(uid.empty())
+  {
+    warning = "VEVENT::UID property has no value";
+    return false;
+  }
+  return true;
+}
+
+
+/** A VEVENT that has been read & expanded, but not yet written. It may have
+*   been made on a worker thread, so it carries its warning instead of
+*   reporting it: Reader::load() reports them in file order. */
+struct StagedEvent
+{
+  StagedEvent(void)
+    : ok(false), unchanged(false), sequence(1), all_day(0),
+      recurs(RECUR_NONE), expanded(EXPANDED_NONE), hash(0)
+    {}
+  bool                   ok;        ///< FALSE: skip it, with 'warning' if set.
+  bool                   unchanged; ///< Matches its stored HASH: not expanded.
+  std::string            warning;
+  std::string            uid;       ///< Empty if IDs are being discarded.
+  std::string            summary;
+  int                    sequence;
+  int                    all_day;
+  RecurType              recurs;
+  time_t                 expanded;
+  long long              hash;
+  std::string            blob;      ///< As zblob_pack()ed.
+  std::vector<Instance>  instances;
+};
+
+
+/** What stage_vevent() needs from Reader::load(). Not changed while worker
+*   threads are running. */
+struct StageContext
+{
+  bool    discard_ids;
+  time_t  horizon; ///< Expand recurring events this far.
+  /** UID -> HASH of the events already stored, or NULL. */
+  const std::map<std::string,long long>*  stored;
+};
+
+
+/** Read the VEVENT whose text is the 'len' bytes at 'text' into 'out'.
+*   scan_vevent() reads it if it can, and libical parses it, as a child of
+*   'parent', if it can't. */
+void
+stage_vevent(
+    const char*          text,
+    size_t               len,
+    icalcomponent*       parent,
+    const StageContext&  ctx,
+    StagedEvent&         out
+  )
+{
+  Parsed parsed(parent);
+  VeventFields fields;
+  icalcomponent* ievt = NULL;
+  const bool scanned = scan_vevent(text,text+len,fields);
+  if(scanned)
+  {
+    out.uid = fields.uid;
+  }
+  else
+  {
+    ievt = ::icalparser_parse_string(std::string(text,len).c_str());
+    if(!ievt)
+    {
+      out.warning = format("failed to parse VEVENT: %s",
+          icalerror_strerror(icalerrno));
+      return;
+    }
+    parsed.adopt(ievt);
+    if(!ctx.discard_ids && !read_uid(ievt,out.uid,out.warning))
+        return;
+  }
+  const char* uid = out.uid.c_str();
+
+  // -- hash --
+  out.hash = fnv1a(text,len);
+  if(ctx.stored)
+  {
+    std::map<std::string,long long>::const_iterator s =ctx.stored->find(uid);
+    if(s!=ctx.stored->end() && s->second==out.hash)
+    {
+      out.ok = out.unchanged = true;
+      return;
+    }
+  }
+
+  icaltimetype dtstart;
+  icaltimetype dtend;
+  if(scanned)
+  {
+    out.summary  = fields.summary;
+    out.sequence = fields.sequence;
+    out.all_day  = fields.all_day;
+  }
+  else
+  {
+    // -- summary --
+    icalproperty* iprop =
+        icalcomponent_get_first_property(ievt,ICAL_SUMMARY_PROPERTY);
+    if(!iprop)
+    {
+      out.warning = format("UID:%s missing VEVENT::SUMMARY property",uid);
+      return;
+    }
+    const char* summary = icalproperty_get_summary(iprop);
+    if(!summary)
+    {
+      out.warning =
+          format("UID:%s VEVENT::SUMMARY property has no value",uid);
+      return;
+    }
+    out.summary = summary;
+
+    // -- sequence --
+    iprop = icalcomponent_get_first_property(ievt,ICAL_SEQUENCE_PROPERTY);
+    if(iprop)
+        out.sequence = icalproperty_get_sequence(iprop);
+
+    // dtstart + tzid (if any)
+    dtstart = icalcomponent_get_dtstart(ievt);
+    if(icaltime_is_null_time(dtstart))
+    {
+      out.warning = format("UID:%s missing VEVENT::DTSTART property",uid);
+      return;
+    }
+
+    // all_day
+    out.all_day = dtstart.is_date;
+
+    // dtend + tzid (if any)
+    dtend = icalcomponent_get_dtend(ievt);
+    if(icaltime_is_null_time(dtend))
+    {
+      out.warning = format("UID:%s missing VEVENT::DTEND property",uid);
+      return;
+    }
+    if(dtend.is_date)
+      --dtend.day; // iCal allday events end the day after.
+  }
+
+  out.blob = zblob_pack(text,len);
+
+  // Generate occurrences. Always include the first one.
+  if(scanned)
+  {
+    // It doesn't recur, so this is all of it.
+    out.recurs = RECUR_NONE;
+    out.expanded = EXPANDED_ALL;
+    out.instances.push_back(Instance(fields.dtstart,fields.dtend,RECUR_NONE));
+  }
+  else
+  {
+    out.recurs = rrule_recurs(ievt);
+    out.expanded = process_rrule(
+        ievt,dtstart,dtend,
+        EXPANDED_NONE,std::max(ctx.horizon,ical2timet(dtstart)+1),
+        out.instances
+      );
+  }
+  out.ok = true;
+}
+
+
+/** A piece of a batch of VEVENTs, and the events staged from it. */
+struct Chunk
+{
+  Chunk(const char* begin_, const char* end_)
+    : begin(begin_), end(end_)
+    {}
+  const char*              begin;
+  const char*              end;
+  std::deque<StagedEvent>  events;
+};
+
+
+/** Stage the VEVENTs in 'chunk', in order. Other components are skipped:
+*   Reader::load() has already added the VTIMEZONEs to 'parent'. */
+void
+stage_chunk(Chunk& chunk, icalcomponent* parent, const StageContext& ctx)
+{
+  ComponentScanner scanner(chunk.begin,chunk.end,true);
+  std::string name;
+  const char* begin;
+  const char* end;
+  while(scanner.next(name,begin,end))
+  {
+    if(name!="VEVENT")
+        continue;
+    chunk.events.push_back(StagedEvent());
+    stage_vevent(begin,end-begin,parent,ctx,chunk.events.back());
+  }
+}
+
+
+/** Stages the chunks of a batch on the calling thread, helped by a few
+*   worker threads. Each chunk's events stay in file order, so the result
+*   doesn't depend on which thread staged what. */
+class Stager
+{
+public:
+  Stager(
+      std::vector<Chunk>&  chunks,
+      const StageContext&  ctx,
+      Progress*            progress
+    );
+  ~Stager(void);
+
+  /** Stage every chunk, with up to 'threads' workers. Each worker gets its
+  *   own copy of 'ical', so that the events that libical parses can find
+  *   their VTIMEZONEs. Returns once they are all done. */
+  void stage_all(icalcomponent* ical, int threads);
+
+private:
+  struct Worker
+  {
+    Stager*         stager;
+    icalcomponent*  parent;
+    GThread*        thread;
+  };
+
+  std::vector<Chunk>&  _chunks;
+  const StageContext&  _ctx;
+  Progress*            _progress;
+  GMutex*              _mutex;
+  size_t               _next; ///< The next chunk to stage.
+
+  /** Stage chunks until there are none left. */
+  void _work(icalcomponent* parent);
+  static gpointer run(gpointer data);
+
+  Stager(const Stager&); // Not copyable
+  Stager& operator=(const Stager&);
+};
+
+
+Stager::Stager(
+    std::vector<Chunk>&  chunks,
+    const StageContext&  ctx,
+    Progress*            progress
+  )
+  : _chunks(chunks),
+    _ctx(ctx),
+    _progress(progress),
+    _mutex(g_mutex_new()),
+    _next(0)
+{}
+
+
+Stager::~Stager(void)
+{
+  g_mutex_free(_mutex);
+}
+
+
+void
+Stager::stage_all(icalcomponent* ical, int threads)
+{
+  std::vector<Worker> workers;
+  workers.reserve(threads); // run() holds pointers into 'workers'.
+  for(int i=0; i<threads; ++i)
+  {
+    Worker w;
+    w.stager = this;
+    w.parent = ::icalcomponent_new_clone(ical);
+    w.thread = NULL;
+    workers.push_back(w);
+    GError* error = NULL;
+    workers.back().thread = g_thread_create(run,&workers.back(),true,&error);
+    if(!workers.back().thread)
+    {
+      CALI_WARN(0,"Failed to start parse thread: %s",error->message);
+      g_error_free(error);
+      ::icalcomponent_free(workers.back().parent);
+      workers.pop_back();
+      break;
+    }
+  }
+  _work(ical);
+  for(std::vector<Worker>::iterator w=workers.begin(); w!=workers.end(); ++w)
+  {
+    g_thread_join(w->thread);
+    ::icalcomponent_free(w->parent);
+  }
+}
+
+
+void
+Stager::_work(icalcomponent* parent)
+{
+  while(true)
+  {
+    g_mutex_lock(_mutex);
+    const size_t i = _next++;
+    g_mutex_unlock(_mutex);
+    if(i>=_chunks.size())
+        break;
+    Chunk& chunk = _chunks[i];
+    stage_chunk(chunk,parent,_ctx);
+    if(_progress)
+        g_atomic_int_add(&_progress->bytes,chunk.end-chunk.begin);
+  }
+}
+
+
+gpointer
+Stager::run(gpointer data)
+{
+  util::set_background_thread();
+  Worker& w = *static_cast<Worker*>(data);
+  w.stager->_work(w.parent);
+  return NULL;
+}
+
+
+/** Writes staged events to EVENT & OCCURRENCE, or to their BULK_ tables,
+*   within Reader::load()'s transaction. */
+class Writer
+{
+public:
+  Writer(
+      sqlite3*   db,
+      int        version,
+      int        calnum,
+      bool       bulk_load,
+      Progress*  progress
+    );
+
+  void write(const StagedEvent& staged);
+
+private:
+  sqlite3*        _db;
+  const int       _version;
+  const int       _calnum;
+  int             _evtnum; ///< The last EVTNUM used.
+  Progress*       _progress;
+  sql::Statement  _insert_evt;
+  sql::Statement  _insert_occ;
+
+  Writer(const Writer&); // Not copyable
+  Writer& operator=(const Writer&);
+};
+
+
+Writer::Writer(
+    sqlite3*   db,
+    int        version,
+    int        calnum,
+    bool       bulk_load,
+    Progress*  progress
+  )
+  : _db(db),
+    _version(version),
+    _calnum(calnum),
+    _evtnum(0),
+    _progress(progress),
+    _insert_evt(CALI_HERE,db,(std::string("insert into ") +
+        (bulk_load? "BULK_EVENT": "EVENT") +
+        " (VERSION,CALNUM,UID,SUMMARY,SEQUENCE,ALLDAY,RECURS,VEVENT,EXPANDED,"
+        "HASH,EVTNUM) values (?,?,?,?,?,?,?,?,?,?,?)").c_str()),
+    _insert_occ(CALI_HERE,db,(std::string("insert into ") +
+        (bulk_load? "BULK_OCCURRENCE": "OCCURRENCE") +
+        " (VERSION,CALNUM,EVTNUM,DTSTART,DTEND,RECURS) values (?,?,?,?,?,?)"
+      ).c_str())
+{
+  // Number new events from the top of EVENT. Events that the user makes in
+  // the main thread count down from zero, so they can't clash with these.
+  sql::query_val(CALI_HERE,db,_evtnum,
+      "select max(0,coalesce(max(EVTNUM),0)) from EVENT");
+}
+
+
+void
+Writer::write(const StagedEvent& staged)
+{
+  // Bind values common to all occurrences.
+  ++_evtnum;
+  sql::bind_int( CALI_HERE,_db,_insert_occ,1,_version);
+  sql::bind_int( CALI_HERE,_db,_insert_occ,2,_calnum);
+  sql::bind_int( CALI_HERE,_db,_insert_occ,3,_evtnum);
+  insert_instances(staged.instances,_db,_insert_occ);
+
+  // Make the EVENT row.
+  // Note: Delay making the event until after we've processed the RRULEs,
+  // makes live easier, atthe expense of allowing the DB to temporarily
+  // contain OCCURRENCEs without a corresponding EVENT.
+  sql::bind_int( CALI_HERE,_db,_insert_evt,1,_version);
+  sql::bind_int( CALI_HERE,_db,_insert_evt,2,_calnum);
+  sql::bind_text(CALI_HERE,_db,_insert_evt,3,staged.uid.c_str());
+  sql::bind_text(CALI_HERE,_db,_insert_evt,4,staged.summary.c_str());
+  sql::bind_int( CALI_HERE,_db,_insert_evt,5,staged.sequence);
+  sql::bind_int( CALI_HERE,_db,_insert_evt,6,staged.all_day);
+  sql::bind_int( CALI_HERE,_db,_insert_evt,7,recur2int(staged.recurs));
+  sql::bind_blob(CALI_HERE,_db,_insert_evt,8,staged.blob);
+  sql::bind_int64(CALI_HERE,_db,_insert_evt,9,staged.expanded);
+  sql::bind_int64(CALI_HERE,_db,_insert_evt,10,staged.hash);
+  sql::bind_int( CALI_HERE,_db,_insert_evt,11,_evtnum);
+  sql::step_reset(CALI_HERE,_db,_insert_evt);
+  if(_progress)
+      g_atomic_int_inc(&_progress->events);
 }
 
 
 // -- class Reader --
 
-Reader::Reader(const char* ical_filename)
+Reader::Reader(const char* ical_filename, Progress* progress)
   : _ical(NULL),
     _ical_filename(ical_filename),
     _discard_ids(false),
+    _progress(progress),
+    _map(NULL),
+    _events_from(0),
+    _stream(NULL),
     calid(),
     calname(),
     path(ical_filename),
-    readonly( 0!= ::access(ical_filename,W_OK) )
+    readonly( 0!= ::access(ical_filename,W_OK) ),
+    incremental(false),
+    removed(),
+    bulk(false)
 {
   assert(!_ical_filename.empty());
   // Parse the iCalendar file.
-  SParser iparser( ::icalparser_new() );
-  FILE* stream = ::fopen(ical_filename,"r");
-  if(!stream)
+  // Just parse the calendar's own properties & timezones now. load() reads
+  // the VEVENTs.
+  std::string header;
+  std::auto_ptr<MappedFile> map( new MappedFile(ical_filename) );
+  std::auto_ptr<StreamScanner> stream;
+  if(map->is_open())
+  {
+    ComponentScanner scanner(map->data(),map->data()+map->size());
+    _events_from = scanner.header() - map->data();
+    header.assign(map->data(),_events_from);
+  }
+  else
   {
-    CALI_ERRO(0,errno,"failed to open calendar file %s",ical_filename);
-    throw OpenFailed();
+    map.reset();
+    stream.reset( new StreamScanner(ical_filename) );
+    if(!stream->is_open())
+    {
+      CALI_ERRO(0,errno,"failed to open calendar file %s",ical_filename);
+      throw OpenFailed();
+    }
+    stream->header(header);
   }
-  ::icalparser_set_gen_data(iparser.get(),stream);
-  SComponent ical( ::icalparser_parse(iparser.get(),read_stream) );
-  ::fclose(stream);
+  if(_progress)
+      g_atomic_int_add(&_progress->bytes,header.size());
+  header += "END:VCALENDAR\r\n";
+  SComponent ical( ::icalparser_parse_string(header.c_str()) );
   if(!ical)
   {
     // ?? This might be an automated update, rather than user-requested.
@@ -285,6 +928,8 @@ Reader::Reader(const char* ical_filename)
     }
   }
   _ical = ical.release();
+  _map = map.release();
+  _stream = stream.release();
 }
 
 
@@ -292,17 +937,23 @@ Reader::~Reader(void)
 {
   if(_ical)
       icalcomponent_free(_ical);
+  delete _map;
+  delete _stream;
 }
 
 
 bool
-Reader::calid_is_unique(Db& db) const
+Reader::calid_is_unique(sqlite3* db) const
 {
-  int calid_count;
-  sql::query_val(CALI_HERE,db,calid_count,
-      "select count(0) from CALENDAR where CALID='%s'",
-      sql::quote(calid).c_str()
-    );
+  const char* sql = "select count(0) from CALENDAR where CALID=?";
+  sql::Statement select_cal(CALI_HERE,db,sql);
+  sql::bind_text(CALI_HERE,db,select_cal,1,calid.c_str(),-1);
+  int calid_count = 0;
+  int return_code = ::sqlite3_step(select_cal);
+  if(return_code==SQLITE_ROW)
+      calid_count = ::sqlite3_column_int(select_cal,0);
+  else
+      calendari::sql::error(CALI_HERE,db);
   return( calid_count == 0 );
 }
 
@@ -315,10 +966,57 @@ Reader::discard_ids(void)
 }
 
 
+bool
+Reader::read_batch(std::string& text)
+{
+  text.clear();
+  std::string name;
+  std::string component;
+  while(text.size()<BATCH_BYTES)
+  {
+    if(!_stream->next(name,component))
+        return false;
+    if(name=="VEVENT")
+    {
+      text += component;
+    }
+    else if(name=="VTIMEZONE")
+    {
+      icalcomponent* ivtz = ::icalparser_parse_string(component.c_str());
+      if(ivtz)
+          ::icalcomponent_add_component(_ical,ivtz);
+    }
+  }
+  return true;
+}
+
+
+bool
+Reader::unique_uid(
+    Calendari*              app,
+    std::set<std::string>&  seen,
+    std::string&            uid
+  ) const
+{
+  if(_discard_ids)
+  {
+    uid = generate_uid();
+    return true;
+  }
+  if(!seen.insert(uid).second)
+  {
+    if(!app || app->debug)
+        CALI_WARN(0,"VEVENT::UID property not unique: %s",uid.c_str());
+    return false;
+  }
+  return true;
+}
+
+
 int
 Reader::load(
     Calendari*   app,
-    Db&          db,
+    sqlite3*     db,
     int          version
   )
 {
@@ -329,136 +1027,208 @@ Reader::load(
         "values (?,?,?,?,?,?,?,?,1)";
   sql::Statement insert_cal(CALI_HERE,db,sql);
 
-  sql="insert into EVENT "
-        "(VERSION,CALNUM,UID,SUMMARY,SEQUENCE,ALLDAY,RECURS,VEVENT) "
-        "values (?,?,?,?,?,?,?,?)";
-  sql::Statement insert_evt(CALI_HERE,db,sql);
-
-  sql="insert into OCCURRENCE "
-        "(VERSION,CALNUM,UID,DTSTART,DTEND,RECURS) values (?,?,?,?,?,?)";
-  sql::Statement insert_occ(CALI_HERE,db,sql);
-
-  CALI_SQLCHK(db, ::sqlite3_exec(db, "begin", 0, 0, 0) );
-
-  // Get the calnum.
-  int calnum = db.calnum(calid.c_str());
-  assert(calnum);
-  // Choose a colour.
-  const char* colour =colours[ calnum % (sizeof(colours)/sizeof(char*)) ];
-  // Bind these values to the statements.
-  sql::bind_int( CALI_HERE,db,insert_cal,1,version);
-  sql::bind_int( CALI_HERE,db,insert_cal,2,calnum);
-  sql::bind_text(CALI_HERE,db,insert_cal,3,calid.c_str());
-  sql::bind_text(CALI_HERE,db,insert_cal,4,calname.c_str());
-  sql::bind_text(CALI_HERE,db,insert_cal,5,path.c_str());
-  sql::bind_int( CALI_HERE,db,insert_cal,6,readonly);
-  sql::bind_int( CALI_HERE,db,insert_cal,7,-1); // position
-  sql::bind_text(CALI_HERE,db,insert_cal,8,colour);
-  sql::step_reset(CALI_HERE,db,insert_cal);
-
-  // Remember events' UIDs, so that we can reject duplicates.
-  std::set<std::string> uids_seen;
+  GTimer* timer = g_timer_new();
+  const int changes = ::sqlite3_total_changes(db);
 
-  // Iterate through all components (VEVENTs).
-  for(icalcompiter e=icalcomponent_begin_component(_ical,ICAL_VEVENT_COMPONENT);
-      icalcompiter_deref(&e)!=NULL;
-      icalcompiter_next(&e))
+  // A mapped file is cut into batches at VEVENT boundaries.
+  std::vector<const char*> batches;
+  const char* map_end = NULL;
+  if(_map)
   {
-    icalproperty* iprop;
-    icalcomponent* ievt = ::icalcompiter_deref(&e);
-    const char* vevent = ::icalcomponent_as_ical_string(ievt);
-
-    // -- uid --
-    std::string uid;
-    if(_discard_ids)
+    // Add the VTIMEZONEs that come after the first VEVENT, if any, so that
+    // every worker's copy of _ical has them all.
+    map_end = _map->data() + _map->size();
+    const char* vtz = _map->data() + _events_from;
+    while(map_end != (vtz = find_line(vtz,map_end,"BEGIN:VTIMEZONE")))
     {
-      uid = generate_uid();
+      const char* vtz_end = find_line(vtz,map_end,"END:VTIMEZONE");
+      vtz_end = static_cast<const char*>(
+          ::memchr(vtz_end,'\n',map_end-vtz_end) );
+      vtz_end = (vtz_end? vtz_end+1: map_end);
+      icalcomponent* ivtz =
+          ::icalparser_parse_string(std::string(vtz,vtz_end).c_str());
+      if(ivtz)
+          ::icalcomponent_add_component(_ical,ivtz);
+      vtz = vtz_end;
     }
-    else
+    batches = split_vevents(_map->data()+_events_from,map_end,BATCH_BYTES);
+  }
+
+  // When re-reading, find the events we already have, so that we can skip the
+  // ones that have not changed. The calendar is already in the database, so
+  // this needn't wait for the write lock.
+  std::map<std::string,long long> stored; // UID -> HASH
+  if(incremental)
+  {
+    sql="select UID,coalesce(HASH,0) from EVENT where VERSION=1 and CALNUM=?";
+    sql::Statement select_evt(CALI_HERE,db,sql);
+    sql::bind_int(CALI_HERE,db,select_evt,1,Db::calnum(db,calid.c_str()));
+    while(true)
     {
-      iprop = icalcomponent_get_first_property(ievt,ICAL_UID_PROPERTY);
-      if(!iprop)
+      int return_code = ::sqlite3_step(select_evt);
+      if(return_code==SQLITE_ROW)
       {
-        CALI_WARN(0,"missing VEVENT::UID property");
-        continue;
+        std::string uid = safestr(::sqlite3_column_text(select_evt,0));
+        stored[uid] = ::sqlite3_column_int64(select_evt,1);
       }
-      uid = safestr( icalproperty_get_uid(iprop) );
-      if(uid.empty())
-      {
-        CALI_WARN(0,"VEVENT::UID property has no value");
-        continue;
-      }
-      if(!uids_seen.insert(uid).second)
+      else
       {
-        if(!app || app->debug)
-            CALI_WARN(0,"VEVENT::UID property not unique: %s",uid.c_str());
-        continue;
+        if(return_code!=SQLITE_DONE)
+            calendari::sql::error(CALI_HERE,db);
+        break;
       }
     }
+  }
 
-    // -- summary --
-    iprop = icalcomponent_get_first_property(ievt,ICAL_SUMMARY_PROPERTY);
-    if(!iprop)
+  // Read & expand the events a batch at a time, and write each batch before
+  // reading the next. The first batch is read before taking the write lock,
+  // so that other loads can write meanwhile. Only expand recurring events a
+  // little way past today. Db::find() expands them further when they are
+  // needed.
+  StageContext ctx;
+  ctx.discard_ids = _discard_ids;
+  ctx.horizon = ::time(NULL) + EXPAND_STEP;
+  ctx.stored = ((incremental && !_discard_ids)? &stored: NULL);
+  std::set<std::string> uids_seen;
+  std::set<std::string> matched; // The UIDs in 'stored' that we've seen.
+  std::auto_ptr<Writer> writer;
+  bool bulk_load = false;
+  int cache_size = 0;
+  int calnum = 0;
+  std::string text; // The batch, if it's read from _stream.
+  size_t next_batch = 0;
+  bool more = true;
+  while(more)
+  {
+    const char* begin;
+    const char* end;
+    if(_map)
     {
-      CALI_WARN(0,"UID:%s missing VEVENT::SUMMARY property",uid.c_str());
-      continue;
+      begin = batches[next_batch++];
+      more = (next_batch<batches.size());
+      end = (more? batches[next_batch]: map_end);
     }
-    const char* summary = icalproperty_get_summary(iprop);
-    if(!summary)
+    else
     {
-      CALI_WARN(0,"UID:%s VEVENT::SUMMARY property has no value",uid.c_str());
-      continue;
+      more = read_batch(text);
+      begin = text.data();
+      end = begin + text.size();
     }
+    std::vector<Chunk> chunks;
+    std::vector<const char*> cuts = split_vevents(begin,end,CHUNK_BYTES);
+    for(size_t i=0; i<cuts.size(); ++i)
+        chunks.push_back(Chunk(cuts[i], (i+1<cuts.size()? cuts[i+1]: end)));
+    long threads = ::sysconf(_SC_NPROCESSORS_ONLN) - 1; // Plus this one.
+    threads = std::min<long>(threads,PARSE_THREADS);
+    threads = std::min<long>(threads,chunks.size()-1);
+    Stager(chunks,ctx,_progress).stage_all(_ical,std::max(threads,0L));
+    if(_map)
+        _map->release(end - _map->data());
 
-    // -- sequence --
-    int sequence = 1;
-    iprop = icalcomponent_get_first_property(ievt,ICAL_SEQUENCE_PROPERTY);
-    if(iprop)
-        sequence = icalproperty_get_sequence(iprop);
-
-    // dtstart + tzid (if any)
-    icaltimetype dtstart = icalcomponent_get_dtstart(ievt);
-    if(icaltime_is_null_time(dtstart))
+    // Choose the events to write, in file order. Report problems, skip
+    // duplicates and, when re-reading, the events that haven't changed.
+    std::vector<const StagedEvent*> writes;
+    typedef std::vector<Chunk>::iterator CIt;
+    for(CIt c=chunks.begin(); c!=chunks.end(); ++c)
     {
-      CALI_WARN(0,"UID:%s missing VEVENT::DTSTART property",uid.c_str());
-      continue;
+      typedef std::deque<StagedEvent>::iterator SEIt;
+      for(SEIt event=c->events.begin(); event!=c->events.end(); ++event)
+      {
+        if(!event->ok)
+        {
+          if(!event->warning.empty())
+              CALI_WARN(0,"%s",event->warning.c_str());
+          continue;
+        }
+        if(!unique_uid(app,uids_seen,event->uid))
+            continue;
+        if(incremental)
+        {
+          std::map<std::string,long long>::const_iterator s =
+              stored.find(event->uid);
+          if(s!=stored.end())
+          {
+            matched.insert(event->uid);
+            if(s->second==event->hash)
+            {
+              if(_progress)
+                  g_atomic_int_inc(&_progress->events);
+              continue;
+            }
+          }
+        }
+        assert(!event->unchanged);
+        writes.push_back(&*event);
+      }
     }
 
-    // all_day
-    int all_day = dtstart.is_date;
-
-    // dtend + tzid (if any)
-    icaltimetype dtend = icalcomponent_get_dtend(ievt);
-    if(icaltime_is_null_time(dtend))
+    if(!writer.get())
     {
-      CALI_WARN(0,"UID:%s missing VEVENT::DTEND property",uid.c_str());
-      continue;
-    }
-    if(dtend.is_date)
-      --dtend.day; // iCal allday events end the day after.
+      // The first batch shows whether this is a big file.
+      bulk_load = (bulk && (more || writes.size()>=BULK_EVENTS));
+      if(bulk_load)
+      {
+        // Give the connection plenty of cache, and keep the BULK_ tables in
+        // memory. The load is one transaction, so the WAL is only synced
+        // when it commits; durability is left as it is.
+        sql::query_val(CALI_HERE,db,cache_size,"pragma cache_size");
+        sql::execf(CALI_HERE,db,"pragma cache_size=%d",-BULK_CACHE_KB);
+        sql::exec(CALI_HERE,db,"pragma temp_store=MEMORY");
+      }
 
-    // Bind values common to all occurrences.
-    sql::bind_int( CALI_HERE,db,insert_occ,1,version);
-    sql::bind_int( CALI_HERE,db,insert_occ,2,calnum);
-    sql::bind_text(CALI_HERE,db,insert_occ,3,uid.c_str());
-    // Generate occurrences.
-    RecurType recurs = process_rrule(ievt,dtstart,dtend,db,insert_occ);
-
-    // Make the EVENT row.
-    // Note: Delay making the event until after we've processed the RRULEs,
-    // makes live easier, atthe expense of allowing the DB to temporarily
-    // contain OCCURRENCEs without a corresponding EVENT.
-    sql::bind_int( CALI_HERE,db,insert_evt,1,version);
-    sql::bind_int( CALI_HERE,db,insert_evt,2,calnum);
-    sql::bind_text(CALI_HERE,db,insert_evt,3,uid.c_str());
-    sql::bind_text(CALI_HERE,db,insert_evt,4,summary);
-    sql::bind_int( CALI_HERE,db,insert_evt,5,sequence);
-    sql::bind_int( CALI_HERE,db,insert_evt,6,all_day);
-    sql::bind_int( CALI_HERE,db,insert_evt,7,recur2int(recurs));
-    sql::bind_text(CALI_HERE,db,insert_evt,8,vevent);
-    sql::step_reset(CALI_HERE,db,insert_evt);
+      // Take the write lock straight away, rather than upgrading a read
+      // lock. Hold it until the last batch is written.
+      CALI_SQLCHK(db, ::sqlite3_exec(db, "begin immediate", 0, 0, 0) );
+      if(bulk_load)
+          Db::begin_bulk(db);
+
+      // Get the calnum.
+      calnum = Db::calnum(db,calid.c_str());
+      assert(calnum);
+      // Choose a colour.
+      const char* colour =colours[ calnum % (sizeof(colours)/sizeof(char*)) ];
+      // Bind these values to the statements.
+      sql::bind_int( CALI_HERE,db,insert_cal,1,version);
+      sql::bind_int( CALI_HERE,db,insert_cal,2,calnum);
+      sql::bind_text(CALI_HERE,db,insert_cal,3,calid.c_str());
+      sql::bind_text(CALI_HERE,db,insert_cal,4,calname.c_str());
+      sql::bind_text(CALI_HERE,db,insert_cal,5,path.c_str());
+      sql::bind_int( CALI_HERE,db,insert_cal,6,readonly);
+      sql::bind_int( CALI_HERE,db,insert_cal,7,-1); // position
+      sql::bind_text(CALI_HERE,db,insert_cal,8,colour);
+      sql::step_reset(CALI_HERE,db,insert_cal);
+      writer.reset( new Writer(db,version,calnum,bulk_load,_progress) );
+    }
+    typedef std::vector<const StagedEvent*>::const_iterator WIt;
+    for(WIt w=writes.begin(); w!=writes.end(); ++w)
+        writer->write(**w);
   }
+  writer.reset();
+  if(bulk_load)
+      Db::end_bulk(db);
   CALI_SQLCHK(db, ::sqlite3_exec(db, "commit", 0, 0, 0) );
+  if(bulk_load)
+  {
+    // A ReadQueue connection is closed straight after this, but the main
+    // connection also loads files (subscribe & import from the menu or the
+    // command line), and it should not keep the bulk settings.
+    sql::execf(CALI_HERE,db,"pragma cache_size=%d",cache_size);
+    sql::exec(CALI_HERE,db,"pragma temp_store=DEFAULT");
+  }
+  if(app && app->debug)
+  {
+    int rows = ::sqlite3_total_changes(db) - changes;
+    double seconds = g_timer_elapsed(timer,NULL);
+    printf("Loaded %s: %d rows in %.2fs, %.0f rows/s%s\n",
+        _ical_filename.c_str(),rows,seconds,
+        (seconds>0? rows/seconds: 0.0),(bulk_load? " (bulk)": ""));
+  }
+  g_timer_destroy(timer);
+  // Whatever wasn't matched has gone from the file.
+  typedef std::map<std::string,long long>::const_iterator SIt;
+  for(SIt s=stored.begin(); s!=stored.end(); ++s)
+      if(!matched.count(s->first))
+          removed.push_back(s->first);
   return calnum;
 }
 
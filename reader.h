@@ -2,25 +2,46 @@
 #define CALENDARI__ICS__READER_H 1
 
 #include "err.h"
+#include "icsscan.h"
 
+#include <glib.h>
 #include <libical/ical.h>
+#include <set>
+#include <sqlite3.h>
 #include <string>
+#include <vector>
 
 namespace calendari {
   struct Calendari;
-  class Db;
 }
 
 namespace calendari {
 namespace ics {
 
 
+/** How far a Reader has got. The counters are updated atomically, so that
+*   another thread may watch them. */
+struct Progress
+{
+  Progress(void): bytes(0), events(0) {}
+  volatile gint  bytes;  ///< Bytes of the file parsed so far.
+  volatile gint  events; ///< VEVENTs loaded so far.
+};
+
+
 /** Helper class used by ics functions that read calendars. */
 class Reader
 {
   icalcomponent*     _ical;
   const std::string  _ical_filename;
   bool               _discard_ids;
+  Progress*          _progress;
+  /** _ical only holds the calendar's properties & leading timezones. If the
+  *   file is mapped, then load() scans the VEVENTs from _events_from, and
+  *   otherwise it reads them from _stream. */
+  MappedFile*        _map;
+  size_t             _events_from;
+  StreamScanner*     _stream;
 
 public:
   struct Exception: public util::Exception {
@@ -40,26 +61,66 @@ public:
   std::string     calname;
   std::string     path;
   bool            readonly;
-
-  /** Read _ical from 'ical_filename' and initialise members. */
-  Reader(const char* ical_filename);
+  /** If set, then load() only writes the events that differ from those
+  *   already in version 1, and lists the ones that have gone in 'removed'. */
+  bool            incremental;
+  std::vector<std::string>  removed;
+  /** If set, and the file has more than one batch, or at least BULK_EVENTS
+  *   VEVENTs, then load() writes them as fast as it can: into unindexed
+  *   tables that are copied into place, in primary-key order, at the end
+  *   (see Db::begin_bulk()), with a large page cache. Only for calendars
+  *   that are new to the database. */
+  bool            bulk;
+
+  /** Smallest file for which 'bulk' takes effect. */
+  static const size_t BULK_EVENTS = 2000;
+  /** Page cache for a bulk load, in KB. */
+  static const int BULK_CACHE_KB = 64*1024;
+  /** load() reads, stages & writes the VEVENTs in batches of about this
+  *   size, so that it only holds one batch in memory. The first batch is
+  *   staged before the write lock is taken. */
+  static const size_t BATCH_BYTES = 16*1024*1024;
+  /** Each batch is cut into chunks of about this size, which are scanned
+  *   and expanded by the loading thread and up to PARSE_THREADS workers. */
+  static const size_t CHUNK_BYTES = 1024*1024;
+  static const int PARSE_THREADS = 4;
+
+  /** Read _ical from 'ical_filename' and initialise members. Reports to
+  *   'progress', if it's set. Regular files are mapped into memory, and
+  *   load() scans their VEVENTs in place: libical only parses the ones that
+  *   scan_vevent() can't handle. Other files are read a VEVENT at a time. */
+  Reader(const char* ical_filename, Progress* progress=NULL);
   ~Reader(void);
 
   /** Returns FALSE if 'calid' is already in use in database 'db'. */
-  bool calid_is_unique(Db& db) const;
+  bool calid_is_unique(sqlite3* db) const;
 
   /** Tell the object to throw away all of the unique IDs (calid & UIDs)
   *   read from the .ics file, and create new ones. */
   void discard_ids(void);
 
-  /** Load the calendar into database 'db'. */
+  /** Load the calendar into database 'db'. Only touches the database, so
+  *   it may be called from any thread with its own connection. */
   int load(
       Calendari*   app,
-      Db&          db,
+      sqlite3*     db,
       int          version
     );
 
 private:
+  /** Read the next BATCH_BYTES or so of VEVENTs from _stream into 'text'.
+  *   VTIMEZONEs are added to _ical, for the VEVENTs that follow them.
+  *   Returns FALSE if the stream is exhausted. */
+  bool read_batch(std::string& text);
+
+  /** Replace 'uid' with a new one if IDs are discarded. Returns FALSE if
+  *   it's in 'seen' already. */
+  bool unique_uid(
+      Calendari*              app,
+      std::set<std::string>&  seen,
+      std::string&            uid
+    ) const;
+
   Reader(Reader&);
   Reader& operator = (Reader&);
 };
@@ -0,0 +1,324 @@
+#include "readqueue.h"
+
+#include "calendari.h"
+#include "db.h"
+#include "err.h"
+#include "event.h"
+#include "ics.h"
+#include "queue.h"
+#include "sql.h"
+#include "view.h"
+
+#include <cassert>
+#include <cstdio>
+
+namespace calendari {
+
+
+/** How often the status bar is updated while files are being read. */
+const guint STATUS_MS = 250;
+
+/** Milliseconds that a job waits for the other jobs' write locks. */
+const int WRITE_TIMEOUT = 60000;
+
+
+ReadQueue::ReadQueue(Calendari& app, const char* dbname)
+  : _app(app),
+    _dbname(dbname),
+    _pool(NULL),
+    _status_source(0),
+    _status_ctx_id(0),
+    _status_shown(false),
+    _refreshed(0),
+    _skipped(0)
+{
+  GError* error = NULL;
+  _pool = g_thread_pool_new(run,this,READ_THREADS,false,&error);
+  if(!_pool)
+  {
+    CALI_WARN(0,"Failed to start read queue threads: %s",error->message);
+    g_error_free(error);
+  }
+}
+
+
+ReadQueue::~ReadQueue(void)
+{
+  if(_pool)
+      g_thread_pool_free(_pool,true,true); // Drop waiting jobs.
+  for(std::list<Job*>::iterator j=_jobs.begin(); j!=_jobs.end(); ++j)
+      delete *j;
+}
+
+
+void
+ReadQueue::subscribe(const char* filename)
+{
+  assert(filename);
+  Job* job = new Job();
+  job->kind     = SUBSCRIBE;
+  job->filename = filename;
+  job->calnum   = 0;
+  job->version  = 1;
+  push(job);
+}
+
+
+void
+ReadQueue::import(const char* filename)
+{
+  assert(filename);
+  Job* job = new Job();
+  job->kind     = IMPORT;
+  job->filename = filename;
+  job->calnum   = 0;
+  job->version  = 1;
+  push(job);
+}
+
+
+void
+ReadQueue::reread(const Calendar& cal)
+{
+  // Don't queue the same calendar twice.
+  for(std::list<Job*>::iterator j=_jobs.begin(); j!=_jobs.end(); ++j)
+      if((**j).kind==REREAD && (**j).calnum==cal.calnum)
+          return;
+
+  // Stage the calendar in the lowest free version.
+  int version = 2;
+  while(_versions.count(version))
+      ++version;
+  _versions.insert(version);
+
+  Job* job = new Job();
+  job->kind     = REREAD;
+  job->filename = cal.path();
+  job->calid    = cal.calid;
+  job->calnum   = cal.calnum;
+  job->version  = version;
+  job->stored   = cal.fingerprint();
+  push(job);
+}
+
+
+void
+ReadQueue::skipped(void)
+{
+  ++_skipped;
+  start_status();
+}
+
+
+// -- private: --
+
+void
+ReadQueue::push(Job* job)
+{
+  job->queue     = this;
+  job->result    = -1;
+  job->unchanged = false;
+  if(!_pool)
+  {
+    delete job;
+    return;
+  }
+  // The threads must see any new calendars, so that they choose fresh calnums.
+  Queue::inst().flush();
+
+  _jobs.push_back(job);
+  g_thread_pool_push(_pool,job,NULL);
+  start_status();
+}
+
+
+void
+ReadQueue::start_status(void)
+{
+  if(!_status_source)
+      _status_source = g_timeout_add(STATUS_MS,status,this);
+}
+
+
+void
+ReadQueue::perform(Job& job, sqlite3* sdb)
+{
+  Calendari* app = &job.queue->_app;
+  const char* filename = job.filename.c_str();
+  switch(job.kind)
+  {
+    case SUBSCRIBE:
+        job.result = ics::subscribe(app,filename,sdb,1,&job.progress);
+        break;
+    case IMPORT:
+        job.result = ics::import(app,filename,sdb,1,&job.progress);
+        break;
+    case REREAD:
+        // Don't parse the file if its contents haven't changed.
+        if(job.found.hash_file(filename) && job.found.hash==job.stored.hash)
+        {
+          job.unchanged = true;
+          job.result = job.calnum;
+          break;
+        }
+        // Clear out anything left in the staging version by an earlier job.
+        sql::execf(CALI_HERE,sdb,
+            "delete from OCCURRENCE where VERSION=%d",job.version);
+        sql::execf(CALI_HERE,sdb,
+            "delete from EVENT where VERSION=%d",job.version);
+        sql::execf(CALI_HERE,sdb,
+            "delete from CALENDAR where VERSION=%d",job.version);
+        job.result = ics::reread(app,filename,sdb,job.calid.c_str(),
+            job.version,&job.progress,&job.removed);
+        break;
+  }
+}
+
+
+bool
+ReadQueue::finish(Job& job)
+{
+  if(job.result<0)
+      return true;
+  Db& db = *_app.db;
+  if(job.kind!=REREAD)
+  {
+    _app.add_calendar(job.result);
+    return true;
+  }
+  // If the calendar was deleted while it was being read, then just leave the
+  // new rows for the next job to clear out of this version.
+  Calendar* cal = db.calendar(job.calnum);
+  if(!cal)
+      return true;
+  if(job.unchanged)
+  {
+    cal->set_fingerprint(job.found); // The mtime may have changed.
+    ++_skipped;
+    return true;
+  }
+  // Only the events that changed are replaced, so the selection may stay.
+  std::set<std::string> uids(job.removed.begin(),job.removed.end());
+  db.staged_uids(job.version,uids);
+  // The merge destroys these events' occurrences, so nothing may pin them.
+  _app.release(uids);
+  if(!db.merge_cal(job.version,uids))
+      return false;
+  cal->set_fingerprint(job.found);
+  ++_refreshed;
+  if(uids.empty())
+      return true; // Nothing to redraw.
+  _app.main_view->reload();
+  _app.queue_main_redraw();
+  return true;
+}
+
+
+bool
+ReadQueue::show_status(void)
+{
+  if(!_app.statusbar)
+      return false;
+  if(!_status_ctx_id)
+  {
+    _status_ctx_id =
+        gtk_statusbar_get_context_id(_app.statusbar,"Read Queue");
+  }
+  if(_status_shown)
+  {
+    gtk_statusbar_pop(_app.statusbar,_status_ctx_id);
+    _status_shown = false;
+  }
+  if(_jobs.empty())
+  {
+    if(!_refreshed && !_skipped)
+        return false;
+    // Leave a summary in the status bar.
+    char buf[256];
+    ::snprintf(buf,sizeof(buf),"Refreshed %d calendars, %d unchanged",
+        _refreshed,_skipped);
+    gtk_statusbar_push(_app.statusbar,_status_ctx_id,buf);
+    _status_shown = true;
+    _refreshed = _skipped = 0;
+    return false;
+  }
+
+  int bytes  = 0;
+  int events = 0;
+  for(std::list<Job*>::iterator j=_jobs.begin(); j!=_jobs.end(); ++j)
+  {
+    bytes  += g_atomic_int_get(&(**j).progress.bytes);
+    events += g_atomic_int_get(&(**j).progress.events);
+  }
+  char buf[256];
+  if(_jobs.size()==1)
+  {
+    gchar* name = g_path_get_basename(_jobs.front()->filename.c_str());
+    ::snprintf(buf,sizeof(buf),"Reading %s: %d KB, %d events",
+        name,bytes/1024,events);
+    g_free(name);
+  }
+  else
+  {
+    ::snprintf(buf,sizeof(buf),"Reading %d calendars: %d KB, %d events",
+        int(_jobs.size()),bytes/1024,events);
+  }
+  gtk_statusbar_push(_app.statusbar,_status_ctx_id,buf);
+  _status_shown = true;
+  return true;
+}
+
+
+void
+ReadQueue::run(gpointer data, gpointer)
+{
+  util::set_background_thread();
+  Job& job = *static_cast<Job*>(data);
+  sqlite3* sdb = NULL;
+  const char* dbname = job.queue->_dbname.c_str();
+  if(SQLITE_OK == ::sqlite3_open_v2(dbname,&sdb,SQLITE_OPEN_READWRITE,NULL))
+  {
+    // Other jobs may hold the write lock for as long as their inserts take.
+    ::sqlite3_busy_timeout(sdb,WRITE_TIMEOUT);
+    perform(job,sdb);
+  }
+  else
+  {
+    CALI_WARN(0,"ReadQueue failed to open database %s",dbname);
+  }
+  ::sqlite3_close(sdb);
+  (void)g_idle_add(done,&job);
+}
+
+
+gboolean
+ReadQueue::done(gpointer data)
+{
+  Job* job = static_cast<Job*>(data);
+  ReadQueue& self = *job->queue;
+  if(!self.finish(*job))
+  {
+    // Another job is writing. Swap this one in later.
+    (void)g_timeout_add(Queue::RETRY_MS,done,job);
+    return false;
+  }
+  if(job->kind==REREAD)
+      self._versions.erase(job->version);
+  self._jobs.remove(job);
+  delete job;
+  return false;
+}
+
+
+gboolean
+ReadQueue::status(gpointer data)
+{
+  ReadQueue& self = *static_cast<ReadQueue*>(data);
+  if(self.show_status())
+      return true;
+  self._status_source = 0;
+  return false;
+}
+
+
+} // end namespace calendari
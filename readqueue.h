@@ -0,0 +1,113 @@
+#ifndef CALENDARI__READQUEUE_H
+#define CALENDARI__READQUEUE_H 1
+
+#include "reader.h"
+#include "util.h"
+
+#include <gtk/gtk.h>
+#include <list>
+#include <set>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+
+namespace calendari {
+
+class Calendar;
+struct Calendari;
+
+
+/** Pool of background threads that read .ics files into the database, so
+*   that big calendars don't freeze the GTK main loop.
+*
+*   Each job parses its file, expands recurring events and inserts the rows
+*   using its own connection. Up to READ_THREADS files are parsed at once; the
+*   inserts take turns for the database's write lock. Only then is the main
+*   thread called back, with g_idle_add(), to load the new calendar into
+*   memory, or to merge a re-read calendar into place with Db::merge_cal().
+*   Each re-read stages just the events that have changed, in a VERSION of its
+*   own, so the merges may happen in any order. While jobs are running their
+*   progress is shown in the status bar. */
+class ReadQueue
+{
+public:
+  ReadQueue(Calendari& app, const char* dbname);
+  ~ReadQueue(void);
+
+  /** FALSE if the threads could not be started. */
+  bool running(void) const
+    { return _pool!=NULL; }
+
+  /** Subscribe to 'filename', as ics::subscribe(). */
+  void subscribe(const char* filename);
+
+  /** Import 'filename', as ics::import(). */
+  void import(const char* filename);
+
+  /** Re-read the readonly calendar 'cal' from its file, as ics::reread().
+  *   The file isn't parsed if its contents match cal.fingerprint(). */
+  void reread(const Calendar& cal);
+
+  /** Count a calendar whose file was not re-read, because it had not
+  *   changed. The status bar reports how many were refreshed & skipped. */
+  void skipped(void);
+
+  /** Maximum number of files that are read at once. */
+  static const int READ_THREADS = 4;
+
+private:
+  enum Kind { SUBSCRIBE, IMPORT, REREAD };
+
+  struct Job
+  {
+    ReadQueue*     queue;
+    Kind           kind;
+    std::string    filename;
+    std::string    calid;    ///< REREAD only.
+    int            calnum;   ///< REREAD only.
+    int            version;  ///< Where the rows are written.
+    int            result;   ///< Return value from ics::subscribe() etc.
+    ics::Progress  progress;
+    std::vector<std::string>  removed; ///< REREAD only: UIDs that have gone.
+    Fingerprint    stored;    ///< REREAD only: the file when last read.
+    Fingerprint    found;     ///< REREAD only: the file now.
+    bool           unchanged; ///< REREAD only: found.hash==stored.hash
+  };
+
+  Calendari&         _app;
+  const std::string  _dbname;
+  GThreadPool*       _pool;
+  /** Jobs that have been pushed, but not yet finished. Main thread only. */
+  std::list<Job*>    _jobs;
+  /** Staging versions that are in use by _jobs. Main thread only. */
+  std::set<int>      _versions;
+  /** Status bar polling, in the main thread. */
+  guint              _status_source;
+  guint              _status_ctx_id;
+  bool               _status_shown;
+  /** Calendars re-read & skipped since the status bar last reported them. */
+  int                _refreshed;
+  int                _skipped;
+
+  ReadQueue(const ReadQueue&); // Not copyable
+  ReadQueue& operator=(const ReadQueue&);
+
+  void push(Job* job);
+  /** Runs in a pool thread. */
+  static void perform(Job& job, sqlite3* sdb);
+  /** Runs in the main thread, once 'job' has been written to the database.
+  *   Returns FALSE if the database is busy, so that it must be tried again. */
+  bool finish(Job& job);
+  void start_status(void);
+  /** Show the jobs' progress. FALSE once there's nothing to show. */
+  bool show_status(void);
+
+  static void run(gpointer job, gpointer self);
+  static gboolean done(gpointer job);
+  static gboolean status(gpointer self);
+};
+
+
+} // end namespace calendari
+
+#endif // CALENDARI__READQUEUE_H
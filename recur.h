@@ -1,6 +1,8 @@
 #ifndef CALENDARI__RECUR_H
 #define CALENDARI__RECUR_H 1
 
+#include <time.h>
+
 namespace calendari {
 
 
@@ -25,6 +27,18 @@ int recur2int(RecurType r);
 RecurType add_recurrence(RecurType r0, RecurType r1);
 
 
+/** Recurring events are expanded into OCCURRENCEs lazily. EVENT.EXPANDED
+*   records the time up to which each event's occurrences are in the
+*   database. Expansion proceeds in steps of this size. */
+const time_t EXPAND_STEP  = 92 * 24 * 60 * 60; // about three months
+
+/** EVENT.EXPANDED value for events that have no more occurrences to expand. */
+const time_t EXPANDED_ALL = 0x7fffffffffffffffLL;
+
+/** An expansion horizon that is earlier than any event. */
+const time_t EXPANDED_NONE = -EXPANDED_ALL - 1;
+
+
 } // end namespace calendari
 
 #endif // CALENDARI__RECUR_H
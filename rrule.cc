@@ -0,0 +1,345 @@
+#include "rrule.h"
+
+#include <cstdio>
+
+namespace calendari {
+namespace ics {
+
+namespace {
+
+/** TRUE if the BYxxx array 'by' has no entries. */
+inline bool empty(const short* by)
+{
+  return( by[0]==ICAL_RECURRENCE_ARRAY_MAX );
+}
+
+
+/** Compare the dates of 'a' & 'b', ignoring their times. */
+int compare_date(const icaltimetype& a, const icaltimetype& b)
+{
+  if(a.year!=b.year)
+      return( a.year<b.year? -1: 1 );
+  if(a.month!=b.month)
+      return( a.month<b.month? -1: 1 );
+  if(a.day!=b.day)
+      return( a.day<b.day? -1: 1 );
+  return 0;
+}
+
+} // end anonymous namespace
+
+
+RecurIterator::RecurIterator(
+    const icalrecurrencetype&  recur,
+    const icaltimetype&        dtstart
+  )
+  : _ical(NULL),
+    _shape(DAILY),
+    _dtstart(dtstart),
+    _until(recur.until),
+    _count(recur.count),
+    _interval(recur.interval),
+    _period(dtstart),
+    _first(true),
+    _noffsets(0),
+    _index(0),
+    _emitted(0),
+    _done(false)
+{
+  if(!_compile(recur))
+      _ical = ::icalrecur_iterator_new(recur,dtstart);
+}
+
+
+RecurIterator::~RecurIterator(void)
+{
+  if(_ical)
+      ::icalrecur_iterator_free(_ical);
+}
+
+
+icaltimetype
+RecurIterator::next(void)
+{
+  if(_ical)
+      return ::icalrecur_iterator_next(_ical);
+  while(!_done)
+  {
+    if(_count && _emitted>=_count)
+    {
+      _done = true;
+      break;
+    }
+    if(_index==_noffsets)
+    {
+      _next_period();
+      _index = 0;
+      _first = false;
+    }
+    icaltimetype t = _period;
+    const int offset = _offsets[_index++];
+    if(_shape==WEEKLY)
+        ::icaltime_adjust(&t,offset,0,0,0);
+    else if(_shape==MONTHLY)
+        t.day = offset;
+    if(_first && compare_date(t,_dtstart)<0)
+        continue; // Before DTSTART, in its week or month.
+    if(!::icaltime_is_null_time(_until) && ::icaltime_compare(t,_until)>0)
+    {
+      _done = true;
+      break;
+    }
+    ++_emitted;
+    return t;
+  }
+  return ::icaltime_null_time();
+}
+
+
+bool
+RecurIterator::_compile(const icalrecurrencetype& recur)
+{
+  if(::icaltime_is_null_time(_dtstart) || _interval<1)
+      return false;
+  if(!empty(recur.by_second)   || !empty(recur.by_minute)   ||
+     !empty(recur.by_hour)     || !empty(recur.by_year_day) ||
+     !empty(recur.by_week_no)  || !empty(recur.by_month)    ||
+     !empty(recur.by_set_pos))
+  {
+    return false;
+  }
+  _noffsets = 1;
+  _offsets[0] = 0;
+  switch(recur.freq)
+  {
+    case ICAL_DAILY_RECURRENCE:
+      {
+        if(!empty(recur.by_day) || !empty(recur.by_month_day))
+            return false;
+        _shape = DAILY;
+        return true;
+      }
+    case ICAL_WEEKLY_RECURRENCE:
+      {
+        if(!empty(recur.by_month_day))
+            return false;
+        const int wkst = (recur.week_start==ICAL_NO_WEEKDAY?
+            ICAL_MONDAY_WEEKDAY: recur.week_start);
+        const int start = (::icaltime_day_of_week(_dtstart) - wkst + 7) % 7;
+        _offsets[0] = start;
+        if(!empty(recur.by_day))
+        {
+          bool days[7] = {false,false,false,false,false,false,false};
+          for(int i=0; recur.by_day[i]!=ICAL_RECURRENCE_ARRAY_MAX; ++i)
+          {
+            if(::icalrecurrencetype_day_position(recur.by_day[i])!=0)
+                return false; // E.g. BYDAY=2MO
+            const int d = ::icalrecurrencetype_day_day_of_week(recur.by_day[i]);
+            if(d<ICAL_SUNDAY_WEEKDAY || d>ICAL_SATURDAY_WEEKDAY)
+                return false;
+            days[(d - wkst + 7) % 7] = true;
+          }
+          if(!days[start])
+              return false;
+          _noffsets = 0;
+          for(int i=0; i<7; ++i)
+              if(days[i])
+                  _offsets[_noffsets++] = i;
+        }
+        ::icaltime_adjust(&_period,-start,0,0,0); // Back to WKST.
+        _shape = WEEKLY;
+        return true;
+      }
+    case ICAL_MONTHLY_RECURRENCE:
+      {
+        // Days that some months lack are left to libical.
+        if(!empty(recur.by_day) || _dtstart.day>28)
+            return false;
+        _offsets[0] = _dtstart.day;
+        if(!empty(recur.by_month_day))
+        {
+          bool days[29];
+          for(int i=0; i<29; ++i)
+              days[i] = false;
+          for(int i=0; recur.by_month_day[i]!=ICAL_RECURRENCE_ARRAY_MAX; ++i)
+          {
+            const int d = recur.by_month_day[i];
+            if(d<1 || d>28)
+                return false;
+            days[d] = true;
+          }
+          if(!days[_dtstart.day])
+              return false;
+          _noffsets = 0;
+          for(int i=1; i<29; ++i)
+              if(days[i])
+                  _offsets[_noffsets++] = i;
+        }
+        _period.day = 1;
+        _shape = MONTHLY;
+        return true;
+      }
+    case ICAL_YEARLY_RECURRENCE:
+      {
+        if(!empty(recur.by_day) || !empty(recur.by_month_day))
+            return false;
+        if(_dtstart.month==2 && _dtstart.day==29)
+            return false;
+        _shape = YEARLY;
+        return true;
+      }
+    default:
+        break;
+  }
+  return false;
+}
+
+
+void
+RecurIterator::_next_period(void)
+{
+  switch(_shape)
+  {
+    case DAILY:
+        ::icaltime_adjust(&_period,_interval,0,0,0);
+        break;
+    case WEEKLY:
+        ::icaltime_adjust(&_period,7*_interval,0,0,0);
+        break;
+    case MONTHLY:
+        _period.month += _interval;
+        _period.year  += (_period.month-1) / 12;
+        _period.month  = (_period.month-1) % 12 + 1;
+        break;
+    case YEARLY:
+        _period.year += _interval;
+        break;
+  }
+}
+
+
+} } // end namespace calendari::ics
+
+
+#ifdef CALENDARI__RRULE__TEST
+#include <cstring>
+#include <string>
+
+/** Parse a DTSTART of the form [TZID:]TIME. Sets 'ok' FALSE if the TZID is
+*   not one of libical's built in time zones. */
+icaltimetype parse_start(const char* start, bool& ok)
+{
+  ok = true;
+  const char* colon = ::strchr(start,':');
+  if(!colon)
+      return ::icaltime_from_string(start);
+  icaltimetype t = ::icaltime_from_string(colon+1);
+  const std::string tzid(start,colon-start);
+  icaltimezone* zone = ::icaltimezone_get_builtin_timezone(tzid.c_str());
+  if(!zone)
+      ok = false;
+  return ::icaltime_set_timezone(&t,zone);
+}
+
+
+/** Differential test: check that RecurIterator's generators give the same
+*   instances as libical, in the same time zone. Compares instances up to
+*   2037; some versions of libical stop there.
+*   Syntax: test_rrule [[TZID:]DTSTART RRULE ...] */
+int main(int argc, char* argv[])
+{
+  static const char* starts[] = {
+      "20240101T090000", "20240131T183000", "20240229T120000",
+      "20240615T000000Z", "20231105T013000", "20240310T023000",
+      "20240703", "20241231",
+      // Either side of the clocks changing, and at times that are skipped
+      // (01:30 on 31st March in London, 02:30 on 10th March in New York)
+      // or repeated (01:30 on 3rd November in New York).
+      "Europe/London:20240324T013000", "Europe/London:20240115T090000",
+      "Europe/London:20241020T120000", "America/New_York:20240303T023000",
+      "America/New_York:20240210T023000", "America/New_York:20241027T013000",
+      0
+    };
+  static const char* rules[] = {
+      "FREQ=DAILY", "FREQ=DAILY;INTERVAL=3", "FREQ=DAILY;COUNT=10",
+      "FREQ=DAILY;UNTIL=20240401T000000Z",
+      "FREQ=WEEKLY", "FREQ=WEEKLY;INTERVAL=2",
+      "FREQ=WEEKLY;BYDAY=MO,TU,WE,TH,FR", "FREQ=WEEKLY;BYDAY=SA,SU,MO",
+      "FREQ=WEEKLY;INTERVAL=2;BYDAY=MO,WE,FR,SA,SU;WKST=SU",
+      "FREQ=WEEKLY;INTERVAL=3;BYDAY=TU,SA;COUNT=20;WKST=WE",
+      "FREQ=WEEKLY;BYDAY=MO,WE,FR,SA,SU;UNTIL=20240301",
+      "FREQ=MONTHLY", "FREQ=MONTHLY;INTERVAL=5;COUNT=30",
+      "FREQ=MONTHLY;BYMONTHDAY=1,15,28", "FREQ=MONTHLY;BYMONTHDAY=3",
+      "FREQ=MONTHLY;INTERVAL=2;BYMONTHDAY=28,1,7,3;UNTIL=20260101T000000Z",
+      "FREQ=YEARLY", "FREQ=YEARLY;INTERVAL=4", "FREQ=YEARLY;COUNT=3",
+      "FREQ=MONTHLY;BYDAY=2MO", "FREQ=YEARLY;BYMONTH=3;BYDAY=-1SU",
+      // UNTIL is in UTC, so it must be compared in DTSTART's time zone.
+      "FREQ=DAILY;UNTIL=20241027T013000Z", "FREQ=WEEKLY;BYDAY=SU;COUNT=10",
+      "FREQ=WEEKLY;UNTIL=20241110T063000Z",
+      // Left to libical.
+      "FREQ=MONTHLY;BYMONTHDAY=-1", "FREQ=MONTHLY;BYMONTHDAY=10,-3;COUNT=24",
+      "FREQ=MONTHLY;BYDAY=MO,TU,WE,TH,FR;BYSETPOS=-1",
+      "FREQ=WEEKLY;BYDAY=MO,WE,FR;BYSETPOS=1,-1", 0
+    };
+  int tests = 0;
+  int compiled = 0;
+  int failures = 0;
+  for(int i=0; ; ++i)
+  {
+    const char* start;
+    const char* rule;
+    if(argc>1)
+    {
+      if(2*i+2 >= argc)
+          break;
+      start = argv[2*i+1];
+      rule  = argv[2*i+2];
+    }
+    else
+    {
+      const int nstarts = sizeof(starts)/sizeof(starts[0]) - 1;
+      if(!rules[i/nstarts])
+          break;
+      start = starts[i%nstarts];
+      rule  = rules[i/nstarts];
+    }
+    bool ok;
+    icaltimetype dtstart = parse_start(start,ok);
+    if(!ok)
+    {
+      printf("SKIP %s: unknown time zone\n",start);
+      continue;
+    }
+    ++tests;
+    icalrecurrencetype recur = ::icalrecurrencetype_from_string(rule);
+    calendari::ics::RecurIterator ours(recur,dtstart);
+    icalrecur_iterator* theirs = ::icalrecur_iterator_new(recur,dtstart);
+    if(ours.compiled())
+        ++compiled;
+    for(int n=0; n<5000; ++n)
+    {
+      icaltimetype a = ours.next();
+      icaltimetype b = ::icalrecur_iterator_next(theirs);
+      const bool a_end = (::icaltime_is_null_time(a) || a.year>=2038);
+      const bool b_end = (::icaltime_is_null_time(b) || b.year>=2038);
+      if(a_end && b_end)
+          break;
+      if(a_end!=b_end || 0!=::icaltime_compare(a,b) ||
+         a.hour!=b.hour || a.minute!=b.minute || a.second!=b.second ||
+         a.zone!=b.zone ||
+         ::icaltime_as_timet_with_zone(a,a.zone) !=
+           ::icaltime_as_timet_with_zone(b,b.zone))
+      {
+        printf("FAIL %s %s #%d: %s != %s\n",start,rule,n,
+            (a_end? "end": ::icaltime_as_ical_string(a)),
+            (b_end? "end": ::icaltime_as_ical_string(b)));
+        ++failures;
+        break;
+      }
+    }
+    ::icalrecur_iterator_free(theirs);
+  }
+  printf("%d rules, %d compiled, %d failed\n",tests,compiled,failures);
+  return( failures? 1: 0 );
+}
+#endif // test
@@ -0,0 +1,66 @@
+#ifndef CALENDARI__ICS__RRULE_H
+#define CALENDARI__ICS__RRULE_H 1
+
+#include <libical/ical.h>
+
+namespace calendari {
+namespace ics {
+
+
+/** Iterates over the instances of an RRULE, exactly as icalrecur_iterator
+*   does. The common shapes of rule are compiled into simple generators:
+*
+*     FREQ=DAILY
+*     FREQ=WEEKLY, with or without BYDAY=MO,WE,...
+*     FREQ=MONTHLY, with or without BYMONTHDAY=1,15,...
+*     FREQ=YEARLY
+*
+*   each with any INTERVAL, COUNT or UNTIL. That covers all of the RecurType
+*   categories. Only rules for which DTSTART is itself an instance are
+*   compiled, as libical versions differ over the others. Anything else is
+*   left to libical. */
+class RecurIterator
+{
+public:
+  RecurIterator(const icalrecurrencetype& recur, const icaltimetype& dtstart);
+  ~RecurIterator(void);
+
+  /** The next instance, or the null time once there are no more. */
+  icaltimetype next(void);
+
+  /** FALSE if the rule is being expanded by libical. */
+  bool compiled(void) const { return !_ical; }
+
+private:
+  enum Shape { DAILY, WEEKLY, MONTHLY, YEARLY };
+
+  icalrecur_iterator*  _ical; ///< Fallback, for the rules we can't compile.
+  Shape                _shape;
+  icaltimetype         _dtstart;
+  icaltimetype         _until;  ///< Null if there's no UNTIL.
+  int                  _count;  ///< Zero if there's no COUNT.
+  int                  _interval;
+  /** Start of the current period: the day, week (at WKST), month or year. */
+  icaltimetype         _period;
+  bool                 _first;  ///< In DTSTART's period.
+  /** The instances in each period: days after the week's start (WEEKLY), or
+  *   days of the month (MONTHLY), in order. Just 0 for DAILY & YEARLY. */
+  int                  _offsets[31];
+  int                  _noffsets;
+  int                  _index;   ///< Next offset in the current period.
+  int                  _emitted; ///< Instances returned so far.
+  bool                 _done;
+
+  /** Set up a generator for 'recur', if it has one of our shapes. */
+  bool _compile(const icalrecurrencetype& recur);
+  /** Move _period on by INTERVAL periods. */
+  void _next_period(void);
+
+  RecurIterator(const RecurIterator&); // Not copyable
+  RecurIterator& operator=(const RecurIterator&);
+};
+
+
+} } // end namespace calendari::ics
+
+#endif // CALENDARI__ICS__RRULE_H
@@ -15,12 +15,15 @@ Setting::Setting(Calendari& app_)
     _timeout_source_tag(0),
     _auto_refresh_minutes(-1),
     _week_starts(-1),
+    _resident_periods(-1),
     _cal_vpaned_pos_db( app.db->setting("cal_vpaned_pos",150) )
 {
   set_auto_refresh_minutes( app.db->setting("auto_refresh_minutes",10) );
   set_week_starts( app.db->setting("week_starts",1) ); // 1=Monday
   set_view_calendars( app.db->setting("view_calendars",true) );
   set_cal_vpaned_pos( _cal_vpaned_pos_db );
+  set_resident_periods(
+      app.db->setting("resident_periods",Db::RESIDENT_PERIODS) );
 }
 
 
@@ -91,4 +94,17 @@ Setting::set_cal_vpaned_pos(int val)
 }
 
 
+
+void
+Setting::set_resident_periods(int val)
+{
+  if(_resident_periods == val || val < 0)
+      return;
+  std::swap(_resident_periods,val);
+  if(val>=0)
+      app.db->set_setting("resident_periods",_resident_periods);
+  app.db->set_resident_periods(_resident_periods);
+}
+
+
 } // end namespace calendari
@@ -29,6 +29,10 @@ public:
   int cal_vpaned_pos(void) const {return _cal_vpaned_pos;}
   void set_cal_vpaned_pos(int);
 
+  /** View periods either side of the current one kept in memory. */
+  int resident_periods(void) const {return _resident_periods;}
+  void set_resident_periods(int);
+
 private:
   Setting(const Setting&);              ///< Not copyable
   Setting& operator = (const Setting&); ///< Not assignable
@@ -44,6 +48,7 @@ private:
   int  _week_starts;
   bool _view_calendars;
   int  _cal_vpaned_pos;
+  int  _resident_periods;
 
   const int  _cal_vpaned_pos_db;
 };
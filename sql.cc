@@ -1,6 +1,7 @@
 #include "sql.h"
 
 #include <cassert>
+#include <memory>
 
 namespace calendari {
 namespace sql {
@@ -40,4 +41,51 @@ Statement::db(void) const
 }
 
 
+// -- class StatementCache --
+
+StatementCache::StatementCache(sqlite3* db)
+  : _db(db),
+    _prepared(0),
+    _reused(0)
+{
+  assert(db);
+}
+
+
+StatementCache::~StatementCache(void)
+{
+  clear();
+}
+
+
+sqlite3_stmt*
+StatementCache::get(const util::Here& here, const char* zSql)
+{
+  std::map<std::string,Statement*>::iterator s = _stmt.find(zSql);
+  if(s==_stmt.end())
+  {
+    std::auto_ptr<Statement> stmt( new Statement(here,_db,zSql) );
+    s = _stmt.insert(std::make_pair(std::string(zSql),stmt.release())).first;
+    ++_prepared;
+  }
+  else
+  {
+    ::sqlite3_reset(*s->second);
+    ::sqlite3_clear_bindings(*s->second);
+    ++_reused;
+  }
+  return *s->second;
+}
+
+
+void
+StatementCache::clear(void)
+{
+  std::map<std::string,Statement*>::iterator s;
+  for(s=_stmt.begin(); s!=_stmt.end(); ++s)
+      delete s->second;
+  _stmt.clear();
+}
+
+
 } } // end namespace calendari::sql
@@ -5,6 +5,8 @@
 
 #include <cstdio>
 #include <cstdarg>
+#include <cstring>
+#include <map>
 #include <sqlite3.h>
 #include <string>
 
@@ -36,6 +38,26 @@ check_error(const util::Here& here, sqlite3* sdb, int return_code)
   }while(0)
 
 
+/** Milliseconds that a connection waits for another connection's lock. */
+const int BUSY_TIMEOUT = 2000;
+
+
+/** Start a write transaction, unless another connection is already writing,
+*   in which case return FALSE at once. Used by the main thread, which must
+*   not wait for a background import to finish. */
+inline bool
+try_begin(const util::Here& here, sqlite3* sdb)
+{
+  ::sqlite3_busy_timeout(sdb,0);
+  int return_code = ::sqlite3_exec(sdb,"begin immediate",0,0,0);
+  ::sqlite3_busy_timeout(sdb,BUSY_TIMEOUT);
+  if(return_code==SQLITE_BUSY)
+      return false;
+  sql::check_error(here,sdb,return_code);
+  return true;
+}
+
+
 /** Escape single-quote characters for Sqlite strings. */
 inline std::string
 quote(const std::string& s)
@@ -73,6 +95,71 @@ public:
 private:
   sqlite3*      _db;
   sqlite3_stmt* _stmt;
+
+  Statement(const Statement&); // Not copyable
+  Statement& operator=(const Statement&);
+};
+
+
+/** Owns prepared statements, keyed by their SQL text, so that frequently
+ *  executed queries are only compiled once. Use CachedStatement to borrow
+ *  them. */
+class StatementCache
+{
+public:
+  explicit StatementCache(sqlite3* db);
+  ~StatementCache(void);
+
+  /** Returns the statement for 'zSql', preparing it if it's not yet cached.
+   *  The statement is reset, and its bindings are cleared. */
+  sqlite3_stmt* get(const util::Here& here, const char* zSql);
+
+  /** Finalize all statements. Must be called before the database is closed. */
+  void clear(void);
+
+  sqlite3* db(void) const { return _db; }
+  /** Number of statements compiled by sqlite3_prepare_v2(). */
+  long prepared(void) const { return _prepared; }
+  /** Number of times that get() was able to re-use a compiled statement. */
+  long reused(void) const { return _reused; }
+
+private:
+  sqlite3*                          _db;
+  std::map<std::string,Statement*>  _stmt;
+  long                              _prepared;
+  long                              _reused;
+
+  StatementCache(const StatementCache&); // Not copyable
+  StatementCache& operator=(const StatementCache&);
+};
+
+
+/** Scoped handle on a statement in a StatementCache. Behaves like Statement,
+ *  but the statement is reset (not finalized) upon destruction, so that it
+ *  releases its locks and is ready for re-use. */
+class CachedStatement
+{
+public:
+  CachedStatement(
+      const util::Here&  here,
+      StatementCache&    cache,
+      const char*        zSql
+    )
+    : _db(cache.db()), _stmt(cache.get(here,zSql))
+    {}
+  ~CachedStatement(void)
+    { ::sqlite3_reset(_stmt); }
+  operator sqlite3_stmt* (void) const
+    { return _stmt; }
+  sqlite3* db(void) const
+    { return _db; }
+
+private:
+  sqlite3*      _db;
+  sqlite3_stmt* _stmt;
+
+  CachedStatement(const CachedStatement&); // Not copyable
+  CachedStatement& operator=(const CachedStatement&);
 };
 
 
@@ -121,6 +208,94 @@ bind_text(
 }
 
 
+inline void
+bind_blob(
+    const util::Here&  here,
+    sqlite3*           sdb,
+    sqlite3_stmt*      stmt,
+    int                idx,
+    const std::string& b,
+    MemoryStatus       mem = SQLITE_TRANSIENT
+  )
+{
+  int ret;
+  ret= ::sqlite3_bind_blob(stmt,idx,b.data(),b.size(),mem);
+  sql::check_error(here,sdb,ret);
+}
+
+
+/** A typed value for a statement parameter: NULL, integer, text or blob. */
+class Value
+{
+public:
+  Value(void)                 : _type(SQLITE_NULL),    _int(0) {}
+  Value(int v)                : _type(SQLITE_INTEGER), _int(v) {}
+  Value(long v)               : _type(SQLITE_INTEGER), _int(v) {}
+  Value(long long v)          : _type(SQLITE_INTEGER), _int(v) {}
+  Value(const char* v)        : _type(SQLITE_TEXT),    _int(0), _text(v) {}
+  Value(const std::string& v) : _type(SQLITE_TEXT),    _int(0), _text(v) {}
+
+  /** A BLOB value, holding the bytes of 'v'. */
+  static Value blob(const std::string& v)
+    {
+      Value result(v);
+      result._type = SQLITE_BLOB;
+      return result;
+    }
+
+  /** The bytes of a TEXT or BLOB value. */
+  const std::string& text(void) const
+    { return _text; }
+
+  bool operator==(const Value& v) const
+    { return _type==v._type && _int==v._int && _text==v._text; }
+  bool operator!=(const Value& v) const
+    { return !operator==(v); }
+  bool operator<(const Value& v) const
+    {
+      if(_type!=v._type) return _type<v._type;
+      if(_int!=v._int)   return _int<v._int;
+      return _text<v._text;
+    }
+
+  /** Bind this value to parameter 'idx' of 'stmt'. The text is not copied,
+   *  so this object must outlive the statement's next step. */
+  void bind(
+      const util::Here&  here,
+      sqlite3*           sdb,
+      sqlite3_stmt*      stmt,
+      int                idx
+    ) const
+    {
+      sql::check_error(here,sdb,bind(stmt,idx));
+    }
+
+  /** As bind(), but returns SQLite's result code instead of reporting an
+   *  error. */
+  int bind(sqlite3_stmt* stmt, int idx) const
+    {
+      switch(_type)
+      {
+        case SQLITE_INTEGER:
+          return ::sqlite3_bind_int64(stmt,idx,_int);
+        case SQLITE_TEXT:
+          return ::sqlite3_bind_text(
+              stmt,idx,_text.data(),_text.size(),SQLITE_STATIC);
+        case SQLITE_BLOB:
+          return ::sqlite3_bind_blob(
+              stmt,idx,_text.data(),_text.size(),SQLITE_STATIC);
+        default:
+          return ::sqlite3_bind_null(stmt,idx);
+      }
+    }
+
+private:
+  int            _type;
+  sqlite3_int64  _int;
+  std::string    _text;
+};
+
+
 inline void
 step_reset(const util::Here& here, sqlite3* sdb, sqlite3_stmt* stmt)
 {
@@ -207,6 +382,44 @@ query_val(
 }
 
 
+/** Returns TRUE if 'table' has a column called 'column'. Used to upgrade
+*   databases written by older versions. */
+inline bool
+has_column(
+    const util::Here&  here,
+    sqlite3*           sdb,
+    const char*        table,
+    const char*        column
+  )
+{
+  char sql[256];
+  int ret = snprintf(sql,sizeof(sql),"pragma table_info(%s)",table);
+  if(ret >= static_cast<int>(sizeof(sql)))
+      util::error(here,1,0,"SQL too large for buffer."); //??
+  Statement info_stmt(here,sdb,sql);
+  while(true)
+  {
+    int return_code = ::sqlite3_step(info_stmt);
+    if(return_code==SQLITE_ROW)
+    {
+      const unsigned char* name = ::sqlite3_column_text(info_stmt,1);
+      if(name && 0==::strcmp(column,reinterpret_cast<const char*>(name)))
+          return true;
+    }
+    else if(return_code==SQLITE_DONE)
+    {
+      break;
+    }
+    else
+    {
+      sql::error(here,sdb);
+      break;
+    }
+  }
+  return false;
+}
+
+
 } } // end namespace calendari::sql
 
 #endif // CALENDARI__UTIL__SQL_H
@@ -0,0 +1,245 @@
+#include "timeindex.h"
+
+#include "event.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace calendari {
+
+
+void
+TimeIndex::insert(Occurrence* occ)
+{
+  assert(occ);
+  Entry e;
+  e.dtstart = occ->dtstart();
+  e.dtend   = occ->dtend();
+  e.occ     = occ;
+  const bool in_order = (_entry.empty() || !(e < _entry.back()));
+  _entry.push_back(e);
+  if(in_order && _nsorted+1==_entry.size())
+      ++_nsorted;
+  _max_end.clear();
+}
+
+
+void
+TimeIndex::erase(Occurrence* occ, time_t dtstart)
+{
+  Entry key;
+  key.dtstart = dtstart;
+  const std::vector<Entry>::iterator sorted_end = _entry.begin() + _nsorted;
+  std::vector<Entry>::iterator e =
+      std::lower_bound(_entry.begin(),sorted_end,key);
+  for( ; e!=sorted_end && e->dtstart==dtstart; ++e)
+      if(e->occ==occ)
+          break;
+  if(e==sorted_end || e->dtstart!=dtstart)
+  {
+    // Not amongst the sorted entries, so try the ones inserted since.
+    for(e=sorted_end; e!=_entry.end(); ++e)
+        if(e->occ==occ)
+            break;
+    if(e==_entry.end())
+        return;
+  }
+  e->occ = NULL; // Keeps the order; _rebuild() squeezes it out.
+  ++_erased;
+  _max_end.clear();
+}
+
+
+void
+TimeIndex::evict(time_t begin, time_t end, std::vector<Occurrence*>& evicted)
+{
+  const size_t nevicted = evicted.size();
+  size_t nsorted = 0;
+  std::vector<Entry>::iterator out = _entry.begin();
+  for(size_t i=0; i<_entry.size(); ++i)
+  {
+    const Entry& e = _entry[i];
+    if(!e.occ)
+        continue; // Erased
+    if((e.dtend>=begin && e.dtstart<end) || e.occ->pinned())
+    {
+      *out++ = e;
+      if(i<_nsorted)
+          ++nsorted;
+    }
+    else
+    {
+      evicted.push_back(e.occ);
+    }
+  }
+  if(out==_entry.end())
+      return;
+  _entry.erase(out,_entry.end());
+  _nsorted = nsorted;
+  _erased = 0;
+  _max_end.clear();
+  if(evicted.size()==nevicted)
+      return; // Just squeezed out erased entries.
+
+  std::vector< std::pair<time_t,time_t> > kept;
+  for(size_t i=0; i<_covered.size(); ++i)
+  {
+    time_t b = std::max(begin,_covered[i].first);
+    time_t e = std::min(end,_covered[i].second);
+    if(b<e)
+        kept.push_back(std::make_pair(b,e));
+  }
+  _covered.swap(kept);
+}
+
+
+void
+TimeIndex::clear(void)
+{
+  _entry.clear();
+  _max_end.clear();
+  _nsorted = 0;
+  _erased = 0;
+  _covered.clear();
+}
+
+
+void
+TimeIndex::find(
+    time_t                              begin,
+    time_t                              end,
+    std::multimap<time_t,Occurrence*>&  result
+  )
+{
+  if(_max_end.empty())
+      _rebuild();
+  if(_entry.empty())
+      return;
+  // Only entries before 'limit' start before 'end'.
+  Entry key;
+  key.dtstart = end;
+  size_t limit =
+      std::lower_bound(_entry.begin(),_entry.end(),key) - _entry.begin();
+  if(limit)
+      _report(1,0,_entry.size(),limit,begin,result);
+}
+
+
+void
+TimeIndex::cover(time_t begin, time_t end)
+{
+  if(begin>=end)
+      return;
+  // Merge [begin,end) with any periods that it overlaps or touches.
+  std::vector< std::pair<time_t,time_t> > merged;
+  merged.reserve(_covered.size()+1);
+  bool placed = false;
+  for(size_t i=0; i<_covered.size(); ++i)
+  {
+    const std::pair<time_t,time_t>& c = _covered[i];
+    if(c.second < begin)
+    {
+      merged.push_back(c);
+    }
+    else if(end < c.first)
+    {
+      if(!placed)
+          merged.push_back(std::make_pair(begin,end));
+      placed = true;
+      merged.push_back(c);
+    }
+    else
+    {
+      begin = std::min(begin,c.first);
+      end   = std::max(end,c.second);
+    }
+  }
+  if(!placed)
+      merged.push_back(std::make_pair(begin,end));
+  _covered.swap(merged);
+}
+
+
+bool
+TimeIndex::covers(time_t begin, time_t end) const
+{
+  for(size_t i=0; i<_covered.size(); ++i)
+      if(_covered[i].first<=begin && end<=_covered[i].second)
+          return true;
+  return false;
+}
+
+
+// -- private --
+
+void
+TimeIndex::_rebuild(void)
+{
+  if(_erased)
+  {
+    // Squeeze out the erased entries, keeping the order.
+    size_t nsorted = 0;
+    std::vector<Entry>::iterator out = _entry.begin();
+    for(size_t i=0; i<_entry.size(); ++i)
+    {
+      if(!_entry[i].occ)
+          continue;
+      *out++ = _entry[i];
+      if(i<_nsorted)
+          ++nsorted;
+    }
+    _entry.erase(out,_entry.end());
+    _nsorted = nsorted;
+    _erased = 0;
+  }
+  if(_nsorted<_entry.size())
+  {
+    // Sort the new entries, and merge them in.
+    const std::vector<Entry>::iterator mid = _entry.begin() + _nsorted;
+    std::stable_sort(mid,_entry.end());
+    std::inplace_merge(_entry.begin(),mid,_entry.end());
+    _nsorted = _entry.size();
+  }
+  if(_entry.empty())
+      return;
+  _max_end.assign(4*_entry.size(),0);
+  _build(1,0,_entry.size());
+}
+
+
+time_t
+TimeIndex::_build(size_t node, size_t lo, size_t hi)
+{
+  if(hi-lo==1)
+      return _max_end[node] = _entry[lo].dtend;
+  size_t mid = (lo+hi)/2;
+  time_t l = _build(2*node,  lo,mid);
+  time_t r = _build(2*node+1,mid,hi);
+  return _max_end[node] = std::max(l,r);
+}
+
+
+void
+TimeIndex::_report(
+    size_t                              node,
+    size_t                              lo,
+    size_t                              hi,
+    size_t                              limit,
+    time_t                              begin,
+    std::multimap<time_t,Occurrence*>&  result
+  ) const
+{
+  if(lo>=limit || _max_end[node]<begin)
+      return;
+  if(hi-lo==1)
+  {
+    result.insert(std::make_pair(_entry[lo].dtstart,_entry[lo].occ));
+    return;
+  }
+  size_t mid = (lo+hi)/2;
+  _report(2*node,  lo,mid,limit,begin,result);
+  _report(2*node+1,mid,hi,limit,begin,result);
+}
+
+
+} // end namespace calendari
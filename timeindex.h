@@ -0,0 +1,96 @@
+#ifndef CALENDARI__TIMEINDEX_H
+#define CALENDARI__TIMEINDEX_H 1
+
+#include <map>
+#include <time.h>
+#include <utility>
+#include <vector>
+
+namespace calendari {
+
+class Occurrence;
+
+
+/** In-memory index of occurrences by time. Finds the occurrences that
+*   overlap a period in O(log n + k).
+*
+*   Entries are held in an array sorted by DTSTART, augmented with a segment
+*   tree of the maximum DTEND under each node. Changes just mark the index
+*   as dirty: new entries are appended, and erased ones are only emptied.
+*   On the next find() the empty entries are squeezed out, the new ones are
+*   merged in and the tree is rebuilt. So erasing k occurrences takes
+*   O(k log n), not O(k n).
+*
+*   The index also records which periods have been completely loaded from the
+*   database, so that Db::find() knows when it can trust the index alone. */
+class TimeIndex
+{
+public:
+  TimeIndex(void): _nsorted(0), _erased(0) {}
+
+  void insert(Occurrence* occ);
+  /** Remove 'occ', which was indexed with the given start time. Searches
+  *   any entries inserted since the last find() one by one. */
+  void erase(Occurrence* occ, time_t dtstart);
+  void clear(void);
+  size_t size(void) const { return _entry.size() - _erased; }
+  /** Memory held by the index's arrays. */
+  size_t bytes(void) const
+    {
+      return _entry.capacity()*sizeof(Entry) +
+             _max_end.capacity()*sizeof(time_t);
+    }
+
+  /** Remove the occurrences that don't overlap [begin,end), except those
+  *   that are pinned, and append them to 'evicted'. Coverage is cut back to
+  *   [begin,end), since the index no longer holds everything outside it. */
+  void evict(time_t begin, time_t end, std::vector<Occurrence*>& evicted);
+
+  /** Add the occurrences that overlap [begin,end) to 'result'. Matches the
+  *   test that Db::find() uses: DTEND>=begin and DTSTART<end. */
+  void find(
+      time_t                              begin,
+      time_t                              end,
+      std::multimap<time_t,Occurrence*>&  result
+    );
+
+  /** Record that every occurrence in [begin,end) is now in the index. */
+  void cover(time_t begin, time_t end);
+  /** TRUE if every occurrence in [begin,end) is known to be in the index. */
+  bool covers(time_t begin, time_t end) const;
+  /** Forget all coverage, e.g. when the database has changed underneath. */
+  void uncover(void) { _covered.clear(); }
+
+private:
+  struct Entry
+  {
+    time_t       dtstart;
+    time_t       dtend;
+    Occurrence*  occ;
+    bool operator<(const Entry& e) const { return dtstart<e.dtstart; }
+  };
+
+  /** Entries; 'occ' is NULL in those that have been erased. */
+  std::vector<Entry>   _entry;
+  std::vector<time_t>  _max_end; ///< Segment tree over _entry; empty if stale.
+  size_t               _nsorted; ///< Length of _entry's sorted prefix.
+  size_t               _erased;  ///< Number of erased entries.
+  /** Disjoint, ordered periods [first,second) that are fully indexed. */
+  std::vector< std::pair<time_t,time_t> >  _covered;
+
+  void _rebuild(void);
+  time_t _build(size_t node, size_t lo, size_t hi);
+  void _report(
+      size_t                              node,
+      size_t                              lo,
+      size_t                              hi,
+      size_t                              limit,
+      time_t                              begin,
+      std::multimap<time_t,Occurrence*>&  result
+    ) const;
+};
+
+
+} // end namespace calendari
+
+#endif // CALENDARI__TIMEINDEX_H
@@ -0,0 +1,488 @@
+#include "tz.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <glib.h>
+#include <map>
+
+namespace calendari {
+
+namespace {
+
+/** Guards the zone cache. */
+GStaticMutex  zone_mutex = G_STATIC_MUTEX_INIT;
+/** Guards the local zone. */
+GStaticMutex  local_mutex = G_STATIC_MUTEX_INIT;
+
+const char* const TZDIR_DEFAULT = "/usr/share/zoneinfo";
+const long SECS_PER_DAY = 86400;
+
+
+long long floor_div(long long a, long long b)
+{
+  return( a>=0? a/b: -((-a+b-1)/b) );
+}
+
+
+bool is_leap(long long y)
+{
+  return( y%4==0 && (y%100!=0 || y%400==0) );
+}
+
+
+/** Days from 1970-01-01 to y-m-d, in the proleptic Gregorian calendar. */
+long long days_from_civil(long long y, int m, int d)
+{
+  y -= (m<=2);
+  const long long era = floor_div(y,400);
+  const long long yoe = y - era*400;
+  const long long doy = (153*(m + (m>2? -3: 9)) + 2)/5 + d-1;
+  const long long doe = yoe*365 + yoe/4 - yoe/100 + doy;
+  return era*146097 + doe - 719468;
+}
+
+
+/** The inverse of days_from_civil(). */
+void civil_from_days(long long z, long long& y, int& m, int& d)
+{
+  z += 719468;
+  const long long era = floor_div(z,146097);
+  const long long doe = z - era*146097;
+  const long long yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+  const long long doy = doe - (365*yoe + yoe/4 - yoe/100);
+  const long long mp  = (5*doy + 2)/153;
+  d = static_cast<int>(doy - (153*mp+2)/5 + 1);
+  m = static_cast<int>(mp<10? mp+3: mp-9);
+  y = yoe + era*400 + (m<=2);
+}
+
+
+long long read_be(const unsigned char* p, int n)
+{
+  unsigned long long v = 0;
+  for(int i=0; i<n; ++i)
+      v = (v << 8) | p[i];
+  if(n<8 && (v >> (8*n-1)))
+      v |= ~0ULL << (8*n); // Sign extend.
+  return static_cast<long long>(v);
+}
+
+
+bool read_file(const std::string& path, std::string& data)
+{
+  FILE* f = ::fopen(path.c_str(),"rb");
+  if(!f)
+      return false;
+  char buf[8192];
+  size_t n;
+  while((n = ::fread(buf,1,sizeof(buf),f)) > 0)
+      data.append(buf,n);
+  ::fclose(f);
+  return true;
+}
+
+
+/** Parse a TZ name: alphabetic, or quoted in <angle brackets>. */
+const char* parse_name(const char* s)
+{
+  if(*s=='<')
+  {
+    const char* e = ::strchr(s,'>');
+    return( e? e+1: NULL );
+  }
+  const char* b = s;
+  while(::isalpha(static_cast<unsigned char>(*s)))
+      ++s;
+  return( s>b? s: NULL );
+}
+
+
+/** Parse [+|-]hh[:mm[:ss]] into seconds. */
+const char* parse_hms(const char* s, long& secs)
+{
+  int sign = 1;
+  if(*s=='+' || *s=='-')
+      sign = (*s++=='-'? -1: 1);
+  if(!::isdigit(static_cast<unsigned char>(*s)))
+      return NULL;
+  long part[3] = {0,0,0};
+  for(int i=0; i<3; ++i)
+  {
+    char* e;
+    part[i] = ::strtol(s,&e,10);
+    s = e;
+    if(*s!=':' || i==2)
+        break;
+    ++s;
+  }
+  secs = sign * (part[0]*3600 + part[1]*60 + part[2]);
+  return s;
+}
+
+} // end anonymous namespace
+
+
+const TimeZone*
+TimeZone::find(const char* tzid)
+{
+  if(!tzid || !tzid[0])
+      return NULL;
+  static std::map<std::string,TimeZone*> zones; // NULL if not found.
+  const std::string key(tzid);
+
+  g_static_mutex_lock(&zone_mutex);
+  std::map<std::string,TimeZone*>::iterator z = zones.find(key);
+  if(z!=zones.end())
+  {
+    TimeZone* zone = z->second;
+    g_static_mutex_unlock(&zone_mutex);
+    return zone;
+  }
+
+  const char* dir = ::getenv("TZDIR");
+  if(!dir || !dir[0])
+      dir = TZDIR_DEFAULT;
+  TimeZone* zone = new TimeZone(key);
+  // Try the whole name, and then without each leading path component in
+  // turn, so that "/softwarestudio.org/Tzfile/Europe/London" is found too.
+  bool ok = false;
+  for(std::string::size_type pos=0; !ok; ++pos)
+  {
+    std::string name = key.substr(pos);
+    if(!name.empty() && name.find("..")==std::string::npos)
+        ok = zone->_load(std::string(dir) + "/" + name);
+    pos = key.find('/',pos);
+    if(pos==std::string::npos)
+        break;
+  }
+  if(!ok)
+  {
+    delete zone;
+    zone = NULL;
+  }
+  zones[key] = zone;
+  g_static_mutex_unlock(&zone_mutex);
+  return zone;
+}
+
+
+const TimeZone&
+TimeZone::local(void)
+{
+  static const TimeZone* zone = NULL;
+  g_static_mutex_lock(&local_mutex);
+  if(!zone)
+  {
+    const char* tz = ::getenv("TZ");
+    if(tz && *tz==':')
+        ++tz;
+    if(tz && tz[0]!='/')
+        zone = find(tz);
+    if(!zone)
+    {
+      TimeZone* z = new TimeZone(tz? tz: "localtime");
+      if(z->_load(tz? tz: "/etc/localtime") || (tz && z->_parse_rule(tz)))
+          zone = z;
+      else
+          delete z;
+    }
+    if(!zone)
+        zone = &utc();
+  }
+  const TimeZone* result = zone;
+  g_static_mutex_unlock(&local_mutex);
+  return *result;
+}
+
+
+const TimeZone&
+TimeZone::utc(void)
+{
+  static const TimeZone zone("UTC");
+  return zone;
+}
+
+
+time_t
+TimeZone::to_time(const tm& wall) const
+{
+  // Seconds since the epoch, as if 'wall' were UTC.
+  const long long year = wall.tm_year + 1900LL + floor_div(wall.tm_mon,12);
+  const int mon = static_cast<int>(wall.tm_mon - 12*floor_div(wall.tm_mon,12));
+  const long long lt =
+      (days_from_civil(year,mon+1,1) + wall.tm_mday-1) * SECS_PER_DAY +
+      wall.tm_hour*3600LL + wall.tm_min*60LL + wall.tm_sec;
+
+  // Transitions are far apart, so at most two offsets could apply.
+  const long before = _type(lt - SECS_PER_DAY).utoff;
+  const long after  = _type(lt + SECS_PER_DAY).utoff;
+  const long long t_before = lt - before;
+  const long long t_after  = lt - after;
+  const bool ok_before = (_type(t_before).utoff == before);
+  const bool ok_after  = (_type(t_after).utoff == after);
+  if(ok_before && ok_after)
+      return static_cast<time_t>(std::min(t_before,t_after)); // Repeated.
+  if(ok_after)
+      return static_cast<time_t>(t_after);
+  return static_cast<time_t>(t_before); // Either valid, or skipped.
+}
+
+
+void
+TimeZone::to_tm(time_t t, tm& wall) const
+{
+  const Type& type = _type(t);
+  const long long lt = static_cast<long long>(t) + type.utoff;
+  const long long days = floor_div(lt,SECS_PER_DAY);
+  const long secs = static_cast<long>(lt - days*SECS_PER_DAY);
+  long long year;
+  int mon, mday;
+  civil_from_days(days,year,mon,mday);
+
+  ::memset(&wall,0,sizeof(wall));
+  wall.tm_year  = static_cast<int>(year - 1900);
+  wall.tm_mon   = mon - 1;
+  wall.tm_mday  = mday;
+  wall.tm_hour  = secs / 3600;
+  wall.tm_min   = (secs / 60) % 60;
+  wall.tm_sec   = secs % 60;
+  wall.tm_wday  = static_cast<int>(days - 7*floor_div(days+4,7) + 4);
+  wall.tm_yday  = static_cast<int>(days - days_from_civil(year,1,1));
+  wall.tm_isdst = type.isdst;
+}
+
+
+long
+TimeZone::offset(time_t t) const
+{
+  return _type(t).utoff;
+}
+
+
+// -- private --
+
+TimeZone::TimeZone(const std::string& name_)
+  : name(name_),
+    _rule(false),
+    _rule_dst(false)
+{
+  _initial.utoff = 0;
+  _initial.isdst = false;
+  _std = _dst = _initial;
+}
+
+
+bool
+TimeZone::_load(const std::string& path)
+{
+  std::string data;
+  return read_file(path,data) && _parse(data);
+}
+
+
+bool
+TimeZone::_parse(const std::string& data)
+{
+  // See RFC 8536 for the format.
+  const size_t HEADER = 44;
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data());
+  size_t n = data.size();
+  if(n<HEADER || 0!=::memcmp(p,"TZif",4))
+      return false;
+
+  // Version 2+ files follow the 32-bit data with a 64-bit copy, and a footer.
+  const bool v2 = (p[4]>='2');
+  int tsize = 4;
+  for(int pass=0; ; ++pass)
+  {
+    if(n<HEADER)
+        return false;
+    const long long isutcnt  = read_be(p+20,4);
+    const long long isstdcnt = read_be(p+24,4);
+    const long long leapcnt  = read_be(p+28,4);
+    const long long timecnt  = read_be(p+32,4);
+    const long long typecnt  = read_be(p+36,4);
+    const long long charcnt  = read_be(p+40,4);
+    const long long len = timecnt*tsize + timecnt + typecnt*6 + charcnt +
+        leapcnt*(tsize+4) + isstdcnt + isutcnt;
+    if(typecnt<1 || typecnt>256 || len<0 || HEADER+len>n)
+        return false;
+    if(v2 && pass==0)
+    {
+      p += HEADER+len;
+      n -= HEADER+len;
+      tsize = 8;
+      continue;
+    }
+
+    const unsigned char* d = p + HEADER;
+    _when.resize(timecnt);
+    _index.resize(timecnt);
+    for(long long i=0; i<timecnt; ++i)
+        _when[i] = read_be(d + i*tsize,tsize);
+    d += timecnt*tsize;
+    for(long long i=0; i<timecnt; ++i)
+    {
+      _index[i] = d[i];
+      if(_index[i]>=typecnt)
+          return false;
+    }
+    d += timecnt;
+    _types.resize(typecnt);
+    for(long long i=0; i<typecnt; ++i)
+    {
+      _types[i].utoff = static_cast<long>(read_be(d + i*6,4));
+      _types[i].isdst = d[i*6+4];
+    }
+    _initial = _types[0];
+
+    // The footer holds a TZ rule for times after the last transition.
+    p += HEADER+len;
+    n -= HEADER+len;
+    if(v2 && n>1 && p[0]=='\n')
+    {
+      const char* f = reinterpret_cast<const char*>(p+1);
+      const char* e = static_cast<const char*>(::memchr(f,'\n',n-1));
+      if(e && e>f)
+          _parse_rule(std::string(f,e).c_str());
+    }
+    return true;
+  }
+}
+
+
+bool
+TimeZone::_parse_rule(const char* s)
+{
+  // std offset [dst [offset] [,start[/time],end[/time]]]
+  long off;
+  s = parse_name(s);
+  if(!s || !(s = parse_hms(s,off)))
+      return false;
+  _std.utoff = -off; // POSIX offsets are west of Greenwich.
+  _std.isdst = false;
+  _rule_dst = false;
+  if(*s)
+  {
+    if(!(s = parse_name(s)))
+        return false;
+    _dst.utoff = _std.utoff + 3600;
+    _dst.isdst = true;
+    if(*s && *s!=',')
+    {
+      if(!(s = parse_hms(s,off)))
+          return false;
+      _dst.utoff = -off;
+    }
+    if(!*s)
+        s = ",M3.2.0,M11.1.0"; // The US rules, by default.
+    Change* change[2] = { &_start, &_end };
+    for(int i=0; i<2; ++i)
+    {
+      if(*s++!=',')
+          return false;
+      Change& c = *change[i];
+      char* e;
+      c.week = c.month = 0;
+      if(*s=='J')
+      {
+        c.form = Change::JULIAN;
+        c.day = ::strtol(s+1,&e,10);
+      }
+      else if(*s=='M')
+      {
+        c.form = Change::MONTH;
+        c.month = ::strtol(s+1,&e,10);
+        if(*e=='.')
+            c.week = ::strtol(e+1,&e,10);
+        if(*e=='.')
+            c.day = ::strtol(e+1,&e,10);
+        if(c.month<1 || c.month>12 || c.week<1 || c.week>5)
+            return false;
+      }
+      else
+      {
+        c.form = Change::DAY;
+        c.day = ::strtol(s,&e,10);
+      }
+      if(e==s)
+          return false;
+      s = e;
+      c.time = 7200;
+      if(*s=='/' && !(s = parse_hms(s+1,c.time)))
+          return false;
+    }
+    _rule_dst = true;
+  }
+  if(_when.empty())
+      _initial = _std;
+  _rule = true;
+  return true;
+}
+
+
+const TimeZone::Type&
+TimeZone::_type(long long t) const
+{
+  if(_when.empty() || t<_when.front())
+      return( _when.empty() && _rule? _rule_type(t): _initial );
+  if(t>=_when.back() && _rule)
+      return _rule_type(t);
+  size_t i = std::upper_bound(_when.begin(),_when.end(),t) - _when.begin();
+  return _types[ _index[i-1] ];
+}
+
+
+const TimeZone::Type&
+TimeZone::_rule_type(long long t) const
+{
+  if(!_rule_dst)
+      return _std;
+  long long year;
+  int mon, mday;
+  civil_from_days(floor_div(t+_std.utoff,SECS_PER_DAY),year,mon,mday);
+  const long long start =
+      _change_time(_start,static_cast<int>(year)) - _std.utoff;
+  const long long end =
+      _change_time(_end,static_cast<int>(year)) - _dst.utoff;
+  bool dst;
+  if(start<end)
+      dst = (start<=t && t<end);
+  else
+      dst = !(end<=t && t<start); // Southern hemisphere.
+  return( dst? _dst: _std );
+}
+
+
+long long
+TimeZone::_change_time(const Change& c, int year)
+{
+  long long day = days_from_civil(year,1,1);
+  switch(c.form)
+  {
+  case Change::JULIAN: // 1-365, never counting February 29th.
+      day += c.day - 1 + (is_leap(year) && c.day>=60? 1: 0);
+      break;
+  case Change::DAY:    // 0-365
+      day += c.day;
+      break;
+  case Change::MONTH:  // Day 'day' of week 'week' of month 'month'.
+    {
+      const long long first = days_from_civil(year,c.month,1);
+      const long long next = (c.month==12?
+          days_from_civil(year+1,1,1): days_from_civil(year,c.month+1,1));
+      const int wday = static_cast<int>(first - 7*floor_div(first+4,7) + 4);
+      day = first + (c.day - wday + 7) % 7 + 7*(c.week-1);
+      while(day>=next)
+          day -= 7;
+    }
+    break;
+  }
+  return day*SECS_PER_DAY + c.time;
+}
+
+
+} // end namespace calendari
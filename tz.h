@@ -0,0 +1,100 @@
+#ifndef CALENDARI__TZ_H
+#define CALENDARI__TZ_H 1
+
+#include <string>
+#include <time.h>
+#include <vector>
+
+namespace calendari {
+
+
+/** A timezone, read from the system's compiled zoneinfo (TZif) files.
+*   Converts between time_t and wall-clock time without touching TZ or any
+*   other global state, so conversions are cheap and thread safe.
+*
+*   Zones are loaded once per TZID, and kept for the life of the process:
+*
+*     const TimeZone* zone = TimeZone::find("Europe/London");
+*     time_t t = zone->to_time(wall); */
+class TimeZone
+{
+public:
+  /** The zone called 'tzid', e.g. "America/New_York", or NULL if there is
+  *   no such zone. Prefixes such as "/mozilla.org/20050126_1/" are ignored.
+  *   Thread safe. */
+  static const TimeZone* find(const char* tzid);
+
+  /** The zone that the process runs in: $TZ, or else /etc/localtime. */
+  static const TimeZone& local(void);
+
+  static const TimeZone& utc(void);
+
+  const std::string  name;
+
+  /** Convert wall-clock time to time_t, like mktime() with tm_isdst=-1.
+  *   Out-of-range fields are normalised. A time that is repeated when the
+  *   clocks go back is taken to be the first one. A time that is skipped
+  *   when the clocks go forward is taken in the old offset, so that it
+  *   lands just after the change. */
+  time_t to_time(const tm& wall) const;
+
+  /** Convert 't' to wall-clock time, like localtime_r(). */
+  void to_tm(time_t t, tm& wall) const;
+
+  /** Seconds east of UTC at time 't'. */
+  long offset(time_t t) const;
+
+private:
+  struct Type
+  {
+    long  utoff; ///< Seconds east of UTC.
+    bool  isdst;
+  };
+
+  /** When a POSIX TZ rule switches between standard & daylight time. */
+  struct Change
+  {
+    enum Form { JULIAN, DAY, MONTH } form;
+    int   day;   ///< Jn: 1-365; n: 0-365; Mm.w.d: day of week 0-6.
+    int   week;  ///< Mm.w.d only: 1-5, where 5 means the last.
+    int   month; ///< Mm.w.d only: 1-12.
+    long  time;  ///< Seconds after midnight, local time.
+  };
+
+  std::vector<long long>      _when;  ///< Transition times, ascending.
+  std::vector<unsigned char>  _index; ///< Index into _types after each.
+  std::vector<Type>           _types;
+  Type                        _initial; ///< Before the first transition.
+
+  /** The TZ rule string from the file's footer, which applies after the
+  *   last transition. Has no DST if _rule_dst is FALSE. */
+  bool                        _rule;
+  bool                        _rule_dst;
+  Type                        _std;
+  Type                        _dst;
+  Change                      _start; ///< Change into daylight time.
+  Change                      _end;   ///< Change back to standard time.
+
+  explicit TimeZone(const std::string& name_);
+
+  /** Read TZif data from 'path'. Returns FALSE if it's not a zoneinfo file. */
+  bool _load(const std::string& path);
+  /** Parse the TZif 'data'. */
+  bool _parse(const std::string& data);
+  /** Parse a POSIX TZ rule string, such as "CET-1CEST,M3.5.0,M10.5.0/3". */
+  bool _parse_rule(const char* s);
+  /** The type in effect at 't'. */
+  const Type& _type(long long t) const;
+  /** The type in effect at 't', according to the TZ rule. */
+  const Type& _rule_type(long long t) const;
+  /** Local time of change 'c' in 'year', in seconds since the epoch. */
+  static long long _change_time(const Change& c, int year);
+
+  TimeZone(const TimeZone&); // Not copyable
+  TimeZone& operator=(const TimeZone&);
+};
+
+
+} // end namespace calendari
+
+#endif // CALENDARI__TZ_H
@@ -1,5 +1,6 @@
 #include "util.h"
 
+#include <cstdio>
 #include <cstring>
 #include <errno.h>
 #include <error.h>
@@ -14,6 +15,37 @@
 namespace calendari {
 
 
+bool
+Fingerprint::stat(const char* path)
+{
+  struct stat st;
+  if(0 != ::stat(path,&st))
+      return false;
+  mtime = st.st_mtime;
+  size  = st.st_size;
+  return true;
+}
+
+
+bool
+Fingerprint::hash_file(const char* path)
+{
+  if(!stat(path))
+      return false;
+  FILE* f = ::fopen(path,"r");
+  if(!f)
+      return false;
+  unsigned long long h = FNV1A_BASIS;
+  char buf[65536];
+  size_t n;
+  while((n = ::fread(buf,1,sizeof(buf),f)) > 0)
+      h = fnv1a(h,buf,n);
+  ::fclose(f);
+  hash = h? static_cast<long long>(h): 1;
+  return true;
+}
+
+
 const char* system_timezone(void)
 {
   static std::string tzid = "";
@@ -2,6 +2,7 @@
 #define CALENDARI__UTIL_H 1
 
 #include <cassert>
+#include <cstring>
 #include <gtk/gtk.h>
 #include <time.h>
 #include <string>
@@ -52,6 +53,57 @@ char* uuidp(char* dest, size_t n);
 std::string uuids(void);
 
 
+/** Starting value for fnv1a(h,s,n). */
+const unsigned long long FNV1A_BASIS = 14695981039346656037ULL;
+
+
+/** Continue 64-bit FNV-1a hash 'h' over 'n' bytes at 's'. */
+inline unsigned long long fnv1a(unsigned long long h, const char* s, size_t n)
+{
+  for(const char* end =s+n; s!=end; ++s)
+  {
+    h ^= static_cast<unsigned char>(*s);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+/** 64-bit FNV-1a hash of 'n' bytes at 's'. Never returns zero, so that zero
+*   may stand for 'unknown'. */
+inline long long fnv1a(const char* s, size_t n)
+{
+  unsigned long long h = fnv1a(FNV1A_BASIS,s,n);
+  return h? static_cast<long long>(h): 1;
+}
+
+
+/** 64-bit FNV-1a hash of 's'. */
+inline long long fnv1a(const char* s)
+{
+  return fnv1a(s,::strlen(s));
+}
+
+
+/** Identifies the contents of a file, so that we can tell when it changes. */
+struct Fingerprint
+{
+  Fingerprint(void): mtime(0), size(-1), hash(0) {}
+
+  time_t     mtime;
+  long long  size;
+  long long  hash; ///< fnv1a() of the contents, or zero if not known.
+
+  /** Read the file's mtime & size. Returns FALSE if the file is missing. */
+  bool stat(const char* path);
+  /** As stat(), and then hash the file's contents. */
+  bool hash_file(const char* path);
+  /** TRUE if mtime & size match. */
+  bool same_stat(const Fingerprint& v) const
+    { return mtime && mtime==v.mtime && size==v.size; }
+};
+
+
 /** A general scoped pointer type. */
 template<typename T, void F(T*)>
 class scoped
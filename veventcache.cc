@@ -0,0 +1,103 @@
+#include "veventcache.h"
+
+#include <cassert>
+
+namespace calendari {
+
+
+VeventCache::VeventCache(size_t budget)
+  : _budget(budget),
+    _bytes(0),
+    _hits(0),
+    _misses(0),
+    _evictions(0)
+{}
+
+
+VeventCache::~VeventCache(void)
+{
+  clear();
+}
+
+
+icalcomponent*
+VeventCache::find(const Event* event)
+{
+  std::map<const Event*,EIt>::iterator i = _index.find(event);
+  if(i==_index.end())
+  {
+    ++_misses;
+    return NULL;
+  }
+  ++_hits;
+  _lru.splice(_lru.begin(),_lru,i->second); // Iterators stay valid.
+  return i->second->vevent;
+}
+
+
+void
+VeventCache::insert(const Event* event, icalcomponent* vevent, size_t bytes)
+{
+  assert(vevent);
+  erase(event);
+  Entry e;
+  e.event  = event;
+  e.vevent = vevent;
+  e.bytes  = bytes;
+  _lru.push_front(e);
+  _index[event] = _lru.begin();
+  _bytes += bytes;
+}
+
+
+void
+VeventCache::resize(const Event* event, size_t bytes)
+{
+  std::map<const Event*,EIt>::iterator i = _index.find(event);
+  if(i==_index.end())
+      return;
+  _bytes = _bytes - i->second->bytes + bytes;
+  i->second->bytes = bytes;
+}
+
+
+void
+VeventCache::erase(const Event* event)
+{
+  std::map<const Event*,EIt>::iterator i = _index.find(event);
+  if(i==_index.end())
+      return;
+  _bytes -= i->second->bytes;
+  icalcomponent_free(i->second->vevent);
+  _lru.erase(i->second);
+  _index.erase(i);
+}
+
+
+void
+VeventCache::trim(void)
+{
+  while(_bytes>_budget && _lru.size()>1)
+  {
+    Entry& e = _lru.back();
+    _bytes -= e.bytes;
+    icalcomponent_free(e.vevent);
+    _index.erase(e.event);
+    _lru.pop_back();
+    ++_evictions;
+  }
+}
+
+
+void
+VeventCache::clear(void)
+{
+  for(EIt e=_lru.begin(); e!=_lru.end(); ++e)
+      icalcomponent_free(e->vevent);
+  _lru.clear();
+  _index.clear();
+  _bytes = 0;
+}
+
+
+} // end namespace calendari
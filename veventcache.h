@@ -0,0 +1,74 @@
+#ifndef CALENDARI__VEVENTCACHE_H
+#define CALENDARI__VEVENTCACHE_H 1
+
+#include <libical/ical.h>
+#include <list>
+#include <map>
+
+namespace calendari {
+
+class Event;
+
+
+/** Parsed VEVENT components, for the events whose details have been looked
+*   at most recently. Owns the components. Entries are charged the length of
+*   their iCalendar text, and the least recently used are freed once the
+*   total exceeds the budget.
+*
+*   Components are only valid until the next call to insert() or trim(). */
+class VeventCache
+{
+public:
+  explicit VeventCache(size_t budget);
+  ~VeventCache(void);
+
+  /** The component for 'event', or NULL if it's not cached. */
+  icalcomponent* find(const Event* event);
+
+  /** Take ownership of 'vevent', which is 'bytes' of iCalendar text. */
+  void insert(const Event* event, icalcomponent* vevent, size_t bytes);
+
+  /** 'event's component has changed; it's now 'bytes' long. */
+  void resize(const Event* event, size_t bytes);
+
+  /** Free 'event's component, if it's cached. */
+  void erase(const Event* event);
+
+  /** Free the least recently used components, until the cache is within its
+  *   budget. The most recently used one is always kept. */
+  void trim(void);
+
+  void clear(void);
+
+  size_t size(void) const { return _index.size(); }
+  size_t bytes(void) const { return _bytes; }
+  long hits(void) const { return _hits; }
+  long misses(void) const { return _misses; }
+  long evictions(void) const { return _evictions; }
+
+private:
+  struct Entry
+  {
+    const Event*    event;
+    icalcomponent*  vevent;
+    size_t          bytes;
+  };
+  typedef std::list<Entry>::iterator EIt;
+
+  const size_t                 _budget;
+  /** Most recently used first. */
+  std::list<Entry>             _lru;
+  std::map<const Event*,EIt>   _index;
+  size_t                       _bytes;
+  long                         _hits;
+  long                         _misses;
+  long                         _evictions;
+
+  VeventCache(const VeventCache&); // Not copyable
+  VeventCache& operator=(const VeventCache&);
+};
+
+
+} // end namespace calendari
+
+#endif // CALENDARI__VEVENTCACHE_H
@@ -10,6 +10,11 @@ namespace calendari {
 class Occurrence;
 
 
+/** Number of periods on either side of the current view that are loaded in
+*   the background, ready for the user to move to them. */
+const int PREFETCH_PERIODS = 2;
+
+
 struct Day
 {
   time_t start;
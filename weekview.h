@@ -44,6 +44,13 @@ public:
   virtual void copy_here(Occurrence*);
 private:
   Calendari& cal;
+
+  /** Find the period [begin,end) that is displayed for the week 'offset'
+  *   weeks after the one that contains 't'. */
+  void period(time_t t, int offset, time_t& begin, time_t& end) const;
+  /** Ask for the weeks around 't' to be loaded in the background. */
+  void prefetch(time_t t) const;
+
   // Time
   time_t    now; ///< Current, wall-clock time.
   struct tm self_local; ///< A time somewhere in the current view.
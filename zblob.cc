@@ -0,0 +1,105 @@
+#include "zblob.h"
+
+#include "err.h"
+#include "sql.h"
+
+#include <cstring>
+#include <zlib.h>
+
+namespace calendari {
+
+
+/** Identifies a compressed blob. */
+const char ZBLOB_MAGIC[] = { '\0', 'Z', '1' };
+const size_t ZBLOB_HEADER = sizeof(ZBLOB_MAGIC) + 4;
+
+
+std::string
+zblob_pack(const char* text, size_t n)
+{
+  if(n<ZBLOB_MIN || n>0xFFFFFFFFUL)
+      return std::string(text,n);
+
+  uLongf zlen = ::compressBound(n);
+  std::string result(ZBLOB_HEADER+zlen,'\0');
+  unsigned char* dest = reinterpret_cast<unsigned char*>(&result[0]);
+  for(size_t i=0; i<sizeof(ZBLOB_MAGIC); ++i)
+      dest[i] = ZBLOB_MAGIC[i];
+  for(size_t i=0; i<4; ++i)
+      dest[sizeof(ZBLOB_MAGIC)+i] = (n >> (8*(3-i))) & 0xFF;
+
+  int ret = ::compress2(dest+ZBLOB_HEADER,&zlen,
+      reinterpret_cast<const Bytef*>(text),n,Z_DEFAULT_COMPRESSION);
+  if(ret!=Z_OK || ZBLOB_HEADER+zlen>=n)
+      return std::string(text,n); // Not worth it.
+  result.resize(ZBLOB_HEADER+zlen);
+  return result;
+}
+
+
+bool
+zblob_unpack(const void* data, size_t n, std::string& text)
+{
+  text.clear();
+  const unsigned char* src = static_cast<const unsigned char*>(data);
+  if(!src || n==0)
+      return true;
+  if(n<ZBLOB_HEADER || 0!=::memcmp(src,ZBLOB_MAGIC,sizeof(ZBLOB_MAGIC)))
+  {
+    text.assign(reinterpret_cast<const char*>(src),n);
+    return true;
+  }
+
+  uLongf len = 0;
+  for(size_t i=0; i<4; ++i)
+      len = (len << 8) | src[sizeof(ZBLOB_MAGIC)+i];
+  text.resize(len);
+  uLongf out = len;
+  int ret = ::uncompress(reinterpret_cast<Bytef*>(&text[0]),&out,
+      src+ZBLOB_HEADER,n-ZBLOB_HEADER);
+  if(ret!=Z_OK || out!=len)
+  {
+    CALI_WARN(0,"Failed to decompress VEVENT blob (zlib error %d)",ret);
+    text.clear();
+    return false;
+  }
+  return true;
+}
+
+
+bool
+zblob_column(sqlite3_stmt* stmt, int col, std::string& text)
+{
+  // The pointer must be fetched before the size.
+  const void* data = ::sqlite3_column_blob(stmt,col);
+  int n = ::sqlite3_column_bytes(stmt,col);
+  return zblob_unpack(data,n,text);
+}
+
+
+/** SQL function zblob_pack(X). */
+static void
+zblob_pack_func(sqlite3_context* ctx, int, sqlite3_value** argv)
+{
+  if(::sqlite3_value_type(argv[0])==SQLITE_NULL)
+  {
+    ::sqlite3_result_null(ctx);
+    return;
+  }
+  const char* data = static_cast<const char*>(::sqlite3_value_blob(argv[0]));
+  int n = ::sqlite3_value_bytes(argv[0]);
+  std::string blob = zblob_pack(data,n);
+  ::sqlite3_result_blob(ctx,blob.data(),blob.size(),SQLITE_TRANSIENT);
+}
+
+
+void
+zblob_register(sqlite3* sdb)
+{
+  int ret = ::sqlite3_create_function(sdb,"zblob_pack",1,SQLITE_UTF8,NULL,
+      zblob_pack_func,NULL,NULL);
+  CALI_SQLCHK(sdb,ret);
+}
+
+
+} // end namespace calendari
@@ -0,0 +1,45 @@
+#ifndef CALENDARI__ZBLOB_H
+#define CALENDARI__ZBLOB_H 1
+
+#include <sqlite3.h>
+#include <string>
+
+namespace calendari {
+
+
+/** Text that is shorter than this is stored as it is. Compression doesn't
+*   gain much on short VEVENTs. */
+const size_t ZBLOB_MIN = 256;
+
+
+/** Pack 'n' bytes of 'text' for storage in a BLOB column. Long text is
+*   compressed with zlib, behind a small header:
+*
+*     "\0Z1" + uncompressed length (4 bytes, big-endian) + deflate stream
+*
+*   Short or incompressible text is returned as it is. The header starts with
+*   a NUL, so it can't be mistaken for iCalendar text. */
+std::string zblob_pack(const char* text, size_t n);
+
+inline std::string zblob_pack(const std::string& text)
+  { return zblob_pack(text.data(),text.size()); }
+
+
+/** Unpack 'n' bytes of 'data', as written by zblob_pack(), into 'text'.
+*   Plain text, as stored by older versions, is copied as it is. Returns FALSE
+*   if the data is corrupt, in which case 'text' is left empty. */
+bool zblob_unpack(const void* data, size_t n, std::string& text);
+
+
+/** Unpack column 'col' of the current row of 'stmt'. */
+bool zblob_column(sqlite3_stmt* stmt, int col, std::string& text);
+
+
+/** Register the SQL function zblob_pack(X) with 'sdb'. Used to compress the
+*   VEVENTs of databases written by older versions. */
+void zblob_register(sqlite3* sdb);
+
+
+} // end namespace calendari
+
+#endif // CALENDARI__ZBLOB_H